@@ -16,6 +16,7 @@ skynet.start(function()
 		port = 8888,
 		maxclient = max_client,
 		nodelay = true,
+		gate = 1,	-- more gates listen on the same port with SO_REUSEPORT
 	})
 	skynet.error("Watchdog listen on " .. addr .. ":" .. port)
 	skynet.exit()
@@ -2,18 +2,22 @@ local skynet = require "skynet"
 
 local CMD = {}
 local SOCKET = {}
-local gate
+local gates = {}
 local agent = {}
+local gate_of = {}	-- fd -> the gate accepted it
 
-function SOCKET.open(fd, addr)
+function SOCKET.open(gate, fd, addr)
 	skynet.error("New client from : " .. addr)
+	gate_of[fd] = gate
 	agent[fd] = skynet.newservice("agent")
 	skynet.call(agent[fd], "lua", "start", { gate = gate, client = fd, watchdog = skynet.self() })
 end
 
 local function close_agent(fd)
 	local a = agent[fd]
+	local gate = gate_of[fd]
 	agent[fd] = nil
+	gate_of[fd] = nil
 	if a then
 		skynet.call(gate, "lua", "kick", fd)
 		-- disconnect never return
@@ -21,26 +25,41 @@ local function close_agent(fd)
 	end
 end
 
-function SOCKET.close(fd)
+function SOCKET.close(_, fd)
 	print("socket close",fd)
 	close_agent(fd)
 end
 
-function SOCKET.error(fd, msg)
+function SOCKET.error(_, fd, msg)
 	print("socket error",fd, msg)
 	close_agent(fd)
 end
 
-function SOCKET.warning(fd, size)
+function SOCKET.warning(_, fd, size)
 	-- size K bytes havn't send out in fd
 	print("socket warning", fd, size)
 end
 
-function SOCKET.data(fd, msg)
+function SOCKET.data(_, fd, msg)
 end
 
+-- conf.gate : the number of gates, more than one gate listen on the same port with SO_REUSEPORT,
+-- and the kernel spreads the connections among them.
 function CMD.start(conf)
-	return skynet.call(gate, "lua", "open" , conf)
+	local n = conf.gate or 1
+	if n > 1 then
+		conf.reuseport = true
+	end
+	for i = 1, n do
+		gates[i] = skynet.newservice("gate")
+	end
+	local addr, port = skynet.call(gates[1], "lua", "open" , conf)
+	-- the first gate may pick the port (port 0), the others bind the same one
+	conf.port = port
+	for i = 2, n do
+		skynet.call(gates[i], "lua", "open" , conf)
+	end
+	return addr, port
 end
 
 function CMD.close(fd)
@@ -51,13 +70,11 @@ skynet.start(function()
 	skynet.dispatch("lua", function(session, source, cmd, subcmd, ...)
 		if cmd == "socket" then
 			local f = SOCKET[subcmd]
-			f(...)
+			f(source, ...)
 			-- socket api don't need return
 		else
 			local f = assert(CMD[cmd])
 			skynet.ret(skynet.pack(f(subcmd, ...)))
 		end
 	end)
-
-	gate = skynet.newservice("gate")
 end)
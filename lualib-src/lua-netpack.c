@@ -23,6 +23,7 @@
 #define TYPE_CLOSE 5
 #define TYPE_WARNING 6
 #define TYPE_INIT 7
+#define TYPE_BATCH 8
 
 /*
 	Each package is uint16 + data , uint16 (serialized in big-endian) is the number of bytes comprising the data .
@@ -316,6 +317,32 @@ filter_data(lua_State *L, int fd, uint8_t * buffer, int size) {
 	return ret;
 }
 
+// the buffer of SKYNET_SOCKET_TYPE_FRAME has only whole packets (see skynet_socket_framing), no uncomplete.
+static int
+filter_frame(lua_State *L, int fd, uint8_t * buffer, int size) {
+	int pack_size = read_size(buffer);
+	if (pack_size + 2 == size) {
+		// just one package, give the buffer to the handler
+		memmove(buffer, buffer + 2, pack_size);
+		lua_pushvalue(L, lua_upvalueindex(TYPE_DATA));
+		lua_pushinteger(L, fd);
+		lua_pushlightuserdata(L, buffer);
+		lua_pushinteger(L, pack_size);
+		return 5;
+	}
+	uint8_t * ptr = buffer;
+	while (size > 0) {
+		pack_size = read_size(ptr);
+		push_data(L, fd, ptr + 2, pack_size, 1);
+		ptr += pack_size + 2;
+		size -= pack_size + 2;
+	}
+	assert(size == 0);
+	skynet_free(buffer);
+	lua_pushvalue(L, lua_upvalueindex(TYPE_MORE));
+	return 2;
+}
+
 static void
 pushstring(lua_State *L, const char * msg, int size) {
 	if (msg) {
@@ -325,6 +352,21 @@ pushstring(lua_State *L, const char * msg, int size) {
 	}
 }
 
+// The accepts of the listen socket (recvpool enabled, see gateserver) to a busy gate come in a batch.
+// The connections are not pooled, so there is no data in it.
+static int
+filter_batch(lua_State *L, struct skynet_socket_message *message) {
+	int i, n = message->ud;
+	luaL_checkstack(L, n * 2 + 1, NULL);
+	lua_pushvalue(L, lua_upvalueindex(TYPE_BATCH));
+	for (i=1;i<=n;i++) {
+		assert(message[i].type == SKYNET_SOCKET_TYPE_ACCEPT);
+		lua_pushinteger(L, message[i].ud);
+		lua_pushstring(L, message[i].buffer);
+	}
+	return 2 + n * 2;
+}
+
 /*
 	userdata queue
 	lightuserdata msg
@@ -354,6 +396,8 @@ lfilter(lua_State *L) {
 		// ignore listen id (message->id)
 		assert(size == -1);	// never padding string
 		return filter_data(L, message->id, (uint8_t *)buffer, message->ud);
+	case SKYNET_SOCKET_TYPE_FRAME:
+		return filter_frame(L, message->id, (uint8_t *)buffer, message->ud);
 	case SKYNET_SOCKET_TYPE_CONNECT:
 		lua_pushvalue(L, lua_upvalueindex(TYPE_INIT));
 		lua_pushinteger(L, message->id);
@@ -384,6 +428,8 @@ lfilter(lua_State *L) {
 		lua_pushinteger(L, message->id);
 		lua_pushinteger(L, message->ud);
 		return 4;
+	case SKYNET_SOCKET_TYPE_BATCH:
+		return filter_batch(L, message);
 	default:
 		// never get here
 		return 1;
@@ -488,8 +534,9 @@ luaopen_skynet_netpack(lua_State *L) {
 	lua_pushliteral(L, "close");
 	lua_pushliteral(L, "warning");
 	lua_pushliteral(L, "init");
+	lua_pushliteral(L, "batch");
 
-	lua_pushcclosure(L, lfilter, 7);
+	lua_pushcclosure(L, lfilter, 8);
 	lua_setfield(L, -2, "filter");
 
 	return 1;
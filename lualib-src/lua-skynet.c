@@ -473,6 +473,51 @@ ltrash(lua_State *L) {
 	return 0;
 }
 
+struct name_list {
+	int n;
+	int cap;
+	char **name;
+	uint32_t *handle;
+};
+
+// called with the handle lock held, so collect the names first and don't touch lua_State
+static void
+collect_name(void *ud, const char *name, uint32_t handle) {
+	struct name_list *l = ud;
+	if (l->n >= l->cap) {
+		l->cap = l->cap ? l->cap * 2 : 16;
+		l->name = skynet_realloc(l->name, l->cap * sizeof(char *));
+		l->handle = skynet_realloc(l->handle, l->cap * sizeof(uint32_t));
+	}
+	l->name[l->n] = skynet_strdup(name);
+	l->handle[l->n] = handle;
+	++l->n;
+}
+
+// return { { name, handle }, ... } sorted by name
+static int
+lnames(lua_State *L) {
+	struct name_list l = { 0, 0, NULL, NULL };
+	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
+	skynet_namelist(context, collect_name, &l);
+	int i;
+	lua_createtable(L, l.n, 0);
+	for (i=0;i<l.n;i++) {
+		lua_createtable(L, 2, 0);
+		lua_pushstring(L, l.name[i]);
+		lua_rawseti(L, -2, 1);
+		lua_pushinteger(L, l.handle[i]);
+		lua_rawseti(L, -2, 2);
+		lua_rawseti(L, -2, i+1);
+	}
+	for (i=0;i<l.n;i++) {
+		skynet_free(l.name[i]);
+	}
+	skynet_free(l.name);
+	skynet_free(l.handle);
+	return 1;
+}
+
 static int
 lnow(lua_State *L) {
 	uint64_t ti = skynet_now();
@@ -579,6 +624,7 @@ luaopen_skynet_core(lua_State *L) {
 		{ "harbor", lharbor },
 		{ "callback", lcallback },
 		{ "trace", ltrace },
+		{ "names", lnames },
 		{ NULL, NULL },
 	};
 
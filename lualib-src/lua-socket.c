@@ -48,7 +48,7 @@ lfreepool(lua_State *L) {
 	for (i=0;i<sz;i++) {
 		struct buffer_node *node = &pool[i];
 		if (node->msg) {
-			skynet_free(node->msg);
+			skynet_socket_free_buffer(node->msg);
 			node->msg = NULL;
 		}
 	}
@@ -168,7 +168,7 @@ return_free_node(lua_State *L, int pool, struct socket_buffer *sb) {
 	lua_rawgeti(L,pool,1);
 	free_node->next = lua_touserdata(L,-1);
 	lua_pop(L,1);
-	skynet_free(free_node->msg);
+	skynet_socket_free_buffer(free_node->msg);
 	free_node->msg = NULL;
 
 	free_node->sz = 0;
@@ -305,7 +305,7 @@ static int
 ldrop(lua_State *L) {
 	void * msg = lua_touserdata(L,1);
 	luaL_checkinteger(L,2);
-	skynet_free(msg);
+	skynet_socket_free_buffer(msg);
 	return 0;
 }
 
@@ -390,6 +390,7 @@ lstr2p(lua_State *L) {
 	integer size
 
 	return type n1 n2 ptr_or_string
+	or type 0 n (type id ud ptr_or_string) * n for SKYNET_SOCKET_TYPE_BATCH
 */
 static int
 lunpack(lua_State *L) {
@@ -399,6 +400,23 @@ lunpack(lua_State *L) {
 	lua_pushinteger(L, message->type);
 	lua_pushinteger(L, message->id);
 	lua_pushinteger(L, message->ud);
+	if (message->type == SKYNET_SOCKET_TYPE_BATCH) {
+		// unpack them all here, the batch is freed after the dispatch which may yield
+		int i, n = message->ud;
+		luaL_checkstack(L, n * 4, NULL);
+		for (i=1;i<=n;i++) {
+			lua_pushinteger(L, message[i].type);
+			lua_pushinteger(L, message[i].id);
+			lua_pushinteger(L, message[i].ud);
+			if (message[i].type == SKYNET_SOCKET_TYPE_ACCEPT) {
+				// the address
+				lua_pushstring(L, message[i].buffer);
+			} else {
+				lua_pushlightuserdata(L, message[i].buffer);
+			}
+		}
+		return 3 + n * 4;
+	}
 	if (message->buffer == NULL) {
 		lua_pushlstring(L, (char *)(message+1),size - sizeof(*message));
 	} else {
@@ -492,8 +510,11 @@ llisten(lua_State *L) {
 	int port = luaL_checkinteger(L,2);
 	// 可能是空
 	int backlog = luaL_optinteger(L,3,BACKLOG);
+	// SO_REUSEPORT, other services may listen on the same port too
+	int reuseport = lua_toboolean(L,4);
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
-	int id = skynet_socket_listen(ctx, host,port,backlog);
+	int id = reuseport ? skynet_socket_listen_reuseport(ctx, host, port, backlog)
+		: skynet_socket_listen(ctx, host,port,backlog);
 	if (id < 0) {
 		return luaL_error(L, "Listen error");
 	}
@@ -640,6 +661,40 @@ lnodelay(lua_State *L) {
 	return 0;
 }
 
+static int
+lrecvpool(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	int enable = lua_isnoneornil(L, 2) ? 1 : lua_toboolean(L, 2);
+	skynet_socket_recvpool(ctx, id, enable);
+	return 0;
+}
+
+// watermark(id, high, low), low is high / 2 by default. high = 0 disables it.
+static int
+lwatermark(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	int high = luaL_checkinteger(L, 2);
+	int low = luaL_optinteger(L, 3, high / 2);
+	skynet_socket_watermark(ctx, id, high, low);
+	return 0;
+}
+
+// framing(id, header, max), header is 2 or 4 (0 disables it), max is 0 by default (the most of the header).
+static int
+lframing(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	int header = luaL_checkinteger(L, 2);
+	int max = luaL_optinteger(L, 3, 0);
+	if (header != 0 && header != 2 && header != 4) {
+		return luaL_error(L, "Invalid frame header size %d", header);
+	}
+	skynet_socket_framing(ctx, id, header, max);
+	return 0;
+}
+
 static int
 ludp(lua_State *L) {
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
@@ -801,6 +856,8 @@ getinfo(lua_State *L, struct socket_info *si) {
 	lua_setfield(L, -2, "read");
 	lua_pushinteger(L, si->write);
 	lua_setfield(L, -2, "write");
+	lua_pushinteger(L, si->wcall);
+	lua_setfield(L, -2, "wcall");
 	lua_pushinteger(L, si->wbuffer);
 	lua_setfield(L, -2, "wbuffer");
 	lua_pushinteger(L, si->rtime);
@@ -890,6 +947,9 @@ luaopen_skynet_socketdriver(lua_State *L) {
 		{ "start", lstart },
 		{ "pause", lpause },
 		{ "nodelay", lnodelay },
+		{ "recvpool", lrecvpool },
+		{ "watermark", lwatermark },
+		{ "framing", lframing },
 		{ "udp", ludp },
 		{ "udp_connect", ludp_connect },
 		{ "udp_dial", ludp_dial},
@@ -135,8 +135,8 @@ do ---- avoid session rewind conflict
 		return session
 	end
 
-	local function auxtimeout_checkconflict(timeout)
-		local session = cintcommand("TIMEOUT", timeout)
+	local function auxtimeout_checkconflict(timeout, cmd)
+		local session = cintcommand(cmd or "TIMEOUT", timeout)
 		checkconflict(session)
 		return session
 	end
@@ -156,8 +156,8 @@ do ---- avoid session rewind conflict
 		return session
 	end
 
-	local function auxtimeout_checkrewind(timeout)
-		local session = cintcommand("TIMEOUT", timeout)
+	local function auxtimeout_checkrewind(timeout, cmd)
+		local session = cintcommand(cmd or "TIMEOUT", timeout)
 		if session and session > dangerzone_low and session <= dangerzone_up then
 			-- enter dangerzone
 			set_checkconflict(session)
@@ -191,6 +191,15 @@ do ---- avoid session rewind conflict
 	set_checkrewind()
 end
 
+-- cancel the timer of session, or ignore the response when it comes
+local function break_session(session)
+	if c.intcommand("TIMERCANCEL", session) == 1 then
+		session_id_coroutine[session] = nil
+	else
+		session_id_coroutine[session] = "BREAK"
+	end
+end
+
 do ---- request/select
 	local function send_requests(self)
 		local sessions = {}
@@ -299,7 +308,7 @@ do ---- request/select
 			self._request = 0
 		end
 		if self._timeout then
-			session_id_coroutine[self._timeout] = "BREAK"
+			break_session(self._timeout)
 			self._timeout = nil
 		end
 	end
@@ -426,7 +435,7 @@ local function dispatch_wakeup()
 				local co = session_id_coroutine[session]
 				local tag = session_coroutine_tracetag[co]
 				if tag then c.trace(tag, "resume") end
-				session_id_coroutine[session] = "BREAK"
+				break_session(session)
 				return suspend(co, coroutine_resume(co, false, "BREAK", nil, session))
 			end
 		else
@@ -508,6 +517,16 @@ function skynet.timeout(ti, func)
 	return co	-- for debug
 end
 
+-- ti is in millisecond, the precision depends on timer_tick in config (10ms by default)
+function skynet.timeout_ms(ti, func)
+	local session = auxtimeout(ti, "TIMEOUTMS")
+	assert(session)
+	local co = co_create_for_timeout(func, ti)
+	assert(session_id_coroutine[session] == nil)
+	session_id_coroutine[session] = co
+	return co	-- for debug
+end
+
 local function suspend_sleep(session, token)
 	local tag = session_coroutine_tracetag[running_thread]
 	if tag then c.trace(tag, "sleep", 2) end
@@ -908,22 +927,48 @@ local trace_source = {}
 -- 这个raw是什么意思
 -- 本来的dispatch_message
 -- 这里的session，就是请求方地址
+local function dispatch_response(msg, sz, session, source)
+	local co = session_id_coroutine[session]
+	if co == "BREAK" then
+		session_id_coroutine[session] = nil
+	elseif co == nil then
+		unknown_response(session, source, msg, sz)
+	else
+		local tag = session_coroutine_tracetag[co]
+		if tag then c.trace(tag, "resume") end
+		session_id_coroutine[session] = nil
+
+		-- coroutine_resume 恢复等待消息的task
+		suspend(co, coroutine_resume(co, true, msg, sz, session))
+	end
+end
+
 local function raw_dispatch_message(prototype, msg, sz, session, source)
 	-- skynet.PTYPE_RESPONSE = 1, read skynet.h
 	-- prototype 为1，说明是返回
 	if prototype == 1 then
-		local co = session_id_coroutine[session]
-		if co == "BREAK" then
-			session_id_coroutine[session] = nil
-		elseif co == nil then
-			unknown_response(session, source, msg, sz)
+		if session == 0 and source == 0 then
+			-- timeouts expired at the same tick, see TIMERBATCH
+			local sessions = c.tostring(msg, sz)
+			local pos = 1
+			local err
+			while pos <= sz do
+				session, pos = string.unpack("i", sessions, pos)
+				-- an error in one callback must not drop the rest of the batch
+				local ok, e = pcall(dispatch_response, nil, 0, session, 0)
+				if not ok then
+					if err then
+						err = err .. "\n" .. tostring(e)
+					else
+						err = tostring(e)
+					end
+				end
+			end
+			if err then
+				error(err)
+			end
 		else
-			local tag = session_coroutine_tracetag[co]
-			if tag then c.trace(tag, "resume") end
-			session_id_coroutine[session] = nil
-
-			-- coroutine_resume 恢复等待消息的task
-			suspend(co, coroutine_resume(co, true, msg, sz, session))
+			dispatch_response(msg, sz, session, source)
 		end
 	else
 		local p = proto[prototype]   -- 找到与消息类型对应的解析协议
@@ -1106,6 +1151,7 @@ function skynet.start(start_func)
 
 	-- 这个是什么
 	c.callback(skynet.dispatch_message)
+	c.intcommand("TIMERBATCH", 1)
 	init_thread = skynet.timeout(0, function()
 		skynet.init_service(start_func)
 		init_thread = nil
@@ -1124,6 +1170,14 @@ function skynet.stat(what)
 	return c.intcommand("STAT", what)
 end
 
+-- high priority services are scheduled before normal ones, returns whether current service is high priority
+function skynet.priority(high)
+	if high == nil then
+		return c.intcommand("PRIORITY") == 1
+	end
+	return c.intcommand("PRIORITY", high and 1 or 0) == 1
+end
+
 local function task_traceback(co)
 	if co == "BREAK" then
 		return co
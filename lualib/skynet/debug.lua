@@ -41,6 +41,8 @@ local function init(skynet, export)
 			stat.mqlen = skynet.stat "mqlen"
 			stat.cpu = skynet.stat "cpu"
 			stat.message = skynet.stat "message"
+			stat.msgcost = skynet.stat "msgcost"	-- cpu microsec per message, cpu is in second
+			stat.quota = skynet.stat "quota"
 			skynet.ret(skynet.pack(stat))
 		end
 
@@ -18,6 +18,7 @@ local socket_pool = setmetatable( -- store all socket object
 
 local socket_onclose = {}
 local socket_message = {}
+local batching = false	-- in a batch of data messages, pause_socket yields after the batch to keep the order
 
 
 -- 这个s是什么
@@ -40,9 +41,24 @@ local function pause_socket(s, size)
 	end
 	driver.pause(s.id)
 	s.pause = true
+	if batching then
+		batching = "yield"
+		return
+	end
 	skynet.yield()	-- there are subsequent socket messages in mqueue, maybe.
 end
 
+-- wakeup the coroutines in socket.wait_writable
+local function wakeup_writable(s)
+	local w = s.writable
+	if w then
+		s.writable = nil
+		for _, co in ipairs(w) do
+			skynet.wakeup(co)
+		end
+	end
+end
+
 local function suspend(s)
 	assert(not s.co)
 	s.co = coroutine.running()
@@ -129,6 +145,7 @@ socket_message[3] = function(id)
 	if s then
 		s.connected = false
 		wakeup(s)
+		wakeup_writable(s)
 	else
 		driver.close(id)
 	end
@@ -140,8 +157,7 @@ socket_message[3] = function(id)
 	end
 end
 
--- SKYNET_SOCKET_TYPE_ACCEPT = 4
-socket_message[4] = function(id, newid, addr)
+local function accept(id, newid, addr)
 	local s = socket_pool[id]
 	if s == nil then
 		driver.close(newid)
@@ -150,6 +166,12 @@ socket_message[4] = function(id, newid, addr)
 	s.callback(newid, addr)
 end
 
+-- SKYNET_SOCKET_TYPE_ACCEPT = 4
+-- The callback may yield (socket.start), it runs in its own coroutine, alone or in a batch (see below).
+socket_message[4] = function(id, newid, addr)
+	skynet.fork(accept, id, newid, addr)
+end
+
 -- SKYNET_SOCKET_TYPE_ERROR = 5
 socket_message[5] = function(id, _, err)
 	local s = socket_pool[id]
@@ -171,6 +193,7 @@ socket_message[5] = function(id, _, err)
 	driver.shutdown(id)
 
 	wakeup(s)
+	wakeup_writable(s)
 end
 
 -- SKYNET_SOCKET_TYPE_UDP = 6
@@ -203,6 +226,37 @@ socket_message[7] = function(id, size)
 	end
 end
 
+-- SKYNET_SOCKET_TYPE_FRAME = 10, whole packets of a framed socket (see socket.framing), they're bytes as DATA here
+socket_message[10] = socket_message[1]
+
+-- SKYNET_SOCKET_TYPE_WATERMARK = 9, see socket.watermark
+socket_message[9] = function(id, blocked)
+	local s = socket_pool[id]
+	if s == nil then
+		return
+	end
+	if blocked == 1 then
+		s.blocked = true
+	else
+		s.blocked = nil
+		wakeup_writable(s)
+	end
+end
+
+-- SKYNET_SOCKET_TYPE_BATCH = 8, the data and accept messages to this service (busy) from the pooled sockets
+socket_message[8] = function(_, n, ...)
+	local batch = { ... }	-- type, id, ud, data of each message (DATA or ACCEPT)
+	batching = true
+	for i = 1, n * 4, 4 do
+		socket_message[batch[i]](batch[i+1], batch[i+2], batch[i+3])
+	end
+	local yield = batching == "yield"
+	batching = false
+	if yield then
+		skynet.yield()
+	end
+end
+
 skynet.register_protocol {
 	name = "socket",
 	id = skynet.PTYPE_SOCKET,	-- PTYPE_SOCKET = 6
@@ -213,10 +267,17 @@ skynet.register_protocol {
 }
 
 local function connect(id, func)
+	if id < 0 then
+		-- no free slot (max_socket in config)
+		return nil, "socket slots exhausted"
+	end
 	local newbuffer
 	if func == nil then
 		newbuffer = driver.buffer()
 	end
+	-- the buffer nodes release the data by driver, so the data can be the pooled blocks,
+	-- and the accepts of a listen socket (func) may come in batch
+	driver.recvpool(id)
 	--- @class s
 	local s = {
 		id = id,
@@ -292,6 +353,7 @@ function socket.close(id)
 		return
 	end
 	driver.close(id)
+	wakeup_writable(s)
 	if s.connected then
 		s.pause = false -- Do not resume this fd if it paused.
 		if s.co then
@@ -412,12 +474,13 @@ function socket.disconnected(id)
 	end
 end
 
-function socket.listen(host, port, backlog)
+-- reuseport : set SO_REUSEPORT, so several services can listen on the same port and the kernel spreads the accepts among them
+function socket.listen(host, port, backlog, reuseport)
 	if port == nil then
 		host, port = string.match(host, "([^:]+):(.+)$")
 		port = tonumber(port)
 	end
-	local id = driver.listen(host, port, backlog)
+	local id = driver.listen(host, port, backlog, reuseport)
 	local s = {
 		id = id,
 		connected = false,
@@ -434,6 +497,8 @@ end
 function socket.abandon(id)
 	local s = socket_pool[id]
 	if s then
+		-- the new owner (a gate in C, for example) may free the data by skynet_free
+		driver.recvpool(id, false)
 		s.connected = false
 		wakeup(s)
 		socket_onclose[id] = nil
@@ -500,6 +565,46 @@ function socket.warning(id, callback)
 	obj.on_warning = callback
 end
 
+-- When the unsent bytes of the socket reach high, it's blocked until they fall to low (high / 2 by default).
+-- The producer calls socket.wait_writable before writing, to throttle instead of piling up the data.
+-- It replaces the warning of the socket (socket.warning), high = 0 disables it.
+function socket.watermark(id, high, low)
+	local s = assert(socket_pool[id])
+	driver.watermark(id, high, low)
+	if high == 0 then
+		s.blocked = nil
+		wakeup_writable(s)
+	end
+end
+
+-- return true at once if the socket is not blocked, or wait until it's writable.
+-- return false if the socket is closed.
+function socket.wait_writable(id)
+	local s = socket_pool[id]
+	if s == nil or not s.connected then
+		return false
+	end
+	if s.blocked then
+		local co = coroutine.running()
+		local w = s.writable
+		if w == nil then
+			w = {}
+			s.writable = w
+		end
+		w[#w+1] = co
+		skynet.wait(co)
+		return socket_pool[id] == s and s.connected
+	end
+	return true
+end
+
+-- The socket thread splits the stream by a big-endian length header of 2 or 4 bytes (header = 0 disables it),
+-- it delivers only whole packets, and raises an error on a packet larger than max.
+-- Call it before socket.start.
+function socket.framing(id, header, max)
+	driver.framing(id, header, max)
+end
+
 function socket.onclose(id, callback)
 	socket_onclose[id] = callback
 end
@@ -43,7 +43,10 @@ function gateserver.start(handler)
 		maxclient = conf.maxclient or 1024
 		nodelay = conf.nodelay
 		skynet.error(string.format("Listen on %s:%d", address, port))
-		socket = socketdriver.listen(address, port, conf.backlog)
+		-- conf.reuseport : other gates may open the same port, see examples/watchdog.lua
+		socket = socketdriver.listen(address, port, conf.backlog, conf.reuseport)
+		-- the accepts to a busy gate come in batch (MSG.batch), the connections are not pooled
+		socketdriver.recvpool(socket)
 		listen_context.co = coroutine.running()
 		listen_context.fd = socket
 		skynet.wait(listen_context.co)
@@ -98,10 +101,19 @@ function gateserver.start(handler)
 		if nodelay then
 			socketdriver.nodelay(fd)
 		end
+		-- the socket thread splits the packets, before socketdriver.start (gateserver.openclient)
+		socketdriver.framing(fd, 2)
 		connection[fd] = true
 		handler.connect(fd, msg)
 	end
 
+	function MSG.batch(...)
+		local batch = { ... }	-- fd, addr of each accept
+		for i = 1, #batch, 2 do
+			MSG.open(batch[i], batch[i+1])
+		end
+	end
+
 	function MSG.close(fd)
 		if fd ~= socket then
 			client_number = client_number - 1
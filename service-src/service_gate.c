@@ -171,11 +171,22 @@ _report(struct gate * g, const char * data, ...) {
 }
 
 
+// data为NULL时从c->buffer读取, 否则是socket线程分好的整包 (SKYNET_SOCKET_TYPE_FRAME)
+static inline void
+_read(struct gate *g, struct connection *c, const char *data, char *buffer, int size) {
+	if (data) {
+		memcpy(buffer, data, size);
+	} else {
+		databuffer_read(&c->buffer,&g->mp,buffer,size);
+	}
+}
+
 // @param * g  是gate
 // @param * c  是connect
+// @param data 包的数据, 或NULL (见_read)
 // @param size 是字节流长度
 static void
-_forward(struct gate *g, struct connection * c, int size) {
+_forward(struct gate *g, struct connection * c, const char *data, int size) {
 	struct skynet_context * ctx = g->ctx;
 	int fd = c->id;
 	if (fd <= 0) {
@@ -188,7 +199,7 @@ _forward(struct gate *g, struct connection * c, int size) {
 		// 分配空间
 		void * temp = skynet_malloc(size);
 		// 这个就是读数据了，把数据读取到temp里
-		databuffer_read(&c->buffer,&g->mp,(char *)temp, size);
+		_read(g, c, data, (char *)temp, size);
 		// 发送到对应service里
 		skynet_send(ctx, 0, g->broker, g->client_tag | PTYPE_TAG_DONTCOPY, fd, temp, size);
 		return;
@@ -196,7 +207,7 @@ _forward(struct gate *g, struct connection * c, int size) {
 	// 这个是什么模式
 	if (c->agent) {
 		void * temp = skynet_malloc(size);
-		databuffer_read(&c->buffer,&g->mp,(char *)temp, size);
+		_read(g, c, data, (char *)temp, size);
 		skynet_send(ctx, c->client, c->agent, g->client_tag | PTYPE_TAG_DONTCOPY, fd , temp, size);
 	} else if (g->watchdog) {
 		// 加包头
@@ -204,7 +215,7 @@ _forward(struct gate *g, struct connection * c, int size) {
 		// 
 		int n = snprintf(tmp,32,"%d data ",c->id);
 		// 数据放到tmp + n 之后
-		databuffer_read(&c->buffer,&g->mp,tmp+n,size);
+		_read(g, c, data, tmp+n, size);
 		skynet_send(ctx, 0, g->watchdog, PTYPE_TEXT | PTYPE_TAG_DONTCOPY, fd, tmp, size + n);
 	}
 }
@@ -228,13 +239,56 @@ dispatch_message(struct gate *g, struct connection *c, int id, void * data, int
 				return;
 			} else {
 
-				_forward(g, c, size);
+				_forward(g, c, NULL, size);
 				databuffer_reset(&c->buffer);
 			}
 		}
 	}
 }
 
+// the whole packets split by the socket thread, see skynet_socket_framing in gate_accept
+static void
+dispatch_frame(struct gate *g, struct connection *c, const uint8_t * data, int sz) {
+	int header = g->header_size;
+	while (sz >= header) {
+		int size;
+		if (header == 2) {
+			size = data[0] << 8 | data[1];
+		} else {
+			size = data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+		}
+		data += header;
+		sz -= header;
+		assert(size <= sz);
+		if (size > 0) {
+			_forward(g, c, (const char *)data, size);
+		}
+		data += size;
+		sz -= size;
+	}
+}
+
+// report accept, then it will be get a SKYNET_SOCKET_TYPE_CONNECT message
+static void
+gate_accept(struct gate *g, int id, const char * addr, int sz) {
+	struct skynet_context * ctx = g->ctx;
+	if (hashid_full(&g->hash)) {
+		skynet_socket_close(ctx, id);
+		return;
+	}
+	struct connection *c = &g->conn[hashid_insert(&g->hash, id)];
+	if (sz >= sizeof(c->remote_name)) {
+		sz = sizeof(c->remote_name) - 1;
+	}
+	c->id = id;
+	memcpy(c->remote_name, addr, sz);
+	c->remote_name[sz] = '\0';
+	// the socket thread splits the packets (> 16M is an error), before the "start" command
+	skynet_socket_framing(ctx, c->id, g->header_size, 0xffffff);
+	_report(g, "%d open %d %s:0",c->id, c->id, c->remote_name);
+	skynet_error(ctx, "socket open: %x", c->id);
+}
+
 static void
 dispatch_socket_message(struct gate *g, const struct skynet_socket_message * message, int sz) {
 	struct skynet_context * ctx = g->ctx;
@@ -251,6 +305,17 @@ dispatch_socket_message(struct gate *g, const struct skynet_socket_message * mes
 		}
 		break;
 	}
+	case SKYNET_SOCKET_TYPE_FRAME: {
+		int id = hashid_lookup(&g->hash, message->id);
+		if (id>=0) {
+			dispatch_frame(g, &g->conn[id], (const uint8_t *)message->buffer, message->ud);
+		} else {
+			skynet_error(ctx, "Drop unknown connection %d message", message->id);
+			skynet_socket_close(ctx, message->id);
+		}
+		skynet_free(message->buffer);
+		break;
+	}
 	case SKYNET_SOCKET_TYPE_CONNECT: {
 		if (message->id == g->listen_id) {
 			// start listening
@@ -272,26 +337,26 @@ dispatch_socket_message(struct gate *g, const struct skynet_socket_message * mes
 			memset(c, 0, sizeof(*c));
 			c->id = -1;
 			_report(g, "%d close", message->id);
+			if (message->type == SKYNET_SOCKET_TYPE_ERROR) {
+				// read error or a packet > 16M, the socket is still open
+				skynet_socket_close(ctx, message->id);
+			}
 		}
 		break;
 	}
 	case SKYNET_SOCKET_TYPE_ACCEPT:
-		// report accept, then it will be get a SKYNET_SOCKET_TYPE_CONNECT message
 		assert(g->listen_id == message->id);
-		if (hashid_full(&g->hash)) {
-			skynet_socket_close(ctx, message->ud);
-		} else {
-			struct connection *c = &g->conn[hashid_insert(&g->hash, message->ud)];
-			if (sz >= sizeof(c->remote_name)) {
-				sz = sizeof(c->remote_name) - 1;
-			}
-			c->id = message->ud;
-			memcpy(c->remote_name, message+1, sz);
-			c->remote_name[sz] = '\0';
-			_report(g, "%d open %d %s:0",c->id, c->id, c->remote_name);
-			skynet_error(ctx, "socket open: %x", c->id);
+		gate_accept(g, message->ud, (const char *)(message+1), sz);
+		break;
+	case SKYNET_SOCKET_TYPE_BATCH: {
+		// the accepts to a busy gate, the listen socket is pooled (see start_listen) but the connections are not
+		int i;
+		for (i=1;i<=message->ud;i++) {
+			assert(message[i].type == SKYNET_SOCKET_TYPE_ACCEPT && g->listen_id == message[i].id);
+			gate_accept(g, message[i].ud, message[i].buffer, strlen(message[i].buffer));
 		}
 		break;
+	}
 	case SKYNET_SOCKET_TYPE_WARNING:
 		skynet_error(ctx, "fd (%d) send buffer (%d)K", message->id, message->ud);
 		break;
@@ -357,6 +422,7 @@ start_listen(struct gate *g, char * listen_addr) {
 	if (g->listen_id < 0) {
 		return 1;
 	}
+	skynet_socket_recvpool(ctx, g->listen_id, 1);
 	skynet_socket_start(ctx, g->listen_id);
 	return 0;
 }
@@ -144,6 +144,7 @@ function COMMAND.help()
 	return {
 		help = "This help message",
 		list = "List all the service",
+		names = "List all the local names",
 		stat = "Dump all stats",
 		info = "info address : get service infomation",
 		exit = "exit address : kill a lua service",
@@ -235,6 +236,14 @@ function COMMAND.list()
 	return skynet.call(".launcher", "lua", "LIST")
 end
 
+function COMMAND.names()
+	local result = {}
+	for _, v in ipairs(core.names()) do
+		result["." .. v[1]] = skynet.address(v[2])
+	end
+	return result
+end
+
 local function timeout(ti)
 	if ti then
 		ti = tonumber(ti)
@@ -449,6 +458,10 @@ local function convert_stat(info)
 	end
 
 	info.address = skynet.address(info.address)
+	if info.wcall and info.wcall > 0 then
+		-- bytes per write syscall
+		info.wcall = string.format("%d (%s each)", info.wcall, bytes(info.write // info.wcall))
+	end
 	info.read = bytes(info.read)
 	info.write = bytes(info.write)
 	info.wbuffer = bytes(info.wbuffer)
@@ -186,6 +186,22 @@ mallctl_opt(const char* name, int* newval) {
 	return v;
 }
 
+int
+mallctl_arena_create(void) {
+	unsigned arena = 0;
+	size_t len = sizeof(arena);
+	if (je_mallctl("arenas.create", &arena, &len, NULL, 0)) {
+		return -1;
+	}
+	return (int)arena;
+}
+
+int
+mallctl_arena_bind(int arena) {
+	unsigned v = (unsigned)arena;
+	return je_mallctl("thread.arena", NULL, NULL, &v, sizeof(v));
+}
+
 // hook : malloc, realloc, free, calloc
 
 void *
@@ -296,6 +312,17 @@ mallctl_cmd(const char* name) {
 	return 0;
 }
 
+int
+mallctl_arena_create(void) {
+	skynet_error(NULL, "No jemalloc : mallctl_arena_create.");
+	return -1;
+}
+
+int
+mallctl_arena_bind(int arena) {
+	return -1;
+}
+
 #endif
 
 size_t
@@ -12,6 +12,8 @@ extern size_t mallctl_int64(const char* name, size_t* newval);
 extern int    mallctl_opt(const char* name, int* newval);
 extern bool   mallctl_bool(const char* name, bool* newval);
 extern int    mallctl_cmd(const char* name);
+extern int    mallctl_arena_create(void);	// return arena index, -1 for error
+extern int    mallctl_arena_bind(int arena);	// bind current thread to arena, 0 for success
 extern void   dump_c_mem(void);
 extern int    dump_mem_lua(lua_State *L);
 extern size_t malloc_current_memory(void);
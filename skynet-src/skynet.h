@@ -29,6 +29,8 @@ struct skynet_context;
 void skynet_error(struct skynet_context * context, const char *msg, ...);
 const char * skynet_command(struct skynet_context * context, const char * cmd , const char * parm);
 uint32_t skynet_queryname(struct skynet_context * context, const char * name);
+// visit the local names sorted by name, returns the count. cb runs with the name lock held, it must not call skynet_*
+int skynet_namelist(struct skynet_context * context, void (*cb)(void *ud, const char *name, uint32_t handle), void *ud);
 int skynet_send(struct skynet_context * context, uint32_t source, uint32_t destination , int type, int session, void * msg, size_t sz);
 int skynet_sendname(struct skynet_context * context, uint32_t source, const char * destination , int type, int session, void * msg, size_t sz);
 
@@ -0,0 +1,99 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "skynet_affinity.h"
+
+int
+affinity_parse(const char *list, int *cpu, int max) {
+	int n = 0;
+	const char *p = list;
+	while (*p) {
+		char *endptr;
+		long from = strtol(p, &endptr, 10);
+		if (endptr == p || from < 0)
+			return -1;
+		long to = from;
+		p = endptr;
+		if (*p == '-') {
+			++p;
+			to = strtol(p, &endptr, 10);
+			if (endptr == p || to < from)
+				return -1;
+			p = endptr;
+		}
+		long i;
+		for (i=from;i<=to;i++) {
+			if (n >= max)
+				return -1;
+			cpu[n++] = (int)i;
+		}
+		while (*p == ',' || *p == ' ') {
+			++p;
+		}
+	}
+	return n;
+}
+
+#ifdef __linux__
+
+int
+affinity_setattr(pthread_attr_t *attr, const int *cpu, int n) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	int i;
+	for (i=0;i<n;i++) {
+		if (cpu[i] >= CPU_SETSIZE)
+			return -1;
+		CPU_SET(cpu[i], &set);
+	}
+	return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+int
+affinity_cpunode(int cpu) {
+	char path[64];
+	sprintf(path, "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR *dir = opendir(path);
+	if (dir == NULL)
+		return 0;
+	int node = 0;
+	struct dirent *ent;
+	while ((ent = readdir(dir))) {
+		if (strncmp(ent->d_name, "node", 4) == 0 && ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+			node = strtol(ent->d_name + 4, NULL, 10);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+#else
+
+int
+affinity_setattr(pthread_attr_t *attr, const int *cpu, int n) {
+	// not supported
+	return -1;
+}
+
+int
+affinity_cpunode(int cpu) {
+	return 0;
+}
+
+#endif
+
+int
+affinity_cpucount(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
@@ -0,0 +1,17 @@
+#ifndef skynet_affinity_h
+#define skynet_affinity_h
+
+#include <pthread.h>
+
+#define MAX_AFFINITY_CPU 1024
+
+// parse cpu list such as "0-3,8,10-11", return the number of cpus, -1 for error
+int affinity_parse(const char *list, int *cpu, int max);
+// set cpu affinity of the thread created with attr, return 0 for success
+int affinity_setattr(pthread_attr_t *attr, const int *cpu, int n);
+// NUMA node of the cpu, 0 if unknown
+int affinity_cpunode(int cpu);
+// number of online cpus
+int affinity_cpucount(void);
+
+#endif
@@ -3,118 +3,261 @@
 #include "skynet_handle.h"
 #include "skynet_server.h"
 #include "rwlock.h"
+#include "atomic.h"
 
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 
 #define DEFAULT_SLOT_SIZE 4
 #define MAX_SLOT_SIZE 0x40000000
+#define DEFAULT_NAME_SIZE 16
+// threads beyond it grab handles with the read lock
+#define MAX_READER 256
+#define CACHE_LINE 64
+// spins before synchronize yields the cpu to a reader
+#define SYNC_SPIN 64
 
 // 这个结构用于记录，服务对应的别名，当应用层为某个服务命名时，会写到这里来
+// 同时挂在按名字和按handle的两个哈希表上，名字和节点一起分配
 struct handle_name {
-	char * name;        // 服务别名
-	uint32_t handle;    // 服务id
+	struct handle_name *next;   // 同名字哈希桶
+	struct handle_name *hnext;  // 同handle哈希桶
+	uint32_t hash;
+	uint32_t handle;            // 服务id
+	char name[1];               // 服务别名
+};
+
+// handle = gen << bits | index，gen 是每个slot自己的代数
+// 服务退出时 gen 加一，所以slot复用后旧的handle不会再匹配，发给旧地址的消息会被丢弃
+struct handle_entry {
+	ATOM_POINTER ctx;                   // struct skynet_context *
+	ATOM_INT gen;                       // generation of the handle in this slot, or of the next one if it's empty
+};
+
+// slot array read by skynet_handle_grab without lock.
+// The writer publishes a new array when it grows, and frees the old one after all the readers leave it.
+struct handle_slot {
+	int size;                           // slot的大小，一定是2^n，初始值是4
+	int bits;                           // size == 1 << bits
+	struct handle_entry e[1];
+};
+
+// epoch of a reader thread when it starts reading the slots, 0 means it's not reading.
+// One cache line each, the array is allocated with skynet_memalign.
+struct handle_reader {
+	ATOM_SIZET epoch;
+	char padding[CACHE_LINE - sizeof(ATOM_SIZET)];
 };
 
 struct handle_storage {
-	struct rwlock lock;                 // 读写锁
+	struct rwlock lock;                 // 读写锁, for writers and the names
 	// 应该是这个节点的id。高8位
 	uint32_t harbor;                    // harbor id
-	uint32_t handle_index;              // 创建下一个服务时，该服务的slot idx，一般会先判断该slot是否被占用，后面会详细讨论
-	int slot_size;                      // slot的大小，一定是2^n，初始值是4
-	// 是一个数组
-	struct skynet_context ** slot;      // skynet_context list
+	uint32_t handle_index;              // 创建下一个服务时，从这个slot idx开始找空位
+	ATOM_POINTER slot;                  // struct handle_slot *
 	
-	int name_cap;                       // 别名列表大小/容量，大小为2^n
+	ATOM_SIZET epoch;                   // starts from 1, bumped by writers to wait for a grace period
+	ATOM_INT reader_count;
+	pthread_key_t reader_key;           // index + 1 of handle_reader
+	struct handle_reader *reader;       // [MAX_READER]
+
+	int name_cap;                       // 别名哈希表的桶数，大小为2^n
 	int name_count;                     // 别名数量
-	struct handle_name *name;           // 别名列表
+	struct handle_name **name;          // 按名字索引
+	struct handle_name **hname;         // 按handle索引，retire时移除
+	ATOM_SIZET name_gen;                // 别名变化时递增，用来让 skynet_sendname 的缓存失效
 };
 
 static struct handle_storage *H = NULL;
 
+static int _remove_name(struct handle_storage *s, uint32_t handle);
+
+static struct handle_slot *
+slot_new(int size) {
+	struct handle_slot *hs = skynet_malloc(sizeof(*hs) + (size - 1) * sizeof(struct handle_entry));
+	hs->size = size;
+	hs->bits = 0;
+	while ((1 << hs->bits) < size) {
+		++hs->bits;
+	}
+	int i;
+	for (i=0;i<size;i++) {
+		ATOM_INIT(&hs->e[i].ctx, (uintptr_t)NULL);
+		ATOM_INIT(&hs->e[i].gen, 0);
+	}
+	return hs;
+}
+
+static inline uint32_t
+handle_gen(struct handle_slot *hs, uint32_t handle) {
+	return (handle & HANDLE_MASK) >> hs->bits;
+}
+
+// the context of handle, or NULL if the generation of the slot doesn't match (a stale handle).
+// ctx's handle is checked too: the slot may be retired and reused between the loads.
+static inline struct skynet_context *
+slot_ctx(struct handle_slot *hs, uint32_t handle) {
+	struct handle_entry *e = &hs->e[handle & (hs->size-1)];
+	if ((uint32_t)ATOM_LOAD(&e->gen) != handle_gen(hs, handle))
+		return NULL;
+	struct skynet_context *ctx = (struct skynet_context *)ATOM_LOAD(&e->ctx);
+	if (ctx && skynet_context_handle(ctx) == handle)
+		return ctx;
+	return NULL;
+}
+
+static struct handle_reader *
+current_reader(struct handle_storage *s) {
+	int id = (int)(uintptr_t)pthread_getspecific(s->reader_key);
+	if (id == 0) {
+		id = ATOM_FINC(&s->reader_count) + 1;
+		if (id > MAX_READER) {
+			id = MAX_READER + 1;
+		}
+		pthread_setspecific(s->reader_key, (void *)(uintptr_t)id);
+	}
+	if (id > MAX_READER)
+		return NULL;
+	return &s->reader[id-1];
+}
+
+// start a grace period after the slot is changed, call it with write lock.
+// A reader entered after the bump sees the slot changed before it.
+static inline size_t
+epoch_bump(struct handle_storage *s) {
+	return ATOM_FINC(&s->epoch) + 1;
+}
+
+// wait until the readers entered before epoch leave. Call it without lock,
+// so a preempted reader only delays this writer, not every register/retire/name operation.
+static void
+synchronize(struct handle_storage *s, size_t epoch) {
+	int n = ATOM_LOAD(&s->reader_count);
+	if (n > MAX_READER) {
+		n = MAX_READER;
+	}
+	int i;
+	for (i=0;i<n;i++) {
+		int spin = 0;
+		for (;;) {
+			size_t e = ATOM_LOAD(&s->reader[i].epoch);
+			if (e == 0 || e >= epoch)
+				break;
+			if (++spin > SYNC_SPIN) {
+				sched_yield();
+			}
+		}
+	}
+}
+
 // 
 uint32_t
 skynet_handle_register(struct skynet_context *ctx) {
 	// 
 	struct handle_storage *s = H;
+	// the array replaced by the grow, freed after the readers leave it
+	struct handle_slot *old_slot = NULL;
+	size_t epoch = 0;
 	// 读写锁的写锁
 	rwlock_wlock(&s->lock);
 	
 	for (;;) {
+		struct handle_slot *hs = (struct handle_slot *)ATOM_LOAD(&s->slot);
 		int i;
-		uint32_t handle = s->handle_index;
 		// slot_size 初始值是4
-		for (i = 0; i < ( s->slot_size); i ++, handle ++) {
-			// 如果超过最大值，从0开始
-			if (handle > HANDLE_MASK) {
-				// 0 is reserved
-				handle = 1;
-			}
+		for (i = 0; i < hs->size; i ++) {
 			// slot_size 一定是2^n，可以知道（slot_size - 1） 的二进制。所有位都是1
 			// 避免最大值。确保小于slot_size
-			int hash = handle & (s->slot_size-1);
-			if (s->slot[hash] == NULL) {
-				// 赋值
-				s->slot[hash] = ctx;
-				s->handle_index = handle + 1;
+			uint32_t hash = (s->handle_index + i) & (hs->size-1);
+			struct handle_entry *e = &hs->e[hash];
+			if (ATOM_LOAD(&e->ctx) == (uintptr_t)NULL) {
+				// A reused slot (even by a pooled context) gets the next generation, so the stale handles are refused.
+				// The generation wraps after 2^(24-bits) reuses of the same slot.
+				uint32_t gen = ATOM_LOAD(&e->gen);
+				if (gen > (HANDLE_MASK >> hs->bits)) {
+					gen = 0;
+				}
+				uint32_t handle = gen << hs->bits | hash;
+				if (handle == 0) {
+					// 0 is reserved
+					gen = 1;
+					handle = gen << hs->bits;
+				}
+				// 赋值, publish gen before ctx
+				ATOM_STORE(&e->gen, gen);
+				ATOM_STORE(&e->ctx, (uintptr_t)ctx);
+				s->handle_index = hash + 1;
 
 				rwlock_wunlock(&s->lock);
 
+				if (old_slot) {
+					synchronize(s, epoch);
+					skynet_free(old_slot);
+				}
+
 				// 这个是或。harbor 是高8位的
 				handle |= s->harbor;
 				return handle;
 			}
 		}
-		assert((s->slot_size*2 - 1) <= HANDLE_MASK);
+		assert((hs->size*2 - 1) <= HANDLE_MASK);
 		// 扩大一倍
-		struct skynet_context ** new_slot = skynet_malloc(s->slot_size * 2 * sizeof(struct skynet_context *));
-		// 初始化
-		memset(new_slot, 0, s->slot_size * 2 * sizeof(struct skynet_context *));
+		struct handle_slot * new_slot = slot_new(hs->size * 2);
 		// 迁移
-		for (i=0;i<s->slot_size;i++) {
-			if (s->slot[i]) {
-				int hash = skynet_context_handle(s->slot[i]) & (s->slot_size * 2 - 1);
-				assert(new_slot[hash] == NULL);
-				new_slot[hash] = s->slot[i];
+		// slot i of gen g is slot i + (g&1)*size of gen g>>1 in the new array, the handle is the same.
+		// The generations of the other slots start after every handle issued from slot i, (2*gen + k) >= next.
+		for (i=0;i<hs->size;i++) {
+			struct skynet_context *c = (struct skynet_context *)ATOM_LOAD(&hs->e[i].ctx);
+			uint32_t g = ATOM_LOAD(&hs->e[i].gen);
+			uint32_t next = c ? g + 1 : g;
+			uint32_t k;
+			for (k=0;k<2;k++) {
+				struct handle_entry *e = &new_slot->e[i + k * hs->size];
+				if (c && (g & 1) == k) {
+					ATOM_STORE(&e->gen, g >> 1);
+					ATOM_STORE(&e->ctx, (uintptr_t)c);
+				} else {
+					ATOM_STORE(&e->gen, (next - k + 1) >> 1);
+				}
 			}
 		}
-		skynet_free(s->slot);
-		s->slot = new_slot;
-		s->slot_size *= 2;
+		ATOM_STORE(&s->slot, (uintptr_t)new_slot);
+		// readers may still read the old one, free it after wunlock.
+		// The new one has free slots, so it grows once at most.
+		assert(old_slot == NULL);
+		old_slot = hs;
+		epoch = epoch_bump(s);
 	}
 }
 
 int
 skynet_handle_retire(uint32_t handle) {
 	int ret = 0;
+	size_t epoch = 0;
 	// s是一个全量结构，包含全局数据
 	struct handle_storage *s = H;
 
 	rwlock_wlock(&s->lock);
 
-	uint32_t hash = handle & (s->slot_size-1);
-	struct skynet_context * ctx = s->slot[hash];
+	struct handle_slot *hs = (struct handle_slot *)ATOM_LOAD(&s->slot);
+	struct handle_entry *e = &hs->e[handle & (hs->size-1)];
+	struct skynet_context * ctx = slot_ctx(hs, handle);
 	// 判断
-	if (ctx != NULL && skynet_context_handle(ctx) == handle) {
-		s->slot[hash] = NULL;
+	if (ctx != NULL) {
+		ATOM_STORE(&e->ctx, (uintptr_t)NULL);
+		// the next handle of this slot is a new generation
+		ATOM_STORE(&e->gen, handle_gen(hs, handle) + 1);
 		ret = 1;
-		int i;
-		int j=0, n=s->name_count;
-		for (i=0; i<n; ++i) {
-			// 判断是否是当前handle的名字
-			if (s->name[i].handle == handle) {
-				// 如果是，那么就释放
-				skynet_free(s->name[i].name);
-				continue;
-			} else if (i!=j) {
-				// 如果不相等，说明，中途移除了。所以后面往前移动
-				s->name[j] = s->name[i];
-			}
-			++j;
+		if (_remove_name(s, handle)) {
+			ATOM_FINC(&s->name_gen);
 		}
-		// 赋值最新的j
-		s->name_count = j;
+		// a reader may have loaded ctx from the slot, and it will grab ctx.
+		// so release ctx after it leaves.
+		epoch = epoch_bump(s);
 	} else {
 		// handle不相等。说明什么
 		ctx = NULL;
@@ -124,6 +267,7 @@ skynet_handle_retire(uint32_t handle) {
 
 	if (ctx) {
 		// release ctx may call skynet_handle_* , so wunlock first.
+		synchronize(s, epoch);
 		skynet_context_release(ctx);
 	}
 
@@ -136,9 +280,14 @@ skynet_handle_retireall() {
 	for (;;) {
 		int n=0;
 		int i;
-		for (i=0;i<s->slot_size;i++) {
+		for (i=0;;i++) {
 			rwlock_rlock(&s->lock);
-			struct skynet_context * ctx = s->slot[i];
+			struct handle_slot *hs = (struct handle_slot *)ATOM_LOAD(&s->slot);
+			if (i >= hs->size) {
+				rwlock_runlock(&s->lock);
+				break;
+			}
+			struct skynet_context * ctx = (struct skynet_context *)ATOM_LOAD(&hs->e[i].ctx);
 			uint32_t handle = 0;
 			if (ctx) {
 				handle = skynet_context_handle(ctx);
@@ -160,112 +309,153 @@ struct skynet_context *
 skynet_handle_grab(uint32_t handle) {
 	struct handle_storage *s = H;
 	struct skynet_context * result = NULL;
+	struct handle_reader *r = current_reader(s);
 
-	rwlock_rlock(&s->lock);
+	if (r == NULL) {
+		// too many threads, fallback to the read lock
+		rwlock_rlock(&s->lock);
+	} else {
+		// no shared write in the fast path, the writer waits for us in synchronize()
+		ATOM_STORE(&r->epoch, ATOM_LOAD(&s->epoch));
+	}
 
-	uint32_t hash = handle & (s->slot_size-1);
-	struct skynet_context * ctx = s->slot[hash];
-	if (ctx && skynet_context_handle(ctx) == handle) {
+	struct handle_slot *hs = (struct handle_slot *)ATOM_LOAD(&s->slot);
+	struct skynet_context * ctx = slot_ctx(hs, handle);
+	if (ctx) {
 		result = ctx;
 		skynet_context_grab(result);
 	}
 
-	rwlock_runlock(&s->lock);
+	if (r == NULL) {
+		rwlock_runlock(&s->lock);
+	} else {
+		ATOM_STORE(&r->epoch, 0);
+	}
 
 	return result;
 }
 
+static inline uint32_t
+name_hash(const char *name) {
+	uint32_t h = 2166136261u;
+	const unsigned char *p;
+	for (p = (const unsigned char *)name; *p; p++) {
+		h = (h ^ *p) * 16777619u;
+	}
+	return h;
+}
+
+static struct handle_name *
+_find_name(struct handle_storage *s, const char *name, uint32_t hash) {
+	struct handle_name *n = s->name[hash & (s->name_cap - 1)];
+	while (n) {
+		if (n->hash == hash && strcmp(n->name, name) == 0)
+			return n;
+		n = n->next;
+	}
+	return NULL;
+}
+
+size_t
+skynet_handle_namegen() {
+	return ATOM_LOAD(&H->name_gen);
+}
+
 uint32_t 
 skynet_handle_findname(const char * name) {
 	struct handle_storage *s = H;
+	uint32_t hash = name_hash(name);
 
 	rwlock_rlock(&s->lock);
 
-	uint32_t handle = 0;
-
-	int begin = 0;
-	int end = s->name_count - 1;
-	while (begin<=end) {
-		// 使用二分法，说明name是一个有序的结构
-		int mid = (begin+end)/2;
-		struct handle_name *n = &s->name[mid];
-		int c = strcmp(n->name, name);
-		if (c==0) {
-			handle = n->handle;
-			break;
-		}
-		if (c<0) {
-			begin = mid + 1;
-		} else {
-			end = mid - 1;
-		}
-	}
+	struct handle_name *n = _find_name(s, name, hash);
+	uint32_t handle = n ? n->handle : 0;
 
 	rwlock_runlock(&s->lock);
 
 	return handle;
 }
 
-// name 中间插入
+// 扩容，只重新挂链表，不移动别名本身
 static void
-_insert_name_before(struct handle_storage *s, char *name, uint32_t handle, int before) {
-	// 判断容量是否足够
-	if (s->name_count >= s->name_cap) {
-		// 扩容？
-		s->name_cap *= 2;
-		assert(s->name_cap <= MAX_SLOT_SIZE);
-		// 分配内存
-		struct handle_name * n = skynet_malloc(s->name_cap * sizeof(struct handle_name));
-		int i;
-		// 迁移
-		for (i=0;i<before;i++) {
-			n[i] = s->name[i];
+_expand_name(struct handle_storage *s) {
+	int cap = s->name_cap * 2;
+	assert(cap <= MAX_SLOT_SIZE);
+	struct handle_name ** name = skynet_malloc(cap * sizeof(struct handle_name *));
+	struct handle_name ** hname = skynet_malloc(cap * sizeof(struct handle_name *));
+	memset(name, 0, cap * sizeof(struct handle_name *));
+	memset(hname, 0, cap * sizeof(struct handle_name *));
+	int i;
+	for (i=0;i<s->name_cap;i++) {
+		struct handle_name *n = s->name[i];
+		while (n) {
+			struct handle_name *next = n->next;
+			n->next = name[n->hash & (cap-1)];
+			name[n->hash & (cap-1)] = n;
+			n = next;
 		}
-		// 预留一位，并迁移后续的
-		for (i=before;i<s->name_count;i++) {
-			n[i+1] = s->name[i];
-		}
-		// 释放之前的
-		skynet_free(s->name);
-		s->name = n;
-	} else {
-		int i;
-		后移
-		for (i=s->name_count;i>before;i--) {
-			s->name[i] = s->name[i-1];
+		n = s->hname[i];
+		while (n) {
+			struct handle_name *next = n->hnext;
+			n->hnext = hname[n->handle & (cap-1)];
+			hname[n->handle & (cap-1)] = n;
+			n = next;
 		}
 	}
-
-	s->name[before].name = name;
-	s->name[before].handle = handle;
-	s->name_count ++;
+	skynet_free(s->name);
+	skynet_free(s->hname);
+	s->name = name;
+	s->hname = hname;
+	s->name_cap = cap;
 }
 
-// 尾部插入
 static const char *
 _insert_name(struct handle_storage *s, const char * name, uint32_t handle) {
-	int begin = 0;
-	int end = s->name_count - 1;
+	uint32_t hash = name_hash(name);
 	// 判断是否已有
-	while (begin<=end) {
-		int mid = (begin+end)/2;
-		struct handle_name *n = &s->name[mid];
-		int c = strcmp(n->name, name);
-		if (c==0) {
-			return NULL;
-		}
-		if (c<0) {
-			begin = mid + 1;
-		} else {
-			end = mid - 1;
-		}
+	if (_find_name(s, name, hash)) {
+		return NULL;
 	}
-	// 
-	char * result = skynet_strdup(name);
+	if (s->name_count >= s->name_cap) {
+		_expand_name(s);
+	}
+	// 别名和节点一起分配
+	size_t sz = strlen(name);
+	struct handle_name *n = skynet_malloc(sizeof(*n) + sz);
+	memcpy(n->name, name, sz + 1);
+	n->hash = hash;
+	n->handle = handle;
+	n->next = s->name[hash & (s->name_cap-1)];
+	s->name[hash & (s->name_cap-1)] = n;
+	n->hnext = s->hname[handle & (s->name_cap-1)];
+	s->hname[handle & (s->name_cap-1)] = n;
+	s->name_count ++;
 
-	_insert_name_before(s, result, handle, begin);
+	return n->name;
+}
 
-	return result;
+// 移除handle的所有别名，调用时持有写锁，返回移除的数量
+static int
+_remove_name(struct handle_storage *s, uint32_t handle) {
+	int count = 0;
+	struct handle_name **pn = &s->hname[handle & (s->name_cap-1)];
+	while (*pn) {
+		struct handle_name *n = *pn;
+		if (n->handle != handle) {
+			pn = &n->hnext;
+			continue;
+		}
+		*pn = n->hnext;
+		struct handle_name **p = &s->name[n->hash & (s->name_cap-1)];
+		while (*p != n) {
+			p = &(*p)->next;
+		}
+		*p = n->next;
+		skynet_free(n);
+		s->name_count --;
+		++count;
+	}
+	return count;
 }
 
 const char * 
@@ -273,34 +463,81 @@ skynet_handle_namehandle(uint32_t handle, const char *name) {
 	rwlock_wlock(&H->lock);
 
 	const char * ret = _insert_name(H, name, handle);
+	if (ret) {
+		ATOM_FINC(&H->name_gen);
+	}
 
 	rwlock_wunlock(&H->lock);
 
 	return ret;
 }
 
+static int
+_compare_name(const void *a, const void *b) {
+	const struct handle_name *na = *(const struct handle_name **)a;
+	const struct handle_name *nb = *(const struct handle_name **)b;
+	return strcmp(na->name, nb->name);
+}
+
+int
+skynet_handle_namelist(void (*cb)(void *ud, const char *name, uint32_t handle), void *ud) {
+	struct handle_storage *s = H;
+
+	rwlock_rlock(&s->lock);
+
+	int n = s->name_count;
+	struct handle_name **list = skynet_malloc((n > 0 ? n : 1) * sizeof(struct handle_name *));
+	int i, count = 0;
+	for (i=0;i<s->name_cap;i++) {
+		struct handle_name *hn;
+		for (hn = s->name[i]; hn; hn = hn->next) {
+			list[count++] = hn;
+		}
+	}
+	assert(count == n);
+	// 按名字排序，和原来有序数组的顺序一致
+	qsort(list, n, sizeof(struct handle_name *), _compare_name);
+	for (i=0;i<n;i++) {
+		cb(ud, list[i]->name, list[i]->handle);
+	}
+
+	rwlock_runlock(&s->lock);
+
+	skynet_free(list);
+	return n;
+}
+
 void 
 skynet_handle_init(int harbor) {
 	assert(H==NULL);
 	// 分配内存
 	struct handle_storage * s = skynet_malloc(sizeof(*H));
+	memset(s, 0, sizeof(*s));
+	// skynet_malloc doesn't align the records to the cache line
+	s->reader = skynet_memalign(CACHE_LINE, MAX_READER * sizeof(struct handle_reader));
+	memset(s->reader, 0, MAX_READER * sizeof(struct handle_reader));
 	// 初始大小
-	s->slot_size = DEFAULT_SLOT_SIZE;
-	// 分配内存
-	s->slot = skynet_malloc(s->slot_size * sizeof(struct skynet_context *));
-	// 初始化
-	memset(s->slot, 0, s->slot_size * sizeof(struct skynet_context *));
+	ATOM_INIT(&s->slot, (uintptr_t)slot_new(DEFAULT_SLOT_SIZE));
 	// 初始化锁
 	rwlock_init(&s->lock);
+	ATOM_INIT(&s->epoch, 1);
+	ATOM_INIT(&s->name_gen, 1);
+	ATOM_INIT(&s->reader_count, 0);
+	if (pthread_key_create(&s->reader_key, NULL)) {
+		fprintf(stderr, "pthread_key_create failed");
+		exit(1);
+	}
 	// reserve 0 for system
 	s->harbor = (uint32_t) (harbor & 0xff) << HANDLE_REMOTE_SHIFT;
 	s->handle_index = 1;
-	s->name_cap = 2;
+	s->name_cap = DEFAULT_NAME_SIZE;
 	s->name_count = 0;
-	s->name = skynet_malloc(s->name_cap * sizeof(struct handle_name));
+	s->name = skynet_malloc(s->name_cap * sizeof(struct handle_name *));
+	s->hname = skynet_malloc(s->name_cap * sizeof(struct handle_name *));
+	memset(s->name, 0, s->name_cap * sizeof(struct handle_name *));
+	memset(s->hname, 0, s->name_cap * sizeof(struct handle_name *));
 
 	H = s;
 
 	// Don't need to free H
 }
-
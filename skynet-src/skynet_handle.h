@@ -2,6 +2,7 @@
 #define SKYNET_CONTEXT_HANDLE_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 // reserve high 8 bits for remote id
 #define HANDLE_MASK 0xffffff
@@ -16,6 +17,10 @@ void skynet_handle_retireall();
 
 uint32_t skynet_handle_findname(const char * name);
 const char * skynet_handle_namehandle(uint32_t handle, const char *name);
+// bumped whenever a name is added or removed, starts from 1
+size_t skynet_handle_namegen();
+// visit all the names in sorted order with the read lock held, cb must not call skynet_handle_*
+int skynet_handle_namelist(void (*cb)(void *ud, const char *name, uint32_t handle), void *ud);
 
 void skynet_handle_init(int harbor);
 
@@ -5,11 +5,22 @@ struct skynet_config {
 	int thread;
 	int harbor;
 	int profile;
+	int worksteal;
+	int dispatch_slice;
+	int numa;
+	int timer_tick;
+	int service_pool;
+	int socket_thread;
+	int max_socket;
+	int accept_batch;
 	const char * daemon;
 	const char * module_path;
 	const char * bootstrap;
 	const char * logger;
 	const char * logservice;
+	const char * worker_cpus;
+	const char * socket_cpus;
+	const char * timer_cpus;
 };
 
 #define THREAD_WORKER 0
@@ -45,6 +45,17 @@ log_blob(FILE *f, void * buffer, size_t sz) {
 
 static void
 log_socket(FILE * f, struct skynet_socket_message * message, size_t sz) {
+	if (message->type == SKYNET_SOCKET_TYPE_BATCH) {
+		int i;
+		for (i=1;i<=message->ud;i++) {
+			if (message[i].type == SKYNET_SOCKET_TYPE_ACCEPT) {
+				fprintf(f, "[socket] %d %d %d [%s]\n", message[i].type, message[i].id, message[i].ud, message[i].buffer);
+			} else {
+				log_socket(f, &message[i], sizeof(*message));
+			}
+		}
+		return;
+	}
 	fprintf(f, "[socket] %d %d %d ", message->type, message->id, message->ud);
 
 	if (message->buffer == NULL) {
@@ -161,6 +161,17 @@ main(int argc, char *argv[]) {
 	config.logger = optstring("logger", NULL);
 	config.logservice = optstring("logservice", "logger");
 	config.profile = optboolean("profile", 1);
+	config.worksteal = optboolean("worksteal", 0);
+	config.dispatch_slice = optint("dispatch_slice", 0);
+	config.worker_cpus = optstring("worker_cpus", NULL);
+	config.socket_cpus = optstring("socket_cpus", NULL);
+	config.timer_cpus = optstring("timer_cpus", NULL);
+	config.numa = optboolean("numa", 0);
+	config.timer_tick = optint("timer_tick", 10);
+	config.service_pool = optint("service_pool", 0);
+	config.socket_thread = optint("socket_thread", 1);
+	config.max_socket = optint("max_socket", 0);
+	config.accept_batch = optint("accept_batch", 0);
 
 	skynet_start(&config);
 	skynet_globalexit();
@@ -1,6 +1,7 @@
 #include "skynet.h"
 #include "skynet_mq.h"
 #include "skynet_handle.h"
+#include "skynet_park.h"
 #include "spinlock.h"
 
 #include <stdio.h>
@@ -8,16 +9,74 @@
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #define DEFAULT_QUEUE_SIZE 64
 #define MAX_GLOBAL_MQ 0x10000
 
+// local run queue of each worker (work stealing mode), must be 2^n
+#define LOCAL_QUEUE_SIZE 256
+// check global queue every n pops, so the injected queues can't be starved by local ones
+#define GLOBAL_CHECK_INTERVAL 61
+// serve a normal priority queue after n high priority ones, so background services can't be starved
+#define HIGH_PRIORITY_BURST 8
+
 // 0 means mq is not in global mq.
 // 1 means mq is in global mq , or the message is dispatching.
 
 #define MQ_IN_GLOBAL 1
 #define MQ_OVERLOAD 1024
 
+#ifdef USE_LOCKFREE_MQ
+
+#include "atomic.h"
+
+// the tail of a closed segment has this bit, producers should move to the next segment.
+#define SEGMENT_CLOSED ((size_t)1 << (sizeof(size_t) * 8 - 1))
+// message_queue.count is length | pushers * MQ_PUSHER, so a push updates both with one atomic add.
+// 16 bits of pushers and 48 bits of length on 64bit platform, 8 and 24 on 32bit.
+#define MQ_PUSHER ((size_t)1 << (sizeof(size_t) * 6))
+
+struct mq_slot {
+	ATOM_SIZET seq;
+	struct skynet_message message;
+};
+
+// A segment is a bounded ring (Dmitry Vyukov's bounded queue), seq of each slot tells whether it's writable or readable.
+struct mq_segment {
+	ATOM_POINTER next;
+	struct mq_segment *retired;
+	size_t cap;
+	size_t head;	// only the consumer touches head
+	ATOM_SIZET tail;
+	struct mq_slot slot[1];
+};
+
+// Multi-producer single-consumer queue without lock.
+// When the tail segment is full, a producer closes it and links a new segment of double size after it,
+// so queued messages are never copied. The consumer moves to the next segment after draining the closed one.
+// When the queue is empty, the consumer closes a grown segment too if it's mostly unused, so a spike doesn't pin its memory.
+struct message_queue {
+	uint32_t handle;
+	ATOM_INT release;
+	ATOM_INT in_global;
+	// Length (approximate, counted before a push and after a pop, so it's never less than the messages ready),
+	// and the producers in skynet_mq_push, the retired segments are freed when there is none.
+	ATOM_SIZET count;
+	int overload;
+	int overload_threshold;
+	int peak;	// max length since the queue is empty last time
+	int priority;
+	int node;	// home NUMA node, -1 before the first dispatch
+	ATOM_POINTER tail_segment;	// producers push into it
+	struct mq_segment *head_segment;	// consumer pops from it
+	// drained segments, producers may still read them, see segment_reclaim
+	struct mq_segment *retired;
+	struct message_queue *next;
+};
+
+#else
+
 struct message_queue {
     // 自旋锁，可能存在多个线程，向同一个队列写入的情况，加上自旋锁避免并发带来的发现，
     //后面会讨论互斥锁，自旋锁，读写锁和条件变量的区别
@@ -30,60 +89,750 @@ struct message_queue {
 	int in_global;
 	int overload;
 	int overload_threshold;
+	int priority;
+	int node;	// home NUMA node, -1 before the first dispatch
 	struct skynet_message *queue;
 	struct message_queue *next;
 };
 
-struct global_queue {
+#endif
+
+// Each worker owns a local ring of ready queues. The owner pushes to tail and pops from head,
+// idle workers steal half of a victim's ring from head.
+struct local_queue {
+	struct spinlock lock;
+	unsigned head;
+	unsigned tail;
+	unsigned tick;
+	struct message_queue *queue[LOCAL_QUEUE_SIZE];
+};
+
+struct mq_list {
 	struct message_queue *head;
 	struct message_queue *tail;
+};
+
+// Ready queues of one NUMA node (only one node when numa mode is off)
+struct node_queue {
+	struct mq_list normal;
+	struct mq_list high;	// queues of MQ_PRIORITY_HIGH
+	int high_served;	// high priority queues popped since the last normal one
+	struct spinlock lock;
+};
+
+// released queues kept for reuse (see skynet_mq_pool), linked by next
+struct mq_pool {
 	struct spinlock lock;
+	int count;
+	int max;	// 0 means pool mode is off
+	struct message_queue *head;
+};
+
+struct global_queue {
+	int node_count;
+	struct node_queue *node;
+	int *worker_node;	// NUMA node of each worker, NULL when numa mode is off
+	// work stealing mode is off when local_count == 0
+	int local_count;
+	struct local_queue *local;
+	pthread_key_t worker_key;
+	struct mq_pool pool;
 };
 
 static struct global_queue *Q = NULL;
 
-void 
-skynet_globalmq_push(struct message_queue * queue) {
-	struct global_queue *q= Q;
+static struct message_queue *
+mqpool_get(struct mq_pool *p) {
+	if (p->max == 0)
+		return NULL;
+	SPIN_LOCK(p)
+	struct message_queue *q = p->head;
+	if (q) {
+		p->head = q->next;
+		q->next = NULL;
+		--p->count;
+	}
+	SPIN_UNLOCK(p)
+	return q;
+}
 
-	SPIN_LOCK(q)
+// return 1 if q is kept by the pool
+static int
+mqpool_put(struct mq_pool *p, struct message_queue *q) {
+	if (p->max == 0)
+		return 0;
+	int ret = 0;
+	SPIN_LOCK(p)
+	if (p->count < p->max) {
+		q->next = p->head;
+		p->head = q;
+		++p->count;
+		ret = 1;
+	}
+	SPIN_UNLOCK(p)
+	return ret;
+}
+
+// return worker id, -1 means not a worker thread (timer, socket, main ...)
+static inline int
+current_worker(struct global_queue *q) {
+	// worker id + 1 is stored, so 0 is not a worker
+	return (int)(uintptr_t)pthread_getspecific(q->worker_key) - 1;
+}
+
+static inline int
+worker_node(struct global_queue *q, int worker) {
+	if (q->worker_node == NULL || worker < 0)
+		return 0;
+	return q->worker_node[worker];
+}
+
+static inline struct local_queue *
+current_local(struct global_queue *q, int worker) {
+	if (q->local_count == 0 || worker < 0)
+		return NULL;
+	return &q->local[worker];
+}
+
+static int
+localmq_push(struct local_queue *lq, struct message_queue *queue) {
+	int ret = 0;
+	SPIN_LOCK(lq)
+	if (lq->tail - lq->head < LOCAL_QUEUE_SIZE) {
+		lq->queue[lq->tail++ & (LOCAL_QUEUE_SIZE-1)] = queue;
+		ret = 1;
+	}
+	SPIN_UNLOCK(lq)
+	return ret;
+}
+
+static struct message_queue *
+localmq_pop(struct local_queue *lq) {
+	struct message_queue *mq = NULL;
+	SPIN_LOCK(lq)
+	if (lq->head != lq->tail) {
+		mq = lq->queue[lq->head++ & (LOCAL_QUEUE_SIZE-1)];
+	}
+	SPIN_UNLOCK(lq)
+	return mq;
+}
+
+static inline void
+mqlist_push(struct mq_list *list, struct message_queue *queue) {
+	if(list->tail) {
+		list->tail->next = queue;
+		list->tail = queue;
+	} else {
+		list->head = list->tail = queue;
+	}
+}
+
+static inline struct message_queue *
+mqlist_pop(struct mq_list *list) {
+	struct message_queue *mq  = list->head;
+	if(mq) {
+		list->head = mq->next;
+		if(list->head == NULL) {
+			assert(mq == list->tail);
+			list->tail = NULL;
+		}
+		mq->next = NULL;
+	}
+	return mq;
+}
+
+// push queue into the global queue of its home node
+static void
+globalmq_push(struct global_queue *q, struct message_queue * queue) {
+	int node = queue->node;
+	struct node_queue *nq = &q->node[node < 0 ? 0 : node];
+	SPIN_LOCK(nq)
 	assert(queue->next == NULL);
-	if(q->tail) {
-		q->tail->next = queue;
-		q->tail = queue;
+	mqlist_push(queue->priority == MQ_PRIORITY_HIGH ? &nq->high : &nq->normal, queue);
+	SPIN_UNLOCK(nq)
+}
+
+static struct message_queue *
+nodemq_pop(struct node_queue *nq) {
+	struct message_queue *mq;
+	SPIN_LOCK(nq)
+	if (nq->high.head && (nq->normal.head == NULL || nq->high_served < HIGH_PRIORITY_BURST)) {
+		mq = mqlist_pop(&nq->high);
+		++nq->high_served;
 	} else {
-		q->head = q->tail = queue;
+		mq = mqlist_pop(&nq->normal);
+		nq->high_served = 0;
 	}
-	SPIN_UNLOCK(q)
+	SPIN_UNLOCK(nq)
+
+	return mq;
+}
+
+// pop from the node of the worker first, then the other nodes
+static struct message_queue *
+globalmq_pop(struct global_queue *q, int node) {
+	int n = q->node_count;
+	if (n == 1)
+		return nodemq_pop(&q->node[0]);
+	int i;
+	for (i=0;i<n;i++) {
+		struct node_queue *nq = &q->node[(node + i) % n];
+		// peek without lock, avoid contention of the remote nodes when they are empty
+		if (nq->normal.head || nq->high.head) {
+			struct message_queue *mq = nodemq_pop(nq);
+			if (mq)
+				return mq;
+		}
+	}
+	return NULL;
+}
+
+static struct message_queue *
+globalmq_pop_high(struct global_queue *q, int node) {
+	struct node_queue *nq = &q->node[node];
+	SPIN_LOCK(nq)
+	struct message_queue *mq = mqlist_pop(&nq->high);
+	SPIN_UNLOCK(nq)
+	return mq;
+}
+
+// move half of victim's queues into self, and return one of them
+static struct message_queue *
+localmq_steal(struct local_queue *self, struct local_queue *victim) {
+	if (victim->head == victim->tail) {
+		// peek without lock, a stale value only makes us skip or retry this victim
+		return NULL;
+	}
+	if (!spinlock_trylock(&victim->lock))
+		return NULL;
+	struct message_queue *stolen[LOCAL_QUEUE_SIZE/2];
+	struct message_queue *mq = NULL;
+	unsigned i, n = victim->tail - victim->head;
+	if (n > 0) {
+		mq = victim->queue[victim->head++ & (LOCAL_QUEUE_SIZE-1)];
+		n /= 2;
+		for (i=0;i<n;i++) {
+			stolen[i] = victim->queue[victim->head++ & (LOCAL_QUEUE_SIZE-1)];
+		}
+	}
+	spinlock_unlock(&victim->lock);
+	// never hold two local locks at the same time, other workers may steal from us now.
+	for (i=0;i<n;i++) {
+		if (!localmq_push(self, stolen[i])) {
+			globalmq_push(Q, stolen[i]);
+		}
+	}
+	return mq;
+}
+
+static struct message_queue *
+worksteal_pop(struct global_queue *q, struct local_queue *lq, int node) {
+	struct message_queue *mq;
+	unsigned tick = ++lq->tick;
+	// peek without lock. skip high priority queues every n pops, so the local ones can't be starved
+	if (q->node[node].high.head && tick % HIGH_PRIORITY_BURST != 0) {
+		mq = globalmq_pop_high(q, node);
+		if (mq)
+			return mq;
+	}
+	if (tick % GLOBAL_CHECK_INTERVAL == 0) {
+		mq = globalmq_pop(q, node);
+		if (mq)
+			return mq;
+	}
+	mq = localmq_pop(lq);
+	if (mq)
+		return mq;
+	// peek without lock, avoid contention of the global lock when it's empty
+	if (q->node_count > 1 || q->node[0].normal.head || q->node[0].high.head) {
+		mq = globalmq_pop(q, node);
+		if (mq)
+			return mq;
+	}
+	int n = q->local_count;
+	int self = (int)(lq - q->local);
+	int start = tick % n;
+	int i;
+	for (i=0;i<n;i++) {
+		int victim = (start + i) % n;
+		if (victim == self)
+			continue;
+		mq = localmq_steal(lq, &q->local[victim]);
+		if (mq)
+			return mq;
+	}
+	return NULL;
+}
+
+void 
+skynet_globalmq_push(struct message_queue * queue) {
+	struct global_queue *q = Q;
+	int worker = current_worker(q);
+	struct local_queue *lq = current_local(q, worker);
+	// high priority queues are always shared, any idle worker can pick them up at once.
+	// queues of other NUMA node go back to their home node.
+	if (!(lq && queue->priority != MQ_PRIORITY_HIGH
+		&& (queue->node < 0 || queue->node == worker_node(q, worker))
+		&& localmq_push(lq, queue))) {
+		// not a worker thread, high priority, remote node, or local queue is full
+		globalmq_push(q, queue);
+	}
+	// a parked worker picks it up (or steals it from the local queue)
+	skynet_park_wakeone();
 }
 
 struct message_queue * 
 skynet_globalmq_pop() {
 	struct global_queue *q = Q;
+	int worker = current_worker(q);
+	int node = worker_node(q, worker);
+	struct local_queue *lq = current_local(q, worker);
+	struct message_queue *mq;
+	if (lq == NULL) {
+		mq = globalmq_pop(q, node);
+	} else {
+		mq = worksteal_pop(q, lq, node);
+	}
+	if (mq && mq->node < 0 && q->worker_node && worker >= 0) {
+		// the service sticks to the node of the first worker dispatching it
+		mq->node = node;
+	}
+	return mq;
+}
 
-	SPIN_LOCK(q)
-	struct message_queue *mq  = q->head;
-	if(mq) {
-		q->head = mq->next;
-		if(q->head == NULL) {
-			assert(mq == q->tail);
-			q->tail = NULL;
+// Peek with the locks, so a push finished before (the pusher found no parked worker) is always seen.
+int
+skynet_globalmq_ready(void) {
+	struct global_queue *q = Q;
+	int i;
+	for (i=0;i<q->node_count;i++) {
+		struct node_queue *nq = &q->node[i];
+		SPIN_LOCK(nq)
+		int ready = nq->normal.head || nq->high.head;
+		SPIN_UNLOCK(nq)
+		if (ready)
+			return 1;
+	}
+	for (i=0;i<q->local_count;i++) {
+		struct local_queue *lq = &q->local[i];
+		SPIN_LOCK(lq)
+		int ready = lq->head != lq->tail;
+		SPIN_UNLOCK(lq)
+		if (ready)
+			return 1;
+	}
+	return 0;
+}
+
+uint32_t 
+skynet_mq_handle(struct message_queue *q) {
+	return q->handle;
+}
+
+int
+skynet_mq_priority(struct message_queue *q) {
+	return q->priority;
+}
+
+void
+skynet_mq_setpriority(struct message_queue *q, int priority) {
+	// takes effect the next time the queue is pushed into global queue
+	q->priority = priority;
+}
+
+int
+skynet_mq_overload(struct message_queue *q) {
+	if (q->overload) {
+		int overload = q->overload;
+		q->overload = 0;
+		return overload;
+	} 
+	return 0;
+}
+
+void 
+skynet_mq_init() {
+	struct global_queue *q = skynet_malloc(sizeof(*q));
+	memset(q,0,sizeof(*q));
+	q->node_count = 1;
+	q->node = skynet_malloc(sizeof(struct node_queue));
+	memset(q->node, 0, sizeof(struct node_queue));
+	SPIN_INIT(&q->node[0]);
+	SPIN_INIT(&q->pool);
+	if (pthread_key_create(&q->worker_key, NULL)) {
+		fprintf(stderr, "pthread_key_create failed");
+		exit(1);
+	}
+	Q=q;
+}
+
+void
+skynet_mq_pool(int max) {
+	Q->pool.max = max < 0 ? 0 : max;
+}
+
+void
+skynet_globalmq_worksteal(int workers) {
+	struct global_queue *q = Q;
+	assert(q->local_count == 0 && workers > 0);
+	q->local = skynet_malloc(workers * sizeof(struct local_queue));
+	memset(q->local, 0, workers * sizeof(struct local_queue));
+	int i;
+	for (i=0;i<workers;i++) {
+		SPIN_INIT(&q->local[i]);
+	}
+	q->local_count = workers;
+}
+
+void
+skynet_globalmq_numa(int workers, const int *node) {
+	struct global_queue *q = Q;
+	assert(q->worker_node == NULL && workers > 0);
+	int i;
+	int n = 1;
+	for (i=0;i<workers;i++) {
+		assert(node[i] >= 0);
+		if (node[i] >= n) {
+			n = node[i] + 1;
 		}
-		mq->next = NULL;
 	}
-	SPIN_UNLOCK(q)
+	q->worker_node = skynet_malloc(workers * sizeof(int));
+	memcpy(q->worker_node, node, workers * sizeof(int));
+	struct node_queue *nq = skynet_malloc(n * sizeof(struct node_queue));
+	memset(nq, 0, n * sizeof(struct node_queue));
+	for (i=0;i<n;i++) {
+		SPIN_INIT(&nq[i]);
+	}
+	// the queues launched before workers start (logger, bootstrap) move to node 0
+	nq[0].normal = q->node[0].normal;
+	nq[0].high = q->node[0].high;
+	SPIN_DESTROY(&q->node[0]);
+	skynet_free(q->node);
+	q->node = nq;
+	q->node_count = n;
+}
 
-	return mq;
+void
+skynet_globalmq_initthread(int worker) {
+	struct global_queue *q = Q;
+	assert(worker >= 0 && (q->local_count == 0 || worker < q->local_count));
+	pthread_setspecific(q->worker_key, (void *)(uintptr_t)(worker + 1));
+}
+
+int
+skynet_mq_node(struct message_queue *q) {
+	return q->node;
+}
+
+static void _release(struct message_queue *q);
+
+int
+skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
+	return skynet_mq_pop_batch(q, message, 1) == 0;
+}
+
+static void
+_drop_queue(struct message_queue *q, message_drop drop_func, void *ud) {
+	struct skynet_message msg;
+	while(!skynet_mq_pop(q, &msg)) {
+		drop_func(&msg, ud);
+	}
+	_release(q);
+}
+
+#ifdef USE_LOCKFREE_MQ
+
+static struct mq_segment *
+segment_new(size_t cap) {
+	struct mq_segment *seg = skynet_malloc(sizeof(*seg) + (cap - 1) * sizeof(struct mq_slot));
+	ATOM_INIT(&seg->next, (uintptr_t)NULL);
+	seg->retired = NULL;
+	seg->cap = cap;
+	seg->head = 0;
+	ATOM_INIT(&seg->tail, 0);
+	size_t i;
+	for (i=0;i<cap;i++) {
+		ATOM_INIT(&seg->slot[i].seq, i);
+	}
+	return seg;
+}
+
+static void
+segment_reset(struct mq_segment *seg) {
+	ATOM_INIT(&seg->next, (uintptr_t)NULL);
+	seg->retired = NULL;
+	seg->head = 0;
+	ATOM_INIT(&seg->tail, 0);
+	size_t i;
+	for (i=0;i<seg->cap;i++) {
+		ATOM_INIT(&seg->slot[i].seq, i);
+	}
 }
 
 struct message_queue * 
 skynet_mq_create(uint32_t handle) {
-	struct message_queue *q = skynet_malloc(sizeof(*q));
+	struct mq_segment *seg;
+	// a pooled queue keeps its (reset) first segment
+	struct message_queue *q = mqpool_get(&Q->pool);
+	if (q) {
+		seg = q->head_segment;
+	} else {
+		q = skynet_malloc(sizeof(*q));
+		seg = segment_new(DEFAULT_QUEUE_SIZE);
+	}
+	q->handle = handle;
+	ATOM_INIT(&q->tail_segment, (uintptr_t)seg);
+	q->head_segment = seg;
+	q->retired = NULL;
+	// set in_global flag to avoid push it to global queue before the service init, see below.
+	ATOM_INIT(&q->in_global, MQ_IN_GLOBAL);
+	ATOM_INIT(&q->release, 0);
+	ATOM_INIT(&q->count, 0);
+	q->peak = 0;
+	q->overload = 0;
+	q->overload_threshold = MQ_OVERLOAD;
+	q->priority = MQ_PRIORITY_NORMAL;
+	q->node = -1;
+	q->next = NULL;
+
+	return q;
+}
+
+static void 
+_release(struct message_queue *q) {
+	assert(q->next == NULL);
+	struct mq_segment *seg = q->retired;
+	while (seg) {
+		struct mq_segment *next = seg->retired;
+		skynet_free(seg);
+		seg = next;
+	}
+	q->retired = NULL;
+	seg = q->head_segment;
+	// the queue has only one segment of default size (never grew, or shrank), reuse it
+	if (seg == (struct mq_segment *)ATOM_LOAD(&q->tail_segment) && seg->cap == DEFAULT_QUEUE_SIZE) {
+		segment_reset(seg);
+		if (mqpool_put(&Q->pool, q)) {
+			return;
+		}
+	}
+	while (seg) {
+		struct mq_segment *next = (struct mq_segment *)ATOM_LOAD(&seg->next);
+		skynet_free(seg);
+		seg = next;
+	}
+	skynet_free(q);
+}
+
+int
+skynet_mq_length(struct message_queue *q) {
+	// called by any thread (the socket thread after each push), head of the segments belongs to the consumer.
+	return (int)(ATOM_LOAD(&q->count) & (MQ_PUSHER - 1));
+}
+
+static inline void
+segment_retire(struct message_queue *q, struct mq_segment *seg, struct mq_segment *next) {
+	seg->retired = q->retired;
+	q->retired = seg;
+	q->head_segment = next;
+}
+
+// Free the retired segments if no producer can touch them, called by the consumer.
+// A producer entered after tail_segment moves past them never sees them, so wait for the ones entered before.
+static void
+segment_reclaim(struct message_queue *q) {
+	struct mq_segment *tail = (struct mq_segment *)ATOM_LOAD(&q->tail_segment);
+	struct mq_segment *seg;
+	for (seg = q->retired; seg; seg = seg->retired) {
+		if (seg == tail)
+			return;
+	}
+	if (ATOM_LOAD(&q->count) >= MQ_PUSHER)
+		return;
+	seg = q->retired;
+	while (seg) {
+		struct mq_segment *next = seg->retired;
+		skynet_free(seg);
+		seg = next;
+	}
+	q->retired = NULL;
+}
+
+// The queue is empty, close the head segment and link a smaller one after it,
+// if the queue used less than a quarter of it since the last time it's empty.
+// It fails if a producer takes a slot first, then try again when the queue is empty next time.
+static void
+segment_shrink(struct message_queue *q) {
+	struct mq_segment *seg = q->head_segment;
+	size_t peak = q->peak;
+	q->peak = 0;
+	if (seg->cap == DEFAULT_QUEUE_SIZE || peak * 4 >= seg->cap || ATOM_LOAD(&seg->next))
+		return;
+	if (!ATOM_CAS_SIZET(&seg->tail, seg->head, seg->head | SEGMENT_CLOSED))
+		return;
+	size_t cap = DEFAULT_QUEUE_SIZE;
+	while (cap < peak * 2) {
+		cap *= 2;
+	}
+	// producers see the closed tail, and wait for next like they do after a producer closes it
+	struct mq_segment *next = segment_new(cap);
+	ATOM_STORE(&seg->next, (uintptr_t)next);
+	ATOM_CAS_POINTER(&q->tail_segment, (uintptr_t)seg, (uintptr_t)next);
+	segment_retire(q, seg, next);
+}
+
+// return the slot of the first message, or NULL when the queue is empty (or the first message is still being written)
+static struct mq_slot *
+ready_slot(struct message_queue *q) {
+	struct mq_segment *seg = q->head_segment;
+	for (;;) {
+		struct mq_slot *slot = &seg->slot[seg->head & (seg->cap - 1)];
+		if (ATOM_LOAD(&slot->seq) == seg->head + 1) {
+			return slot;
+		}
+		struct mq_segment *next = (struct mq_segment *)ATOM_LOAD(&seg->next);
+		if (next == NULL || seg->head != (ATOM_LOAD(&seg->tail) & ~SEGMENT_CLOSED)) {
+			return NULL;
+		}
+		// seg is closed and drained
+		segment_retire(q, seg, next);
+		seg = next;
+	}
+}
+
+static void
+take_slot(struct message_queue *q, struct mq_slot *slot, struct skynet_message *message) {
+	struct mq_segment *seg = q->head_segment;
+	*message = slot->message;
+	// make the slot writable for the producer of next round
+	ATOM_STORE(&slot->seq, seg->head + seg->cap);
+	++seg->head;
+}
+
+static int
+acquire_global(struct message_queue *q) {
+	// ATOM_CAS may fail spuriously, retry until in_global is set by anyone
+	while (ATOM_LOAD(&q->in_global) == 0) {
+		if (ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL))
+			return 1;
+	}
+	return 0;
+}
+
+int
+skynet_mq_pop_batch(struct message_queue *q, struct skynet_message *message, int max) {
+	int n = 0;
+	struct mq_slot *slot;
+	if (q->retired) {
+		segment_reclaim(q);
+	}
+	while (n < max && (slot = ready_slot(q))) {
+		take_slot(q, slot, &message[n++]);
+	}
+	if (n > 0) {
+		int length = (int)((ATOM_FSUB(&q->count, n) - n) & (MQ_PUSHER - 1));
+		if (length + n > q->peak) {
+			q->peak = length + n;
+		}
+		while (length > q->overload_threshold) {
+			q->overload = length;
+			q->overload_threshold *= 2;
+		}
+		return n;
+	}
+	// reset overload_threshold when queue is empty
+	q->overload_threshold = MQ_OVERLOAD;
+	// the consumer owns q until in_global is cleared, so shrink it before
+	segment_shrink(q);
+	if (q->retired) {
+		segment_reclaim(q);
+	}
+	ATOM_STORE(&q->in_global, 0);
+	// A producer may push a message before in_global is cleared, and it would not push q into global queue.
+	// So check again, take q back if no producer does it.
+	slot = ready_slot(q);
+	if (slot && acquire_global(q)) {
+		take_slot(q, slot, message);
+		ATOM_FDEC(&q->count);
+		return 1;
+	}
+	return 0;
+}
+
+void 
+skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
+	assert(message);
+	// the segment loaded below can't be freed until we leave
+	ATOM_FADD(&q->count, MQ_PUSHER + 1);
+	for (;;) {
+		struct mq_segment *seg = (struct mq_segment *)ATOM_LOAD(&q->tail_segment);
+		size_t pos = ATOM_LOAD(&seg->tail);
+		if (pos & SEGMENT_CLOSED) {
+			// help to move tail_segment forward, or wait for the producer who closed seg
+			struct mq_segment *next = (struct mq_segment *)ATOM_LOAD(&seg->next);
+			if (next) {
+				ATOM_CAS_POINTER(&q->tail_segment, (uintptr_t)seg, (uintptr_t)next);
+			}
+			continue;
+		}
+		struct mq_slot *slot = &seg->slot[pos & (seg->cap - 1)];
+		size_t seq = ATOM_LOAD(&slot->seq);
+		if (seq == pos) {
+			if (ATOM_CAS_SIZET(&seg->tail, pos, pos + 1)) {
+				slot->message = *message;
+				ATOM_STORE(&slot->seq, pos + 1);
+				break;
+			}
+		} else if ((intptr_t)(seq - pos) < 0) {
+			// seg is full
+			if (ATOM_CAS_SIZET(&seg->tail, pos, pos | SEGMENT_CLOSED)) {
+				struct mq_segment *next = segment_new(seg->cap * 2);
+				ATOM_STORE(&seg->next, (uintptr_t)next);
+				ATOM_CAS_POINTER(&q->tail_segment, (uintptr_t)seg, (uintptr_t)next);
+			}
+		}
+		// else other producer takes the slot, retry
+	}
+	ATOM_FSUB(&q->count, MQ_PUSHER);
+
+	if (acquire_global(q)) {
+		skynet_globalmq_push(q);
+	}
+}
+
+void 
+skynet_mq_mark_release(struct message_queue *q) {
+	assert(ATOM_LOAD(&q->release) == 0);
+	ATOM_STORE(&q->release, 1);
+	if (acquire_global(q)) {
+		skynet_globalmq_push(q);
+	}
+}
+
+void 
+skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud) {
+	if (ATOM_LOAD(&q->release)) {
+		_drop_queue(q, drop_func, ud);
+	} else {
+		skynet_globalmq_push(q);
+	}
+}
+
+#else
+
+struct message_queue * 
+skynet_mq_create(uint32_t handle) {
+	// a pooled queue keeps its message array of DEFAULT_QUEUE_SIZE
+	struct message_queue *q = mqpool_get(&Q->pool);
+	if (q == NULL) {
+		q = skynet_malloc(sizeof(*q));
+		SPIN_INIT(q)
+		q->queue = skynet_malloc(sizeof(struct skynet_message) * DEFAULT_QUEUE_SIZE);
+	}
 	q->handle = handle;
 	q->cap = DEFAULT_QUEUE_SIZE;
 	q->head = 0;
 	q->tail = 0;
-	SPIN_INIT(q)
 	// When the queue is create (always between service create and service init) ,
 	// set in_global flag to avoid push it to global queue .
 	// If the service init success, skynet_context_new will call skynet_mq_push to push it to global queue.
@@ -91,7 +840,8 @@ skynet_mq_create(uint32_t handle) {
 	q->release = 0;
 	q->overload = 0;
 	q->overload_threshold = MQ_OVERLOAD;
-	q->queue = skynet_malloc(sizeof(struct skynet_message) * q->cap);
+	q->priority = MQ_PRIORITY_NORMAL;
+	q->node = -1;
 	q->next = NULL;
 
 	return q;
@@ -100,16 +850,14 @@ skynet_mq_create(uint32_t handle) {
 static void 
 _release(struct message_queue *q) {
 	assert(q->next == NULL);
+	if (q->cap == DEFAULT_QUEUE_SIZE && mqpool_put(&Q->pool, q)) {
+		return;
+	}
 	SPIN_DESTROY(q)
 	skynet_free(q->queue);
 	skynet_free(q);
 }
 
-uint32_t 
-skynet_mq_handle(struct message_queue *q) {
-	return q->handle;
-}
-
 int
 skynet_mq_length(struct message_queue *q) {
 	int head, tail,cap;
@@ -127,33 +875,21 @@ skynet_mq_length(struct message_queue *q) {
 }
 
 int
-skynet_mq_overload(struct message_queue *q) {
-	if (q->overload) {
-		int overload = q->overload;
-		q->overload = 0;
-		return overload;
-	} 
-	return 0;
-}
-
-int
-skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
-	int ret = 1;
+skynet_mq_pop_batch(struct message_queue *q, struct skynet_message *message, int max) {
+	int n = 0;
 	SPIN_LOCK(q)
 
-	if (q->head != q->tail) {
-		*message = q->queue[q->head++];
-		ret = 0;
-		int head = q->head;
-		int tail = q->tail;
-		int cap = q->cap;
-
-		if (head >= cap) {
-			q->head = head = 0;
+	while (n < max && q->head != q->tail) {
+		message[n++] = q->queue[q->head++];
+		if (q->head >= q->cap) {
+			q->head = 0;
 		}
-		int length = tail - head;
+	}
+
+	if (n > 0) {
+		int length = q->tail - q->head;
 		if (length < 0) {
-			length += cap;
+			length += q->cap;
 		}
 		while (length > q->overload_threshold) {
 			q->overload = length;
@@ -162,15 +898,12 @@ skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
 	} else {
 		// reset overload_threshold when queue is empty
 		q->overload_threshold = MQ_OVERLOAD;
-	}
-
-	if (ret) {
 		q->in_global = 0;
 	}
 	
 	SPIN_UNLOCK(q)
 
-	return ret;
+	return n;
 }
 
 static void
@@ -202,20 +935,19 @@ skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
 		expand_queue(q);
 	}
 
+	int push = 0;
 	if (q->in_global == 0) {
 		q->in_global = MQ_IN_GLOBAL;
-		skynet_globalmq_push(q);
+		push = 1;
 	}
 	
 	SPIN_UNLOCK(q)
-}
 
-void 
-skynet_mq_init() {
-	struct global_queue *q = skynet_malloc(sizeof(*q));
-	memset(q,0,sizeof(*q));
-	SPIN_INIT(q);
-	Q=q;
+	// in_global is set, so nobody else pushes it. Push (and wake a worker) out of the lock,
+	// or the woken worker may spin on the lock held by a preempted producer.
+	if (push) {
+		skynet_globalmq_push(q);
+	}
 }
 
 void 
@@ -229,15 +961,6 @@ skynet_mq_mark_release(struct message_queue *q) {
 	SPIN_UNLOCK(q)
 }
 
-static void
-_drop_queue(struct message_queue *q, message_drop drop_func, void *ud) {
-	struct skynet_message msg;
-	while(!skynet_mq_pop(q, &msg)) {
-		drop_func(&msg, ud);
-	}
-	_release(q);
-}
-
 void 
 skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud) {
 	SPIN_LOCK(q)
@@ -250,3 +973,5 @@ skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud) {
 		SPIN_UNLOCK(q)
 	}
 }
+
+#endif
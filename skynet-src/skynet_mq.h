@@ -20,8 +20,18 @@ struct skynet_message {
 
 struct message_queue;
 
+#define MQ_PRIORITY_NORMAL 0
+#define MQ_PRIORITY_HIGH 1
+
 void skynet_globalmq_push(struct message_queue * queue);
 struct message_queue * skynet_globalmq_pop(void);
+// 1 if any queue is ready in the global queue or the local queues of workers, it doesn't pop
+int skynet_globalmq_ready(void);
+// enable per worker run queues with work stealing, call before workers start
+void skynet_globalmq_worksteal(int workers);
+// enable NUMA mode, node[i] is the NUMA node of worker i. call before workers start
+void skynet_globalmq_numa(int workers, const int *node);
+void skynet_globalmq_initthread(int worker);
 
 struct message_queue * skynet_mq_create(uint32_t handle);
 void skynet_mq_mark_release(struct message_queue *q);
@@ -33,12 +43,21 @@ uint32_t skynet_mq_handle(struct message_queue *);
 
 // 0 for success
 int skynet_mq_pop(struct message_queue *q, struct skynet_message *message);
+// pop at most max messages at once, return the number of messages (0 for empty)
+int skynet_mq_pop_batch(struct message_queue *q, struct skynet_message *message, int max);
 void skynet_mq_push(struct message_queue *q, struct skynet_message *message);
 
 // return the length of message queue, for debug
 int skynet_mq_length(struct message_queue *q);
 int skynet_mq_overload(struct message_queue *q);
+// high priority queues are served first by the scheduler
+int skynet_mq_priority(struct message_queue *q);
+void skynet_mq_setpriority(struct message_queue *q, int priority);
+// home NUMA node of the service, -1 for none
+int skynet_mq_node(struct message_queue *q);
 
 void skynet_mq_init();
+// keep at most max released queues (which never grew) for reuse, 0 : off
+void skynet_mq_pool(int max);
 
 #endif
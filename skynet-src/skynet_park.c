@@ -0,0 +1,189 @@
+#include "skynet.h"
+#include "skynet_park.h"
+#include "spinlock.h"
+#include "atomic.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct worker_park {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int token;	// set by waker, cleared by the worker
+	int parked;	// in idle stack, protected by park.lock
+};
+
+struct park {
+	int count;
+	struct worker_park *w;
+	struct spinlock lock;
+	int top;
+	int *stack;
+	ATOM_INT idle;	// the same as top, for reading without lock
+	ATOM_ULONG wakeup;
+	ATOM_ULONG spurious;
+};
+
+static struct park *P = NULL;
+
+void
+skynet_park_init(int workers) {
+	struct park *p = skynet_malloc(sizeof(*p));
+	memset(p, 0, sizeof(*p));
+	p->count = workers;
+	p->w = skynet_malloc(workers * sizeof(struct worker_park));
+	p->stack = skynet_malloc(workers * sizeof(int));
+	int i;
+	for (i=0;i<workers;i++) {
+		struct worker_park *w = &p->w[i];
+		if (pthread_mutex_init(&w->mutex, NULL)) {
+			fprintf(stderr, "Init mutex error");
+			exit(1);
+		}
+		if (pthread_cond_init(&w->cond, NULL)) {
+			fprintf(stderr, "Init cond error");
+			exit(1);
+		}
+		w->token = 0;
+		w->parked = 0;
+	}
+	SPIN_INIT(p);
+	ATOM_INIT(&p->idle, 0);
+	ATOM_INIT(&p->wakeup, 0);
+	ATOM_INIT(&p->spurious, 0);
+	P = p;
+}
+
+void
+skynet_park_exit(void) {
+	struct park *p = P;
+	if (p == NULL)
+		return;
+	P = NULL;
+	int i;
+	for (i=0;i<p->count;i++) {
+		pthread_mutex_destroy(&p->w[i].mutex);
+		pthread_cond_destroy(&p->w[i].cond);
+	}
+	SPIN_DESTROY(p);
+	skynet_free(p->stack);
+	skynet_free(p->w);
+	skynet_free(p);
+}
+
+int
+skynet_park_idle(void) {
+	struct park *p = P;
+	if (p == NULL)
+		return 0;
+	return ATOM_LOAD(&p->idle);
+}
+
+void
+skynet_park_prepare(int worker) {
+	struct park *p = P;
+	struct worker_park *w = &p->w[worker];
+	SPIN_LOCK(p)
+	if (!w->parked) {
+		w->parked = 1;
+		p->stack[p->top++] = worker;
+		ATOM_STORE(&p->idle, p->top);
+	}
+	SPIN_UNLOCK(p)
+}
+
+void
+skynet_park_cancel(int worker) {
+	struct park *p = P;
+	struct worker_park *w = &p->w[worker];
+	SPIN_LOCK(p)
+	if (w->parked) {
+		int i;
+		for (i=p->top-1;i>=0;i--) {
+			if (p->stack[i] == worker) {
+				memmove(&p->stack[i], &p->stack[i+1], (p->top - i - 1) * sizeof(int));
+				break;
+			}
+		}
+		--p->top;
+		w->parked = 0;
+		ATOM_STORE(&p->idle, p->top);
+	}
+	// If a waker popped it already, the token is kept and the next wait returns at once.
+	SPIN_UNLOCK(p)
+}
+
+void
+skynet_park_wait(int worker) {
+	struct worker_park *w = &P->w[worker];
+	pthread_mutex_lock(&w->mutex);
+	while (!w->token) {
+		pthread_cond_wait(&w->cond, &w->mutex);
+	}
+	w->token = 0;
+	pthread_mutex_unlock(&w->mutex);
+}
+
+static void
+signal_worker(struct worker_park *w) {
+	pthread_mutex_lock(&w->mutex);
+	w->token = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+void
+skynet_park_wakeone(void) {
+	struct park *p = P;
+	// Read without lock, it's on the path of every global queue push.
+	// A worker parking at the same time may be missed, the timer thread wakes one every tick if all workers are parked.
+	if (p == NULL || ATOM_LOAD(&p->idle) == 0)
+		return;
+	SPIN_LOCK(p)
+	if (p->top == 0) {
+		SPIN_UNLOCK(p)
+		return;
+	}
+	int worker = p->stack[--p->top];
+	p->w[worker].parked = 0;
+	ATOM_STORE(&p->idle, p->top);
+	SPIN_UNLOCK(p)
+	ATOM_FINC(&p->wakeup);
+	signal_worker(&p->w[worker]);
+}
+
+void
+skynet_park_wakeall(void) {
+	struct park *p = P;
+	SPIN_LOCK(p)
+	int i;
+	for (i=0;i<p->top;i++) {
+		p->w[p->stack[i]].parked = 0;
+	}
+	p->top = 0;
+	ATOM_STORE(&p->idle, 0);
+	SPIN_UNLOCK(p)
+	// set the token of every worker, include the ones not parked yet
+	for (i=0;i<p->count;i++) {
+		signal_worker(&p->w[i]);
+	}
+}
+
+void
+skynet_park_spurious(void) {
+	ATOM_FINC(&P->spurious);
+}
+
+void
+skynet_park_stat(uint64_t *wakeup, uint64_t *spurious) {
+	struct park *p = P;
+	if (p == NULL) {
+		*wakeup = 0;
+		*spurious = 0;
+		return;
+	}
+	*wakeup = ATOM_LOAD(&p->wakeup);
+	*spurious = ATOM_LOAD(&p->spurious);
+}
@@ -0,0 +1,27 @@
+#ifndef SKYNET_PARK_H
+#define SKYNET_PARK_H
+
+#include <stdint.h>
+
+// Idle workers park on their own condition variable, and push themselves into an idle stack.
+// A waker pops one worker from the stack and signals it only, so there is no thundering herd.
+
+void skynet_park_init(int workers);
+void skynet_park_exit(void);
+
+// number of parked workers
+int skynet_park_idle(void);
+// push the worker into idle stack, it should check for work again before skynet_park_wait
+void skynet_park_prepare(int worker);
+// remove the worker from idle stack, if it found work after skynet_park_prepare
+void skynet_park_cancel(int worker);
+void skynet_park_wait(int worker);
+// wake one parked worker (the last parked one), do nothing if no one is parked
+void skynet_park_wakeone(void);
+// wake all workers, for exit
+void skynet_park_wakeall(void);
+
+void skynet_park_spurious(void);
+void skynet_park_stat(uint64_t *wakeup, uint64_t *spurious);
+
+#endif
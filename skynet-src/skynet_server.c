@@ -10,6 +10,8 @@
 #include "skynet_monitor.h"
 #include "skynet_imp.h"
 #include "skynet_log.h"
+#include "skynet_park.h"
+#include "skynet_socket.h"
 #include "spinlock.h"
 #include "atomic.h"
 
@@ -18,9 +20,13 @@
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdbool.h>
 
+// max number of messages popped from a service queue at once
+#define DISPATCH_BATCH 64
+
 #ifdef CALLING_CHECK
 
 #define CHECKCALLING_BEGIN(ctx) if (!(spinlock_trylock(&ctx->calling))) { assert(0); }
@@ -39,6 +45,16 @@
 
 #endif
 
+#define NAME_CACHE_SIZE 8	// 2^n
+#define NAME_CACHE_LENGTH 32
+
+// resolved ".name" of skynet_sendname, valid while gen equals skynet_handle_namegen()
+struct name_cache {
+	size_t gen;
+	uint32_t handle;
+	char name[NAME_CACHE_LENGTH];
+};
+
 struct skynet_context {
 	void * instance;            // 由指定module的create函数，创建的数据实例指针，同一类服务可能有多个实例，
                                 // 因此每个服务都应该有自己的数据
@@ -54,19 +70,34 @@ struct skynet_context {
 	int session_id;             // 在发出请求后，收到对方的返回消息时，通过session_id来匹配一个返回，对应哪个请求
 	ATOM_INT ref;               // 引用计数变量，当为0时，表示内存可以被释放
 	int message_count;
+	int quota;	// messages drained in the last dispatch
+	double msg_cost;	// moving average of cpu cost per message (in microsec), for adaptive dispatch
 	bool init;                  // 是否完成初始化
 	bool endless;               // 消息是否堵住
 	bool profile;
+	bool timer_batch;	// see TIMER_BATCH
+	struct name_cache name_cache[NAME_CACHE_SIZE];	// only used by the thread dispatching this context
+	struct skynet_context * next;	// in context pool
 
 	CHECKCALLING_DECL
 };
 
+// released contexts kept for reuse, for services created and killed frequently
+struct context_pool {
+	struct spinlock lock;
+	int count;
+	int max;	// 0 means pool mode is off
+	struct skynet_context * head;
+};
+
 struct skynet_node {
 	ATOM_INT total;
 	int init;
 	uint32_t monitor_exit;
 	pthread_key_t handle_key;
 	bool profile;	// default is on
+	int dispatch_slice;	// in microsec, 0 means use the static weight of each worker
+	struct context_pool pool;
 };
 
 static struct skynet_node G_NODE;
@@ -110,6 +141,24 @@ id_to_hex(char * str, uint32_t id) {
 	str[9] = '\0';
 }
 
+// an inline socket message is freed with its data, by the receiver of the data
+static inline bool
+inline_message(struct skynet_message *msg) {
+	return (msg->sz >> MESSAGE_TYPE_SHIFT) == PTYPE_SOCKET &&
+		skynet_socket_message_inline(msg->data, msg->sz & MESSAGE_TYPE_MASK);
+}
+
+// free a message not dispatched
+static void
+free_message(struct skynet_message *msg) {
+	if (inline_message(msg)) {
+		struct skynet_socket_message *sm = msg->data;
+		skynet_socket_free_buffer(sm->buffer);
+	} else {
+		skynet_free(msg->data);
+	}
+}
+
 struct drop_t {
 	uint32_t handle;
 };
@@ -119,13 +168,50 @@ drop_message(struct skynet_message *msg, void *ud) {
 	// 为什么要用结构
 	struct drop_t *d = ud;
 	// 释放空间
-	skynet_free(msg->data);
+	free_message(msg);
 	// 获取地址
 	uint32_t source = d->handle;
 	assert(source);
 	// report error to the message source
 	skynet_send(NULL, source, msg->source, PTYPE_ERROR, msg->session, NULL, 0);
 }
+static struct skynet_context *
+context_alloc() {
+	struct context_pool *p = &G_NODE.pool;
+	struct skynet_context * ctx = NULL;
+	if (p->max > 0) {
+		SPIN_LOCK(p)
+		ctx = p->head;
+		if (ctx) {
+			p->head = ctx->next;
+			--p->count;
+		}
+		SPIN_UNLOCK(p)
+	}
+	if (ctx == NULL) {
+		ctx = skynet_malloc(sizeof(*ctx));
+	}
+	return ctx;
+}
+
+static void
+context_free(struct skynet_context *ctx) {
+	struct context_pool *p = &G_NODE.pool;
+	if (p->max > 0) {
+		SPIN_LOCK(p)
+		if (p->count < p->max) {
+			ctx->next = p->head;
+			p->head = ctx;
+			++p->count;
+			ctx = NULL;
+		}
+		SPIN_UNLOCK(p)
+	}
+	if (ctx) {
+		skynet_free(ctx);
+	}
+}
+
 // new skynet_context ？？
 struct skynet_context * 
 skynet_context_new(const char * name, const char *param) {
@@ -139,7 +225,7 @@ skynet_context_new(const char * name, const char *param) {
 	if (inst == NULL)
 		return NULL;
 	// 分配内存
-	struct skynet_context * ctx = skynet_malloc(sizeof(*ctx));
+	struct skynet_context * ctx = context_alloc();
 	CHECKCALLING_INIT(ctx)
 
 	ctx->mod = mod;
@@ -156,7 +242,12 @@ skynet_context_new(const char * name, const char *param) {
 	ctx->cpu_cost = 0;
 	ctx->cpu_start = 0;
 	ctx->message_count = 0;
+	ctx->quota = 0;
+	ctx->msg_cost = 0;
 	ctx->profile = G_NODE.profile;
+	ctx->timer_batch = false;
+	memset(ctx->name_cache, 0, sizeof(ctx->name_cache));
+	ctx->next = NULL;
 	// Should set to 0 first to avoid skynet_handle_retireall get an uninitialized handle
 	ctx->handle = 0;
 	// 	
@@ -229,7 +320,8 @@ delete_context(struct skynet_context *ctx) {
 	skynet_module_instance_release(ctx->mod, ctx->instance);
 	skynet_mq_mark_release(ctx->queue);
 	CHECKCALLING_DESTROY(ctx)
-	skynet_free(ctx);
+	// nobody holds ctx now (the handle is retired before the last release), so it can be reused
+	context_free(ctx);
 	context_dec();
 }
 
@@ -256,6 +348,19 @@ skynet_context_push(uint32_t handle, struct skynet_message *message) {
 
 	return 0;
 }
+
+int
+skynet_context_push_length(uint32_t handle, struct skynet_message *message) {
+	struct skynet_context * ctx = skynet_handle_grab(handle);
+	if (ctx == NULL) {
+		return -1;
+	}
+	skynet_mq_push(ctx->queue, message);
+	int length = skynet_mq_length(ctx->queue);
+	skynet_context_release(ctx);
+
+	return length;
+}
 // 是否死循环？？
 void 
 skynet_context_endless(uint32_t handle) {
@@ -294,16 +399,17 @@ dispatch_message(struct skynet_context *ctx, struct skynet_message *msg) {
 	}
 	// 消息数量自增
 	++ctx->message_count;
-	int reserve_msg;
+	// check it before the callback, which may free the inline message with its data
+	int reserve_msg = inline_message(msg);
 	if (ctx->profile) {
 		ctx->cpu_start = skynet_thread_time();
 		// 回调？？
 		// 哪里处理判断消息类型，然后回调
-		reserve_msg = ctx->cb(ctx, ctx->cb_ud, type, msg->session, msg->source, msg->data, sz);
+		reserve_msg |= ctx->cb(ctx, ctx->cb_ud, type, msg->session, msg->source, msg->data, sz);
 		uint64_t cost_time = skynet_thread_time() - ctx->cpu_start;
 		ctx->cpu_cost += cost_time;
 	} else {
-		reserve_msg = ctx->cb(ctx, ctx->cb_ud, type, msg->session, msg->source, msg->data, sz);
+		reserve_msg |= ctx->cb(ctx, ctx->cb_ud, type, msg->session, msg->source, msg->data, sz);
 	}
 	if (!reserve_msg) {
 		skynet_free(msg->data);
@@ -321,6 +427,37 @@ skynet_context_dispatchall(struct skynet_context * ctx) {
 	}
 }
 
+// how many messages can be dispatched in one slice, estimated by the average cost per message
+static int
+adaptive_quota(struct skynet_context *ctx, int length) {
+	if (length < 1) {
+		length = 1;
+	}
+	if (ctx->msg_cost <= 0) {
+		// cheaper than the resolution of thread time
+		return length;
+	}
+	double n = G_NODE.dispatch_slice / ctx->msg_cost;
+	if (n >= length) {
+		return length;
+	}
+	return n < 1 ? 1 : (int)n;
+}
+
+static void
+update_cost(struct skynet_context *ctx, uint64_t cpu_cost, int message_count) {
+	int count = ctx->message_count - message_count;
+	ctx->quota = count;
+	if (!ctx->profile || count <= 0)
+		return;
+	double cost = (double)(ctx->cpu_cost - cpu_cost) / count;
+	if (ctx->msg_cost == 0) {
+		ctx->msg_cost = cost;
+	} else {
+		ctx->msg_cost = (ctx->msg_cost * 7 + cost) / 8;
+	}
+}
+
 // 分发消息
 struct message_queue * 
 skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue *q, int weight) {
@@ -341,33 +478,53 @@ skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue
 	}
 
 	int i,n=1;
-	struct skynet_message msg;
-
-	for (i=0;i<n;i++) {
-		if (skynet_mq_pop(q,&msg)) {
+	if (G_NODE.dispatch_slice > 0 && ctx->profile && ctx->message_count > 0) {
+		// adaptive mode : drain as many messages as fit in one slice, instead of the static weight
+		n = adaptive_quota(ctx, skynet_mq_length(q));
+	} else if (weight >= 0) {
+		n = skynet_mq_length(q) >> weight;
+		if (n < 1) {
+			n = 1;
+		}
+	}
+	uint64_t cpu_cost = ctx->cpu_cost;
+	int message_count = ctx->message_count;
+	// pop messages into a local buffer batch by batch, lock the queue once per batch
+	struct skynet_message msg[DISPATCH_BATCH];
+
+	for (i=0;i<n;) {
+		int batch = n - i;
+		if (batch > DISPATCH_BATCH) {
+			batch = DISPATCH_BATCH;
+		}
+		int count = skynet_mq_pop_batch(q, msg, batch);
+		if (count == 0) {
+			update_cost(ctx, cpu_cost, message_count);
 			skynet_context_release(ctx);
 			return skynet_globalmq_pop();
-		} else if (i==0 && weight >= 0) {
-			n = skynet_mq_length(q);
-			n >>= weight;
 		}
+		i += count;
 		// 预警
 		int overload = skynet_mq_overload(q);
 		if (overload) {
 			skynet_error(ctx, "May overload, message queue length = %d", overload);
 		}
-		// 处理一个消息，版本号增加
-		skynet_monitor_trigger(sm, msg.source , handle);
+		int j;
+		for (j=0;j<count;j++) {
+			// 处理一个消息，版本号增加
+			skynet_monitor_trigger(sm, msg[j].source , handle);
+
+			if (ctx->cb == NULL) {
+				free_message(&msg[j]);
+			} else {
+				dispatch_message(ctx, &msg[j]);
+			}
 
-		if (ctx->cb == NULL) {
-			skynet_free(msg.data);
-		} else {
-			dispatch_message(ctx, &msg);
+			skynet_monitor_trigger(sm, 0,0);
 		}
-
-		skynet_monitor_trigger(sm, 0,0);
 	}
 
+	update_cost(ctx, cpu_cost, message_count);
 	assert(q == ctx->queue);
 	struct message_queue *nq = skynet_globalmq_pop();
 	if (nq) {
@@ -404,6 +561,11 @@ skynet_queryname(struct skynet_context * context, const char * name) {
 	return 0;
 }
 
+int
+skynet_namelist(struct skynet_context * context, void (*cb)(void *ud, const char *name, uint32_t handle), void *ud) {
+	return skynet_handle_namelist(cb, ud);
+}
+
 static void
 handle_exit(struct skynet_context * context, uint32_t handle) {
 	if (handle == 0) {
@@ -426,15 +588,45 @@ struct command_func {
 };
 
 static const char *
-cmd_timeout(struct skynet_context * context, const char * param) {
+timeout(struct skynet_context * context, const char * param, int flag) {
 	char * session_ptr = NULL;
 	int ti = strtol(param, &session_ptr, 10);
 	int session = skynet_context_newsession(context);
-	skynet_timeout(context->handle, ti, session);
+	if (context->timer_batch) {
+		flag |= TIMER_BATCH;
+	}
+	skynet_timeout_flag(context->handle, ti, session, flag);
 	sprintf(context->result, "%d", session);
 	return context->result;
 }
 
+static const char *
+cmd_timeout(struct skynet_context * context, const char * param) {
+	return timeout(context, param, 0);
+}
+
+static const char *
+cmd_timeoutms(struct skynet_context * context, const char * param) {
+	return timeout(context, param, TIMER_MS);
+}
+
+static const char *
+cmd_timercancel(struct skynet_context * context, const char * param) {
+	int session = strtol(param, NULL, 10);
+	int r = skynet_timeout_cancel(context->handle, session);
+	sprintf(context->result, "%d", r);
+	return context->result;
+}
+
+static const char *
+cmd_timerbatch(struct skynet_context * context, const char * param) {
+	if (param && param[0] != '\0') {
+		context->timer_batch = strtol(param, NULL, 10) != 0;
+	}
+	sprintf(context->result, "%d", context->timer_batch ? 1 : 0);
+	return context->result;
+}
+
 static const char *
 cmd_reg(struct skynet_context * context, const char * param) {
 	if (param == NULL || param[0] == '\0') {
@@ -605,12 +797,38 @@ cmd_stat(struct skynet_context * context, const char * param) {
 		}
 	} else if (strcmp(param, "message") == 0) {
 		sprintf(context->result, "%d", context->message_count);
+	} else if (strcmp(param, "msgcost") == 0) {
+		// in microsec, a second would round the cost of most messages to 0
+		sprintf(context->result, "%lf", context->msg_cost);
+	} else if (strcmp(param, "quota") == 0) {
+		sprintf(context->result, "%d", context->quota);
+	} else if (strcmp(param, "node") == 0) {
+		sprintf(context->result, "%d", skynet_mq_node(context->queue));
+	} else if (strcmp(param, "wakeup") == 0) {
+		// worker wakeups of the whole node
+		uint64_t wakeup, spurious;
+		skynet_park_stat(&wakeup, &spurious);
+		sprintf(context->result, "%" PRIu64, wakeup);
+	} else if (strcmp(param, "spurious") == 0) {
+		uint64_t wakeup, spurious;
+		skynet_park_stat(&wakeup, &spurious);
+		sprintf(context->result, "%" PRIu64, spurious);
 	} else {
 		context->result[0] = '\0';
 	}
 	return context->result;
 }
 
+static const char *
+cmd_priority(struct skynet_context * context, const char * param) {
+	if (param && param[0] != '\0') {
+		int priority = strtol(param, NULL, 10) > 0 ? MQ_PRIORITY_HIGH : MQ_PRIORITY_NORMAL;
+		skynet_mq_setpriority(context->queue, priority);
+	}
+	sprintf(context->result, "%d", skynet_mq_priority(context->queue));
+	return context->result;
+}
+
 static const char *
 cmd_logon(struct skynet_context * context, const char * param) {
 	uint32_t handle = tohandle(context, param);
@@ -675,6 +893,9 @@ cmd_signal(struct skynet_context * context, const char * param) {
 
 static struct command_func cmd_funcs[] = {
 	{ "TIMEOUT", cmd_timeout },
+	{ "TIMEOUTMS", cmd_timeoutms },
+	{ "TIMERCANCEL", cmd_timercancel },
+	{ "TIMERBATCH", cmd_timerbatch },
 	{ "REG", cmd_reg },
 	{ "QUERY", cmd_query },
 	{ "NAME", cmd_name },
@@ -687,6 +908,7 @@ static struct command_func cmd_funcs[] = {
 	{ "ABORT", cmd_abort },
 	{ "MONITOR", cmd_monitor },
 	{ "STAT", cmd_stat },
+	{ "PRIORITY", cmd_priority },
 	{ "LOGON", cmd_logon },
 	{ "LOGOFF", cmd_logoff },
 	{ "SIGNAL", cmd_signal },
@@ -802,6 +1024,32 @@ skynet_send(
 	return session;
 }
 
+static uint32_t
+findname_cached(struct skynet_context * context, const char * name) {
+	size_t len = strlen(name);
+	if (len >= NAME_CACHE_LENGTH) {
+		return skynet_handle_findname(name);
+	}
+	uint32_t h = (uint32_t)len;
+	size_t i;
+	for (i=0;i<len;i++) {
+		h = h * 31 + (unsigned char)name[i];
+	}
+	struct name_cache *c = &context->name_cache[h & (NAME_CACHE_SIZE-1)];
+	// read the generation before the lookup, so a name changed after it invalidates the entry
+	size_t gen = skynet_handle_namegen();
+	if (c->gen == gen && memcmp(c->name, name, len+1) == 0) {
+		return c->handle;
+	}
+	uint32_t handle = skynet_handle_findname(name);
+	if (handle) {
+		c->gen = gen;
+		c->handle = handle;
+		memcpy(c->name, name, len+1);
+	}
+	return handle;
+}
+
 int
 skynet_sendname(struct skynet_context * context, uint32_t source, const char * addr , int type, int session, void * data, size_t sz) {
 	// contest -> handle 为什么名字是handle呢？？
@@ -815,7 +1063,7 @@ skynet_sendname(struct skynet_context * context, uint32_t source, const char * a
 		des = strtoul(addr+1, NULL, 16);
 	} else if (addr[0] == '.') {
 		// .开始的是别名，此处要去找名字对应地址
-		des = skynet_handle_findname(addr + 1);
+		des = findname_cached(context, addr + 1);
 		if (des == 0) {
 			if (type & PTYPE_TAG_DONTCOPY) {
 				skynet_free(data);
@@ -879,6 +1127,10 @@ skynet_globalinit(void) {
 	ATOM_INIT(&G_NODE.total , 0);
 	G_NODE.monitor_exit = 0;
 	G_NODE.init = 1;
+	SPIN_INIT(&G_NODE.pool)
+	G_NODE.pool.count = 0;
+	G_NODE.pool.max = 0;
+	G_NODE.pool.head = NULL;
 	if (pthread_key_create(&G_NODE.handle_key, NULL)) {
 		fprintf(stderr, "pthread_key_create failed");
 		exit(1);
@@ -902,3 +1154,13 @@ void
 skynet_profile_enable(int enable) {
 	G_NODE.profile = (bool)enable;
 }
+
+void
+skynet_context_pool(int max) {
+	G_NODE.pool.max = max < 0 ? 0 : max;
+}
+
+void
+skynet_dispatch_slice(int microsec) {
+	G_NODE.dispatch_slice = microsec < 0 ? 0 : microsec;
+}
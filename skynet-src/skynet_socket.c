@@ -11,11 +11,28 @@
 #include <string.h>
 #include <stdbool.h>
 
+#define MAX_SOCKET_BATCH 64
+#define BATCH_ADDR_SIZE 64
+
+// Pooled DATA messages and the ACCEPT messages of pooled listen sockets to a busy service (its queue
+// is not empty after a push) are coalesced into one SKYNET_SOCKET_TYPE_BATCH message,
+// until the socket thread waits for new events (SOCKET_IDLE).
+struct socket_batch {
+	uint32_t owner;	// 0 : not busy
+	int n;
+	struct skynet_socket_message msg[MAX_SOCKET_BATCH];
+	char addr[MAX_SOCKET_BATCH][BATCH_ADDR_SIZE];	// the address of ACCEPT
+};
+
 static struct socket_server * SOCKET_SERVER = NULL;
+static struct socket_batch * SOCKET_BATCH = NULL;	// one for each socket thread
 
 void 
-skynet_socket_init() {
-	SOCKET_SERVER = socket_server_create(skynet_now());
+skynet_socket_init(int poller, int max_socket, int accept_batch) {
+	assert(sizeof(struct skynet_socket_message) <= SOCKET_RECV_HEADER);
+	SOCKET_SERVER = socket_server_create(skynet_now(), poller, max_socket, accept_batch);
+	SOCKET_BATCH = skynet_malloc(poller * sizeof(struct socket_batch));
+	memset(SOCKET_BATCH, 0, poller * sizeof(struct socket_batch));
 }
 
 void
@@ -27,6 +44,8 @@ void
 skynet_socket_free() {
 	socket_server_release(SOCKET_SERVER);
 	SOCKET_SERVER = NULL;
+	skynet_free(SOCKET_BATCH);
+	SOCKET_BATCH = NULL;
 }
 
 void
@@ -34,6 +53,143 @@ skynet_socket_updatetime() {
 	socket_server_updatetime(SOCKET_SERVER, skynet_now());
 }
 
+// return the queue length of the owner after push, -1 when the owner is gone
+static int
+push_message(uint32_t owner, struct skynet_socket_message *sm, size_t sz) {
+	struct skynet_message message;
+	message.source = 0;
+	message.session = 0;
+	message.data = sm;
+	message.sz = sz | ((size_t)PTYPE_SOCKET << MESSAGE_TYPE_SHIFT);
+
+	return skynet_context_push_length(owner, &message);
+}
+
+// The header is written into the pooled block, just before the data, so the message is one block
+// and it's released with the data by skynet_socket_free_buffer (see skynet_socket_message_inline).
+static int
+push_inline(uint32_t owner, int id, int size, char *data) {
+	struct skynet_socket_message *sm = (struct skynet_socket_message *)(data - sizeof(*sm));
+	sm->type = SKYNET_SOCKET_TYPE_DATA;
+	sm->id = id;
+	sm->ud = size;
+	sm->buffer = data;
+	int length = push_message(owner, sm, sizeof(*sm) + size);
+	if (length < 0) {
+		socket_server_free_buffer(SOCKET_SERVER, data);
+	}
+	return length;
+}
+
+// the same layout as forward_message with padding
+static int
+push_accept(uint32_t owner, int id, int newid, const char *addr) {
+	size_t len = strlen(addr);
+	struct skynet_socket_message *sm = skynet_malloc(sizeof(*sm) + len);
+	sm->type = SKYNET_SOCKET_TYPE_ACCEPT;
+	sm->id = id;
+	sm->ud = newid;
+	sm->buffer = NULL;
+	memcpy(sm+1, addr, len);
+	int length = push_message(owner, sm, sizeof(*sm) + len);
+	if (length < 0) {
+		skynet_free(sm);
+	}
+	return length;
+}
+
+static int
+push_single(uint32_t owner, struct skynet_socket_message *sm, const char *addr) {
+	if (sm->type == SKYNET_SOCKET_TYPE_ACCEPT) {
+		return push_accept(owner, sm->id, sm->ud, addr);
+	} else {
+		return push_inline(owner, sm->id, sm->ud, sm->buffer);
+	}
+}
+
+// The entries follow the header, and the addresses of ACCEPT (zero terminated) follow the entries.
+static void
+flush_batch(struct socket_batch *b) {
+	int n = b->n;
+	b->n = 0;
+	if (n == 0) {
+		return;
+	} else if (n == 1) {
+		push_single(b->owner, &b->msg[0], b->addr[0]);
+		return;
+	}
+	int i;
+	size_t sz = sizeof(struct skynet_socket_message) * (n + 1);
+	size_t addr_sz = 0;
+	for (i=0;i<n;i++) {
+		if (b->msg[i].type == SKYNET_SOCKET_TYPE_ACCEPT) {
+			addr_sz += strlen(b->addr[i]) + 1;
+		}
+	}
+	struct skynet_socket_message *sm = skynet_malloc(sz + addr_sz);
+	sm->type = SKYNET_SOCKET_TYPE_BATCH;
+	sm->id = 0;
+	sm->ud = n;
+	sm->buffer = NULL;
+	memcpy(sm+1, b->msg, n * sizeof(*sm));
+	char * addr = (char *)sm + sz;
+	for (i=0;i<n;i++) {
+		if (b->msg[i].type == SKYNET_SOCKET_TYPE_ACCEPT) {
+			size_t len = strlen(b->addr[i]) + 1;
+			memcpy(addr, b->addr[i], len);
+			sm[i+1].buffer = addr;
+			addr += len;
+		}
+	}
+	if (push_message(b->owner, sm, sz + addr_sz) < 0) {
+		for (i=0;i<n;i++) {
+			if (b->msg[i].type == SKYNET_SOCKET_TYPE_DATA) {
+				socket_server_free_buffer(SOCKET_SERVER, b->msg[i].buffer);
+			}
+		}
+		skynet_free(sm);
+	}
+}
+
+// The data in a pooled block, or an accept of a pooled listen socket, goes to the batch when the owner is busy.
+// Or it's pushed alone, as an inline message for the data.
+static void
+forward_batch(struct socket_batch *b, int type, struct socket_message * result) {
+	uint32_t owner = (uint32_t)result->opaque;
+	const char * addr = NULL;
+	if (type == SKYNET_SOCKET_TYPE_ACCEPT) {
+		addr = result->data ? result->data : "";
+	}
+	if (b->owner != owner) {
+		flush_batch(b);
+		b->owner = 0;
+	} else {
+		if (b->n == MAX_SOCKET_BATCH) {
+			flush_batch(b);
+		}
+		struct skynet_socket_message *sm = &b->msg[b->n];
+		sm->type = type;
+		sm->id = result->id;
+		sm->ud = result->ud;
+		sm->buffer = result->data;
+		if (addr) {
+			strncpy(b->addr[b->n], addr, BATCH_ADDR_SIZE - 1);
+			b->addr[b->n][BATCH_ADDR_SIZE - 1] = '\0';
+		}
+		++b->n;
+		return;
+	}
+	int length;
+	if (addr) {
+		length = push_accept(owner, result->id, result->ud, addr);
+	} else {
+		length = push_inline(owner, result->id, result->ud, result->data);
+	}
+	if (length > 1) {
+		b->owner = owner;
+	}
+}
+
 // mainloop thread
 static void
 forward_message(int type, bool padding, struct socket_message * result) {
@@ -70,23 +226,42 @@ forward_message(int type, bool padding, struct socket_message * result) {
 	if (skynet_context_push((uint32_t)result->opaque, &message)) {
 		// todo: report somewhere to close socket
 		// don't call skynet_socket_close here (It will block mainloop)
-		skynet_free(sm->buffer);
+		socket_server_free_buffer(SOCKET_SERVER, sm->buffer);
 		skynet_free(sm);
 	}
 }
 
 int 
- skynet_socket_poll() {
+ skynet_socket_poll(int poller) {
 	struct socket_server *ss = SOCKET_SERVER;
 	assert(ss);
+	struct socket_batch *b = &SOCKET_BATCH[poller];
 	struct socket_message result;
 	int more = 1;
-	int type = socket_server_poll(ss, &result, &more);
+	int type;
+	while ((type = socket_server_poll(ss, poller, &result, &more)) == SOCKET_IDLE) {
+		if (b->owner) {
+			// don't hold the batch while waiting
+			flush_batch(b);
+			b->owner = 0;
+			return 1;
+		}
+	}
+	if (b->owner && (type == SOCKET_EXIT || (uint32_t)result.opaque == b->owner)
+		&& !((type == SOCKET_DATA || type == SOCKET_ACCEPT) && result.pooled)) {
+		// keep the order of the messages to the owner
+		flush_batch(b);
+		b->owner = 0;
+	}
 	switch (type) {
 	case SOCKET_EXIT:
 		return 0;
 	case SOCKET_DATA:
-		forward_message(SKYNET_SOCKET_TYPE_DATA, false, &result);
+		if (result.pooled) {
+			forward_batch(b, SKYNET_SOCKET_TYPE_DATA, &result);
+		} else {
+			forward_message(SKYNET_SOCKET_TYPE_DATA, false, &result);
+		}
 		break;
 	case SOCKET_CLOSE:
 		forward_message(SKYNET_SOCKET_TYPE_CLOSE, false, &result);
@@ -98,7 +273,11 @@ int
 		forward_message(SKYNET_SOCKET_TYPE_ERROR, true, &result);
 		break;
 	case SOCKET_ACCEPT:
-		forward_message(SKYNET_SOCKET_TYPE_ACCEPT, true, &result);
+		if (result.pooled) {
+			forward_batch(b, SKYNET_SOCKET_TYPE_ACCEPT, &result);
+		} else {
+			forward_message(SKYNET_SOCKET_TYPE_ACCEPT, true, &result);
+		}
 		break;
 	case SOCKET_UDP:
 		forward_message(SKYNET_SOCKET_TYPE_UDP, false, &result);
@@ -106,6 +285,12 @@ int
 	case SOCKET_WARNING:
 		forward_message(SKYNET_SOCKET_TYPE_WARNING, false, &result);
 		break;
+	case SOCKET_WATERMARK:
+		forward_message(SKYNET_SOCKET_TYPE_WATERMARK, false, &result);
+		break;
+	case SOCKET_FRAME:
+		forward_message(SKYNET_SOCKET_TYPE_FRAME, false, &result);
+		break;
 	default:
 		skynet_error(NULL, "Unknown socket message type %d.",type);
 		return -1;
@@ -134,6 +319,12 @@ skynet_socket_listen(struct skynet_context *ctx, const char *host, int port, int
 	return socket_server_listen(SOCKET_SERVER, source, host, port, backlog);
 }
 
+int
+skynet_socket_listen_reuseport(struct skynet_context *ctx, const char *host, int port, int backlog) {
+	uint32_t source = skynet_context_handle(ctx);
+	return socket_server_listen_reuseport(SOCKET_SERVER, source, host, port, backlog);
+}
+
 int 
 skynet_socket_connect(struct skynet_context *ctx, const char *host, int port) {
 	uint32_t source = skynet_context_handle(ctx);
@@ -176,6 +367,30 @@ skynet_socket_nodelay(struct skynet_context *ctx, int id) {
 	socket_server_nodelay(SOCKET_SERVER, id);
 }
 
+void
+skynet_socket_recvpool(struct skynet_context *ctx, int id, int enable) {
+	socket_server_recvpool(SOCKET_SERVER, id, enable);
+}
+
+void
+skynet_socket_watermark(struct skynet_context *ctx, int id, int high, int low) {
+	socket_server_watermark(SOCKET_SERVER, id, high, low);
+}
+
+void
+skynet_socket_framing(struct skynet_context *ctx, int id, int header, int max) {
+	socket_server_framing(SOCKET_SERVER, id, header, max);
+}
+
+void
+skynet_socket_free_buffer(void *buffer) {
+	if (SOCKET_SERVER) {
+		socket_server_free_buffer(SOCKET_SERVER, buffer);
+	} else {
+		skynet_free(buffer);
+	}
+}
+
 int 
 skynet_socket_udp(struct skynet_context *ctx, const char * addr, int port) {
 	uint32_t source = skynet_context_handle(ctx);
@@ -13,6 +13,9 @@ struct skynet_context;
 #define SKYNET_SOCKET_TYPE_ERROR 5
 #define SKYNET_SOCKET_TYPE_UDP 6
 #define SKYNET_SOCKET_TYPE_WARNING 7
+#define SKYNET_SOCKET_TYPE_BATCH 8	// ud DATA or ACCEPT messages of the pooled sockets follow the header
+#define SKYNET_SOCKET_TYPE_WATERMARK 9	// ud is 1 : blocked (high watermark), 0 : writable (low watermark)
+#define SKYNET_SOCKET_TYPE_FRAME 10	// like DATA, but the buffer is whole packets of a framed socket
 
 struct skynet_socket_message {
 	int type;
@@ -21,15 +24,23 @@ struct skynet_socket_message {
 	char * buffer;
 };
 
-void skynet_socket_init();
+// A DATA message of a pooled socket may be one block with its data: the header is just before the data.
+// It's released with the data by skynet_socket_free_buffer, don't skynet_free it.
+static inline int
+skynet_socket_message_inline(const struct skynet_socket_message *sm, size_t sz) {
+	return sz > sizeof(*sm) && sm->buffer == (const char *)(sm + 1);
+}
+
+void skynet_socket_init(int poller, int max_socket, int accept_batch);
 void skynet_socket_exit();
 void skynet_socket_free();
-int skynet_socket_poll();
+int skynet_socket_poll(int poller);
 void skynet_socket_updatetime();
 
 int skynet_socket_sendbuffer(struct skynet_context *ctx, struct socket_sendbuffer *buffer);
 int skynet_socket_sendbuffer_lowpriority(struct skynet_context *ctx, struct socket_sendbuffer *buffer);
 int skynet_socket_listen(struct skynet_context *ctx, const char *host, int port, int backlog);
+int skynet_socket_listen_reuseport(struct skynet_context *ctx, const char *host, int port, int backlog);
 int skynet_socket_connect(struct skynet_context *ctx, const char *host, int port);
 int skynet_socket_bind(struct skynet_context *ctx, int fd);
 void skynet_socket_close(struct skynet_context *ctx, int id);
@@ -37,6 +48,19 @@ void skynet_socket_shutdown(struct skynet_context *ctx, int id);
 void skynet_socket_start(struct skynet_context *ctx, int id);
 void skynet_socket_pause(struct skynet_context *ctx, int id);
 void skynet_socket_nodelay(struct skynet_context *ctx, int id);
+// the data of SKYNET_SOCKET_TYPE_DATA comes from a pool of fixed size blocks (the larger reads are malloc'd as usual),
+// release it by skynet_socket_free_buffer.
+// The messages may be inline, or coalesced into SKYNET_SOCKET_TYPE_BATCH when the service is busy.
+// Enable it for a listen socket, and its ACCEPT messages may be coalesced too (the buffer of each is the address).
+void skynet_socket_recvpool(struct skynet_context *ctx, int id, int enable);
+// report SKYNET_SOCKET_TYPE_WATERMARK when the unsent bytes reach high, and when they fall to low again.
+// It replaces SKYNET_SOCKET_TYPE_WARNING of the socket, high = 0 disables it.
+void skynet_socket_watermark(struct skynet_context *ctx, int id, int high, int low);
+// the data of the socket comes as SKYNET_SOCKET_TYPE_FRAME, whole packets of a big-endian length header (2 or 4 bytes)
+// see socket_server_framing. Call it before skynet_socket_start.
+void skynet_socket_framing(struct skynet_context *ctx, int id, int header, int max);
+// free the buffer of a socket message, pooled or not
+void skynet_socket_free_buffer(void *buffer);
 
 int skynet_socket_udp(struct skynet_context *ctx, const char * addr, int port);
 int skynet_socket_udp_connect(struct skynet_context *ctx, int id, const char * addr, int port);
@@ -9,6 +9,9 @@
 #include "skynet_socket.h"
 #include "skynet_daemon.h"
 #include "skynet_harbor.h"
+#include "skynet_affinity.h"
+#include "skynet_park.h"
+#include "malloc_hook.h"
 
 #include <pthread.h>
 #include <unistd.h>
@@ -21,9 +24,6 @@
 struct monitor {
 	int count;
 	struct skynet_monitor ** m;
-	pthread_cond_t cond;
-	pthread_mutex_t mutex;
-	int sleep;
 	int quit;
 };
 
@@ -31,6 +31,24 @@ struct worker_parm {
 	struct monitor *m;
 	int id;
 	int weight;
+	int arena;	// jemalloc arena of its NUMA node, -1 for default
+};
+
+struct socket_parm {
+	struct monitor *m;
+	int poller;
+};
+
+struct cpuset {
+	int n;	// 0 means not pinned
+	int cpu[MAX_AFFINITY_CPU];
+};
+
+struct placement {
+	struct cpuset worker;	// worker i is pinned to worker.cpu[i % n]
+	struct cpuset socket;	// socket thread i is pinned to socket.cpu[i % n], like workers
+	struct cpuset timer;
+	int numa;
 };
 
 static volatile int SIG = 0;
@@ -45,7 +63,17 @@ handle_hup(int signal) {
 #define CHECK_ABORT if (skynet_context_total()==0) break;
 
 static void
-create_thread(pthread_t *thread, void *(*start_routine) (void *), void *arg) {
+create_thread(pthread_t *thread, void *(*start_routine) (void *), void *arg, const int *cpu, int n) {
+	if (n > 0) {
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		int err = affinity_setattr(&attr, cpu, n) || pthread_create(thread, &attr, start_routine, arg);
+		pthread_attr_destroy(&attr);
+		if (err == 0)
+			return;
+		// invalid or offline cpu, run it unpinned
+		fprintf(stderr, "Set cpu affinity failed\n");
+	}
 	if (pthread_create(thread,NULL, start_routine, arg)) {
 		fprintf(stderr, "Create thread failed");
 		exit(1);
@@ -54,18 +82,19 @@ create_thread(pthread_t *thread, void *(*start_routine) (void *), void *arg) {
 
 static void
 wakeup(struct monitor *m, int busy) {
-	if (m->sleep >= m->count - busy) {
-		// signal sleep worker, "spurious wakeup" is harmless
-		pthread_cond_signal(&m->cond);
+	if (skynet_park_idle() >= m->count - busy) {
+		// wake one parked worker, "spurious wakeup" is harmless
+		skynet_park_wakeone();
 	}
 }
 
 static void *
 thread_socket(void *p) {
-	struct monitor * m = p;
+	struct socket_parm *sp = p;
+	struct monitor * m = sp->m;
 	skynet_initthread(THREAD_SOCKET);
 	for (;;) {
-		int r = skynet_socket_poll();
+		int r = skynet_socket_poll(sp->poller);
 		if (r==0)
 			break;
 		if (r<0) {
@@ -84,8 +113,6 @@ free_monitor(struct monitor *m) {
 	for (i=0;i<n;i++) {
 		skynet_monitor_delete(m->m[i]);
 	}
-	pthread_mutex_destroy(&m->mutex);
-	pthread_cond_destroy(&m->cond);
 	skynet_free(m->m);
 	skynet_free(m);
 }
@@ -134,7 +161,7 @@ thread_timer(void *p) {
 		skynet_socket_updatetime();
 		CHECK_ABORT
 		wakeup(m,m->count-1);
-		usleep(2500);
+		skynet_timer_wait();
 		if (SIG) {
 			signal_hup();
 			SIG = 0;
@@ -143,10 +170,8 @@ thread_timer(void *p) {
 	// wakeup socket thread
 	skynet_socket_exit();
 	// wakeup all worker thread
-	pthread_mutex_lock(&m->mutex);
 	m->quit = 1;
-	pthread_cond_broadcast(&m->cond);
-	pthread_mutex_unlock(&m->mutex);
+	skynet_park_wakeall();
 	return NULL;
 }
 
@@ -158,22 +183,33 @@ thread_worker(void *p) {
 	struct monitor *m = wp->m;
 	struct skynet_monitor *sm = m->m[id];
 	skynet_initthread(THREAD_WORKER);
+	skynet_globalmq_initthread(id);
+	if (wp->arena >= 0) {
+		mallctl_arena_bind(wp->arena);
+	}
 	struct message_queue * q = NULL;
+	int woken = 0;
 	while (!m->quit) {
 		q = skynet_context_message_dispatch(sm, q, weight);
 		if (q == NULL) {
-			if (pthread_mutex_lock(&m->mutex) == 0) {
-				++ m->sleep;
-				// "spurious wakeup" is harmless,
-				// because skynet_context_message_dispatch() can be call at any time.
-				if (!m->quit)
-					pthread_cond_wait(&m->cond, &m->mutex);
-				-- m->sleep;
-				if (pthread_mutex_unlock(&m->mutex)) {
-					fprintf(stderr, "unlock mutex error");
-					exit(1);
-				}
+			if (woken) {
+				skynet_park_spurious();
+			}
+			skynet_park_prepare(id);
+			// check again after entering idle stack, a push before that doesn't wake us.
+			// Only peek here, leave the idle stack before dispatching, or a waker may spend its wakeup on us.
+			if (skynet_globalmq_ready()) {
+				skynet_park_cancel(id);
+				woken = 0;
+				continue;
 			}
+			// "spurious wakeup" is harmless,
+			// because skynet_context_message_dispatch() can be call at any time.
+			if (!m->quit)
+				skynet_park_wait(id);
+			woken = 1;
+		} else {
+			woken = 0;
 		}
 	}
 	return NULL;
@@ -181,31 +217,30 @@ thread_worker(void *p) {
 
 // thread  线程数量
 static void
-start(int thread) {
-	pthread_t pid[thread+3];
+start(int thread, int socket_thread, struct placement *pl) {
+	pthread_t pid[thread+2+socket_thread];
 
 	struct monitor *m = skynet_malloc(sizeof(*m));
 	memset(m, 0, sizeof(*m));
 	m->count = thread;
-	m->sleep = 0;
 
 	m->m = skynet_malloc(thread * sizeof(struct skynet_monitor *));
 	int i;
 	for (i=0;i<thread;i++) {
 		m->m[i] = skynet_monitor_new();
 	}
-	if (pthread_mutex_init(&m->mutex, NULL)) {
-		fprintf(stderr, "Init mutex error");
-		exit(1);
-	}
-	if (pthread_cond_init(&m->cond, NULL)) {
-		fprintf(stderr, "Init cond error");
-		exit(1);
-	}
+	skynet_park_init(thread);
 
-	create_thread(&pid[0], thread_monitor, m);
-	create_thread(&pid[1], thread_timer, m);
-	create_thread(&pid[2], thread_socket, m);
+	create_thread(&pid[0], thread_monitor, m, NULL, 0);
+	create_thread(&pid[1], thread_timer, m, pl->timer.cpu, pl->timer.n);
+	struct socket_parm sp[socket_thread];
+	for (i=0;i<socket_thread;i++) {
+		sp[i].m = m;
+		sp[i].poller = i;
+		// each poller has its own cpu, so the socket threads don't compete for one cpu of the set
+		const int *cpu = pl->socket.n > 0 ? &pl->socket.cpu[i % pl->socket.n] : NULL;
+		create_thread(&pid[thread+2+i], thread_socket, &sp[i], cpu, cpu ? 1 : 0);
+	}
 
 	static int weight[] = { 
 		-1, -1, -1, -1, 0, 0, 0, 0,
@@ -213,6 +248,7 @@ start(int thread) {
 		2, 2, 2, 2, 2, 2, 2, 2, 
 		3, 3, 3, 3, 3, 3, 3, 3, };
 	struct worker_parm wp[thread];
+	int node[thread];
 	for (i=0;i<thread;i++) {
 		wp[i].m = m;
 		wp[i].id = i;
@@ -221,16 +257,65 @@ start(int thread) {
 		} else {
 			wp[i].weight = 0;
 		}
-		create_thread(&pid[i+3], thread_worker, &wp[i]);
+		node[i] = pl->worker.n > 0 ? affinity_cpunode(pl->worker.cpu[i % pl->worker.n]) : 0;
+		wp[i].arena = -1;
+		if (pl->numa) {
+			// workers of the same node share one arena
+			int j;
+			for (j=0;j<i && node[j] != node[i];j++)
+				;
+			wp[i].arena = (j < i) ? wp[j].arena : mallctl_arena_create();
+		}
+	}
+	if (pl->numa) {
+		skynet_globalmq_numa(thread, node);
+	}
+	for (i=0;i<thread;i++) {
+		const int *cpu = pl->worker.n > 0 ? &pl->worker.cpu[i % pl->worker.n] : NULL;
+		create_thread(&pid[i+2], thread_worker, &wp[i], cpu, cpu ? 1 : 0);
 	}
 
-	for (i=0;i<thread+3;i++) {
+	for (i=0;i<thread+2+socket_thread;i++) {
 		pthread_join(pid[i], NULL); 
 	}
 
+	skynet_park_exit();
 	free_monitor(m);
 }
 
+static void
+parse_cpuset(struct cpuset *set, const char *key, const char *list) {
+	set->n = 0;
+	if (list == NULL)
+		return;
+	int n = affinity_parse(list, set->cpu, MAX_AFFINITY_CPU);
+	if (n < 0) {
+		fprintf(stderr, "Invalid cpu list %s = %s\n", key, list);
+		exit(1);
+	}
+	set->n = n;
+}
+
+static void
+init_placement(struct placement *pl, struct skynet_config * config) {
+	parse_cpuset(&pl->worker, "worker_cpus", config->worker_cpus);
+	parse_cpuset(&pl->socket, "socket_cpus", config->socket_cpus);
+	parse_cpuset(&pl->timer, "timer_cpus", config->timer_cpus);
+	pl->numa = config->numa;
+	if (pl->numa && pl->worker.n == 0) {
+		// workers must be pinned to know their nodes, use all online cpus
+		int i;
+		int n = affinity_cpucount();
+		if (n > MAX_AFFINITY_CPU) {
+			n = MAX_AFFINITY_CPU;
+		}
+		for (i=0;i<n;i++) {
+			pl->worker.cpu[i] = i;
+		}
+		pl->worker.n = n;
+	}
+}
+
 static void
 bootstrap(struct skynet_context * logger, const char * cmdline) {
 	int sz = strlen(cmdline);
@@ -273,10 +358,19 @@ skynet_start(struct skynet_config * config) {
 	skynet_harbor_init(config->harbor);
 	skynet_handle_init(config->harbor);
 	skynet_mq_init();
+	skynet_mq_pool(config->service_pool);
+	if (config->worksteal) {
+		skynet_globalmq_worksteal(config->thread);
+	}
 	skynet_module_init(config->module_path);
-	skynet_timer_init();
-	skynet_socket_init();
+	skynet_timer_init(config->timer_tick, config->thread);
+	if (config->socket_thread < 1) {
+		config->socket_thread = 1;
+	}
+	skynet_socket_init(config->socket_thread, config->max_socket, config->accept_batch);
 	skynet_profile_enable(config->profile);
+	skynet_dispatch_slice(config->dispatch_slice);
+	skynet_context_pool(config->service_pool);
 
 	struct skynet_context *ctx = skynet_context_new(config->logservice, config->logger);
 	if (ctx == NULL) {
@@ -288,7 +382,9 @@ skynet_start(struct skynet_config * config) {
 
 	bootstrap(ctx, config->bootstrap);
 
-	start(config->thread);
+	static struct placement pl;
+	init_placement(&pl, config);
+	start(config->thread, config->socket_thread, &pl);
 
 	// harbor_exit may call socket send, so it should exit before socket_free
 	skynet_harbor_exit();
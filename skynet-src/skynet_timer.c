@@ -7,10 +7,13 @@
 #include "spinlock.h"
 
 #include <time.h>
+#include <errno.h>
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
+#include <stdio.h>
 
 typedef void (*timer_execute_func)(void *ud,void *arg);
 
@@ -21,51 +24,190 @@ typedef void (*timer_execute_func)(void *ud,void *arg);
 #define TIME_NEAR_MASK (TIME_NEAR-1)
 #define TIME_LEVEL_MASK (TIME_LEVEL-1)
 
-struct timer_event {
-	uint32_t handle;
-	int session;
-};
+// max number of free nodes kept for reuse, shared by all shards
+#define MAX_FREE_NODE 65536
+#define DEFAULT_HASH_SIZE 1024
+// dispatch_list sorts the expired nodes on stack when there are not too many
+#define DISPATCH_STACK 128
+
+#define MAX_SHARD 64
 
 struct timer_node {
 	struct timer_node *next;
+	struct timer_node *prev;	// so timer_cancel can unlink the node from the wheel
+	struct timer_node *hnext;	// next node in the same hash slot, for cancellation
 	uint32_t expire;
+	uint32_t handle;
+	int session;
+	int flag;	// TIMER_BATCH
 };
 
+// circular list, head is the sentinel
 struct link_list {
 	struct timer_node head;
-	struct timer_node *tail;
 };
 
-struct timer {
+// timers are sharded by handle, each shard has its own wheel and lock
+struct timer_wheel {
 	struct link_list near[TIME_NEAR];
 	struct link_list t[4][TIME_LEVEL];
 	struct spinlock lock;
 	uint32_t time;
+	// pending nodes indexed by (handle, session)
+	int hash_size;
+	int hash_count;
+	struct timer_node **hash;
+	// free nodes
+	int free_count;
+	int free_max;
+	struct timer_node *free_list;
+};
+
+struct timer {
 	uint32_t starttime;
-	uint64_t current;
-	uint64_t current_point;
+	uint64_t current;	// in centisecond
+	uint64_t current_point;	// in tick
+	uint64_t elapsed;	// ticks since start
+	int tick;	// in millisecond, 10 for the default centisecond wheel
+	struct timespec deadline;	// next wakeup of timer thread, for high resolution mode
+	int shard;	// power of 2
+	struct timer_wheel *wheel;
 };
 
 static struct timer * TI = NULL;
 
+static inline void
+link_init(struct link_list *list) {
+	list->head.next = &(list->head);
+	list->head.prev = &(list->head);
+}
+
+static inline int
+link_empty(struct link_list *list) {
+	return list->head.next == &(list->head);
+}
+
+// take all the nodes out, return them linked by next and ended with NULL
 static inline struct timer_node *
 link_clear(struct link_list *list) {
+	if (link_empty(list))
+		return NULL;
 	struct timer_node * ret = list->head.next;
-	list->head.next = 0;
-	list->tail = &(list->head);
+	list->head.prev->next = NULL;
+	link_init(list);
 
 	return ret;
 }
 
 static inline void
 link(struct link_list *list,struct timer_node *node) {
-	list->tail->next = node;
-	list->tail = node;
-	node->next=0;
+	node->prev = list->head.prev;
+	node->next = &(list->head);
+	list->head.prev->next = node;
+	list->head.prev = node;
+}
+
+static inline void
+link_remove(struct timer_node *node) {
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	node->next = NULL;
+}
+
+static inline int
+hash_slot(struct timer_wheel *T, uint32_t handle, int session) {
+	uint32_t h = (handle * 2654435761u) ^ (uint32_t)session;
+	return (int)(h & (T->hash_size - 1));
+}
+
+static void
+hash_expand(struct timer_wheel *T) {
+	int old_size = T->hash_size;
+	struct timer_node **old = T->hash;
+	T->hash_size = old_size * 2;
+	T->hash = skynet_malloc(T->hash_size * sizeof(struct timer_node *));
+	memset(T->hash, 0, T->hash_size * sizeof(struct timer_node *));
+	int i;
+	for (i=0;i<old_size;i++) {
+		struct timer_node *node = old[i];
+		while (node) {
+			struct timer_node *next = node->hnext;
+			int slot = hash_slot(T, node->handle, node->session);
+			node->hnext = T->hash[slot];
+			T->hash[slot] = node;
+			node = next;
+		}
+	}
+	skynet_free(old);
+}
+
+static void
+hash_insert(struct timer_wheel *T, struct timer_node *node) {
+	if (T->hash_count >= T->hash_size) {
+		hash_expand(T);
+	}
+	int slot = hash_slot(T, node->handle, node->session);
+	node->hnext = T->hash[slot];
+	T->hash[slot] = node;
+	++T->hash_count;
 }
 
+static struct timer_node *
+hash_remove(struct timer_wheel *T, uint32_t handle, int session) {
+	struct timer_node **p = &T->hash[hash_slot(T, handle, session)];
+	while (*p) {
+		struct timer_node *node = *p;
+		if (node->handle == handle && node->session == session) {
+			*p = node->hnext;
+			node->hnext = NULL;
+			--T->hash_count;
+			return node;
+		}
+		p = &node->hnext;
+	}
+	return NULL;
+}
+
+// remove the node itself, the key may be not unique
 static void
-add_node(struct timer *T,struct timer_node *node) {
+hash_delete(struct timer_wheel *T, struct timer_node *node) {
+	struct timer_node **p = &T->hash[hash_slot(T, node->handle, node->session)];
+	while (*p != node) {
+		p = &(*p)->hnext;
+	}
+	*p = node->hnext;
+	node->hnext = NULL;
+	--T->hash_count;
+}
+
+static inline struct timer_node *
+node_alloc(struct timer_wheel *T) {
+	struct timer_node *node = T->free_list;
+	if (node) {
+		T->free_list = node->next;
+		--T->free_count;
+		return node;
+	}
+	return (struct timer_node *)skynet_malloc(sizeof(*node));
+}
+
+static void
+node_free_list(struct timer_wheel *T, struct timer_node *list) {
+	while (list) {
+		struct timer_node *next = list->next;
+		if (T->free_count < T->free_max) {
+			list->next = T->free_list;
+			T->free_list = list;
+			++T->free_count;
+		} else {
+			skynet_free(list);
+		}
+		list = next;
+	}
+}
+
+static void
+add_node(struct timer_wheel *T,struct timer_node *node) {
 	uint32_t time=node->expire;
 	uint32_t current_time=T->time;
 	
@@ -86,20 +228,35 @@ add_node(struct timer *T,struct timer_node *node) {
 }
 
 static void
-timer_add(struct timer *T,void *arg,size_t sz,int time) {
-	struct timer_node *node = (struct timer_node *)skynet_malloc(sizeof(*node)+sz);
-	memcpy(node+1,arg,sz);
-
+timer_add(struct timer_wheel *T,uint32_t handle, int session, int flag, int time) {
 	SPIN_LOCK(T);
 
+		struct timer_node *node = node_alloc(T);
+		node->handle = handle;
+		node->session = session;
+		node->flag = flag;
 		node->expire=time+T->time;
 		add_node(T,node);
+		hash_insert(T,node);
 
 	SPIN_UNLOCK(T);
 }
 
+static int
+timer_cancel(struct timer_wheel *T, uint32_t handle, int session) {
+	SPIN_LOCK(T);
+	// the nodes in the wheel are in the hash, the expired ones are removed from both before dispatch
+	struct timer_node *node = hash_remove(T, handle, session);
+	if (node) {
+		link_remove(node);
+		node_free_list(T, node);
+	}
+	SPIN_UNLOCK(T);
+	return node != NULL;
+}
+
 static void
-move_list(struct timer *T, int level, int idx) {
+move_list(struct timer_wheel *T, int level, int idx) {
 	struct timer_node *current = link_clear(&T->t[level][idx]);
 	while (current) {
 		struct timer_node *temp=current->next;
@@ -109,7 +266,7 @@ move_list(struct timer *T, int level, int idx) {
 }
 
 static void
-timer_shift(struct timer *T) {
+timer_shift(struct timer_wheel *T) {
 	int mask = TIME_NEAR;
 	uint32_t ct = ++T->time;
 	if (ct == 0) {
@@ -132,38 +289,119 @@ timer_shift(struct timer *T) {
 }
 
 static inline void
-dispatch_list(struct timer_node *current) {
-	do {
-		struct timer_event * event = (struct timer_event *)(current+1);
-		struct skynet_message message;
-		message.source = 0;
-		message.session = event->session;
-		message.data = NULL;
-		message.sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
+send_timeout(uint32_t handle, int session) {
+	struct skynet_message message;
+	message.source = 0;
+	message.session = session;
+	message.data = NULL;
+	message.sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
+
+	skynet_context_push(handle, &message);
+}
 
-		skynet_context_push(event->handle, &message);
-		
-		struct timer_node * temp = current;
-		current=current->next;
-		skynet_free(temp);	
-	} while (current);
+// all the sessions in one message, see TIMER_BATCH
+static void
+send_batch(struct timer_node **node, int n) {
+	int *session = skynet_malloc(n * sizeof(int));
+	int i;
+	for (i=0;i<n;i++) {
+		session[i] = node[i]->session;
+	}
+	struct skynet_message message;
+	message.source = 0;
+	message.session = 0;
+	message.data = session;
+	message.sz = (n * sizeof(int)) | ((size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT);
+
+	if (skynet_context_push(node[0]->handle, &message)) {
+		skynet_free(session);
+	}
+}
+
+// stable merge sort by handle, so the sessions of one handle keep the order they were armed in
+static void
+sort_handle(struct timer_node **a, struct timer_node **buf, int n) {
+	if (n < 2)
+		return;
+	int h = n / 2;
+	sort_handle(a, buf, h);
+	sort_handle(a + h, buf, n - h);
+	if (a[h-1]->handle <= a[h]->handle)
+		return;
+	memcpy(buf, a, h * sizeof(*a));
+	int i = 0, j = h, k = 0;
+	while (i < h && j < n) {
+		if (a[j]->handle < buf[i]->handle) {
+			a[k++] = a[j++];
+		} else {
+			a[k++] = buf[i++];
+		}
+	}
+	while (i < h) {
+		a[k++] = buf[i++];
+	}
+}
+
+static void
+dispatch_list(struct timer_node *current) {
+	// the second half is the buffer of sort_handle
+	struct timer_node *tmp[DISPATCH_STACK * 2];
+	struct timer_node **batch = tmp;
+	int n = 0;
+	int cap = DISPATCH_STACK;
+	for (; current; current = current->next) {
+		if (!(current->flag & TIMER_BATCH)) {
+			send_timeout(current->handle, current->session);
+			continue;
+		}
+		if (n >= cap) {
+			cap *= 2;
+			struct timer_node **nb = skynet_malloc(cap * 2 * sizeof(*nb));
+			memcpy(nb, batch, n * sizeof(*nb));
+			if (batch != tmp) {
+				skynet_free(batch);
+			}
+			batch = nb;
+		}
+		batch[n++] = current;
+	}
+	sort_handle(batch, batch + cap, n);
+	int i, from = 0;
+	for (i=1;i<=n;i++) {
+		if (i == n || batch[i]->handle != batch[from]->handle) {
+			if (i - from == 1) {
+				send_timeout(batch[from]->handle, batch[from]->session);
+			} else {
+				send_batch(&batch[from], i - from);
+			}
+			from = i;
+		}
+	}
+	if (batch != tmp) {
+		skynet_free(batch);
+	}
 }
 
 static inline void
-timer_execute(struct timer *T) {
+timer_execute(struct timer_wheel *T) {
 	int idx = T->time & TIME_NEAR_MASK;
 	
-	while (T->near[idx].head.next) {
+	while (!link_empty(&T->near[idx])) {
 		struct timer_node *current = link_clear(&T->near[idx]);
+		struct timer_node *node;
+		for (node = current; node; node = node->next) {
+			hash_delete(T, node);
+		}
 		SPIN_UNLOCK(T);
 		// dispatch_list don't need lock T
 		dispatch_list(current);
 		SPIN_LOCK(T);
+		node_free_list(T, current);
 	}
 }
 
 static void 
-timer_update(struct timer *T) {
+timer_update(struct timer_wheel *T) {
 	SPIN_LOCK(T);
 
 	// try to dispatch timeout 0 (rare condition)
@@ -177,32 +415,63 @@ timer_update(struct timer *T) {
 	SPIN_UNLOCK(T);
 }
 
-static struct timer *
-timer_create_timer() {
-	struct timer *r=(struct timer *)skynet_malloc(sizeof(struct timer));
+static void
+timer_init_wheel(struct timer_wheel *r) {
 	memset(r,0,sizeof(*r));
 
 	int i,j;
 
 	for (i=0;i<TIME_NEAR;i++) {
-		link_clear(&r->near[i]);
+		link_init(&r->near[i]);
 	}
 
 	for (i=0;i<4;i++) {
 		for (j=0;j<TIME_LEVEL;j++) {
-			link_clear(&r->t[i][j]);
+			link_init(&r->t[i][j]);
 		}
 	}
 
 	SPIN_INIT(r)
 
+	r->hash_size = DEFAULT_HASH_SIZE;
+	r->hash = skynet_malloc(r->hash_size * sizeof(struct timer_node *));
+	memset(r->hash, 0, r->hash_size * sizeof(struct timer_node *));
+}
+
+static struct timer *
+timer_create_timer(int shard) {
+	struct timer *r=(struct timer *)skynet_malloc(sizeof(struct timer));
+	memset(r,0,sizeof(*r));
+
+	r->shard = shard;
+	r->wheel = skynet_malloc(shard * sizeof(struct timer_wheel));
+	int i;
+	for (i=0;i<shard;i++) {
+		timer_init_wheel(&r->wheel[i]);
+		r->wheel[i].free_max = MAX_FREE_NODE / shard;
+	}
+
 	r->current = 0;
 
 	return r;
 }
 
+static inline struct timer_wheel *
+timer_wheel(uint32_t handle) {
+	// handles are allocated in sequence, so the low bits spread well
+	return &TI->wheel[handle & (TI->shard - 1)];
+}
+
 int
-skynet_timeout(uint32_t handle, int time, int session) {
+skynet_timeout_flag(uint32_t handle, int time, int session, int flag) {
+	if (flag & TIMER_MS) {
+		// round up to ticks
+		time = (int)(((int64_t)time + TI->tick - 1) / TI->tick);
+	} else if (TI->tick != 10) {
+		// in 64 bits, a long timeout with a small tick overflows int
+		int64_t t = (int64_t)time * (10 / TI->tick);
+		time = t > INT_MAX ? INT_MAX : (int)t;
+	}
 	if (time <= 0) {
 		struct skynet_message message;
 		message.source = 0;
@@ -214,15 +483,22 @@ skynet_timeout(uint32_t handle, int time, int session) {
 			return -1;
 		}
 	} else {
-		struct timer_event event;
-		event.handle = handle;
-		event.session = session;
-		timer_add(TI, &event, sizeof(event), time);
+		timer_add(timer_wheel(handle), handle, session, flag & TIMER_BATCH, time);
 	}
 
 	return session;
 }
 
+int
+skynet_timeout(uint32_t handle, int time, int session) {
+	return skynet_timeout_flag(handle, time, session, 0);
+}
+
+int
+skynet_timeout_cancel(uint32_t handle, int session) {
+	return timer_cancel(timer_wheel(handle), handle, session);
+}
+
 // centisecond: 1/100 second
 static void
 systime(uint32_t *sec, uint32_t *cs) {
@@ -232,29 +508,35 @@ systime(uint32_t *sec, uint32_t *cs) {
 	*cs = (uint32_t)(ti.tv_nsec / 10000000);
 }
 
+// in tick
 static uint64_t
-gettime() {
+gettime(int tick) {
 	uint64_t t;
 	struct timespec ti;
 	clock_gettime(CLOCK_MONOTONIC, &ti);
-	t = (uint64_t)ti.tv_sec * 100;
-	t += ti.tv_nsec / 10000000;
+	t = (uint64_t)ti.tv_sec * (1000 / tick);
+	t += ti.tv_nsec / (1000000 * tick);
 	return t;
 }
 
 void
 skynet_updatetime(void) {
-	uint64_t cp = gettime();
+	uint64_t cp = gettime(TI->tick);
 	if(cp < TI->current_point) {
 		skynet_error(NULL, "time diff error: change from %lld to %lld", cp, TI->current_point);
 		TI->current_point = cp;
 	} else if (cp != TI->current_point) {
 		uint32_t diff = (uint32_t)(cp - TI->current_point);
+		uint64_t elapsed = TI->elapsed + diff;
 		TI->current_point = cp;
-		TI->current += diff;
-		int i;
+		TI->current += elapsed * TI->tick / 10 - TI->elapsed * TI->tick / 10;
+		TI->elapsed = elapsed;
+		int i,j;
 		for (i=0;i<diff;i++) {
-			timer_update(TI);
+			// other shards are not blocked when one shard is executing
+			for (j=0;j<TI->shard;j++) {
+				timer_update(&TI->wheel[j]);
+			}
 		}
 	}
 }
@@ -269,18 +551,60 @@ skynet_now(void) {
 	return TI->current;
 }
 
+#define NANOSEC 1000000000
+
+void
+skynet_timer_wait(void) {
+	if (TI->tick == 10) {
+		struct timespec ti = { 0, 2500000 };	// 2.5ms
+		nanosleep(&ti, NULL);
+		return;
+	}
+#ifdef __linux__
+	// sleep to absolute deadlines, so the ticks don't drift with the time spent on dispatching
+	struct timespec *d = &TI->deadline;
+	d->tv_nsec += TI->tick * 1000000;
+	if (d->tv_nsec >= NANOSEC) {
+		d->tv_nsec -= NANOSEC;
+		++d->tv_sec;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec > d->tv_sec + 1) {
+		// fall behind too much (suspended, or busy), restart from now
+		*d = now;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, d, NULL) == EINTR)
+		;
+#else
+	struct timespec ti = { 0, TI->tick * 1000000 };
+	nanosleep(&ti, NULL);
+#endif
+}
+
 void 
-skynet_timer_init(void) {
-	TI = timer_create_timer();
+skynet_timer_init(int tick, int shard) {
+	int n = 1;
+	while (n < shard && n < MAX_SHARD) {
+		n *= 2;
+	}
+	TI = timer_create_timer(n);
+	if (tick <= 0 || 10 % tick != 0) {
+		// the centisecond api needs tick to be a divisor of 10ms
+		fprintf(stderr, "Invalid timer_tick %d, use 10\n", tick);
+		tick = 10;
+	}
+	TI->tick = tick;
 	uint32_t current = 0;
 	systime(&TI->starttime, &current);
 	TI->current = current;
-	TI->current_point = gettime();
+	TI->current_point = gettime(tick);
+	TI->elapsed = 0;
+	clock_gettime(CLOCK_MONOTONIC, &TI->deadline);
 }
 
 // for profile
 
-#define NANOSEC 1000000000
 #define MICROSEC 1000000
 
 uint64_t
@@ -3,11 +3,24 @@
 
 #include <stdint.h>
 
-int skynet_timeout(uint32_t handle, int time, int session);
+// timeouts of the same handle expiring at the same tick are sent in one PTYPE_RESPONSE message,
+// whose session is 0 and data is an int array of the sessions.
+#define TIMER_BATCH 1
+// time is in millisecond instead of centisecond
+#define TIMER_MS 4
+
+int skynet_timeout(uint32_t handle, int time, int session);	// in centisecond
+int skynet_timeout_flag(uint32_t handle, int time, int session, int flag);
+// return 1 if the timer is cancelled before it expires
+int skynet_timeout_cancel(uint32_t handle, int session);
 void skynet_updatetime(void);
 uint32_t skynet_starttime(void);
 uint64_t skynet_thread_time(void);	// for profile, in micro second
 
-void skynet_timer_init(void);
+// sleep until the next update of timer thread
+void skynet_timer_wait(void);
+
+// tick in millisecond, 10 (centisecond) by default. timers are sharded by handle into n wheels, n is rounded up to power of 2
+void skynet_timer_init(int tick, int shard);
 
 #endif
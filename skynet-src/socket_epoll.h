@@ -64,6 +64,7 @@ sp_wait(int efd, struct event *e, int max) {
 		e[i].read = (flag & EPOLLIN) != 0;
 		e[i].error = (flag & EPOLLERR) != 0;
 		e[i].eof = (flag & EPOLLHUP) != 0;
+		e[i].recv = false;
 	}
 
 	return n;
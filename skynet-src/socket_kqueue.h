@@ -84,6 +84,7 @@ sp_wait(int kfd, struct event *e, int max) {
 		e[i].read = (filter == EVFILT_READ);
 		e[i].error = (ev[i].flags & EV_ERROR) != 0;
 		e[i].eof = eof;
+		e[i].recv = false;
 	}
 
 	return n;
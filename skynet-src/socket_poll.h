@@ -3,7 +3,11 @@
 
 #include <stdbool.h>
 
+#if defined(__linux__) && defined(USE_IO_URING)
+typedef struct sp_uring * poll_fd;
+#else
 typedef int poll_fd;
+#endif
 
 struct event {
 	void * s;
@@ -11,6 +15,10 @@ struct event {
 	bool write;
 	bool error;
 	bool eof;
+	// the data is received by the backend already (see socket_uring.h), recv_size is 0 at eof, or -errno
+	bool recv;
+	int recv_size;
+	const char * recv_data;
 };
 
 static bool sp_invalid(poll_fd fd);
@@ -23,8 +31,12 @@ static int sp_wait(poll_fd, struct event *e, int max);
 static void sp_nonblocking(int sock);
 
 #ifdef __linux__
+#ifdef USE_IO_URING
+#include "socket_uring.h"
+#else
 #include "socket_epoll.h"
 #endif
+#endif
 
 #if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined (__NetBSD__)
 #include "socket_kqueue.h"
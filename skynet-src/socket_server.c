@@ -1,3 +1,7 @@
+#ifdef __linux__
+#define _GNU_SOURCE	// accept4
+#endif
+
 #include "skynet.h"
 
 #include "socket_server.h"
@@ -7,6 +11,8 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <netinet/tcp.h>
 #include <unistd.h>
 #include <errno.h>
@@ -16,12 +22,27 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #define MAX_INFO 128
-// MAX_SOCKET will be 2^MAX_SOCKET_P
-#define MAX_SOCKET_P 16
+// The slot table holds at most 2^slot_p sockets (from the max_socket config), it's allocated by pages
+// when a round of the ids finds the allocated slots all in use, see reserve_id
+#define DEFAULT_SOCKET_P 16
+#define MIN_SOCKET_P 10
+#define MAX_SOCKET_P 24
+#define SOCKET_PAGE_P 10
+#define SOCKET_PAGE_SIZE (1<<SOCKET_PAGE_P)
 #define MAX_EVENT 64
+#define DEFAULT_ACCEPT_BATCH 8
 #define MIN_READ_BUFFER 64
+#ifndef IOV_MAX
+#define IOV_MAX 1024	// the limit of linux and bsd, limits.h defines it only for xopen
+#endif
+#define MAX_IOV IOV_MAX
 #define SOCKET_TYPE_INVALID 0
 #define SOCKET_TYPE_RESERVE 1
 #define SOCKET_TYPE_PLISTEN 2
@@ -33,13 +54,11 @@
 #define SOCKET_TYPE_PACCEPT 8
 #define SOCKET_TYPE_BIND 9
 
-#define MAX_SOCKET (1<<MAX_SOCKET_P)
-
 #define PRIORITY_HIGH 0
 #define PRIORITY_LOW 1
 
-#define HASH_ID(id) (((unsigned)id) % MAX_SOCKET)
-#define ID_TAG16(id) ((id>>MAX_SOCKET_P) & 0xffff)
+#define HASH_ID(ss, id) (((unsigned)(id)) & (ss)->slot_mask)
+#define ID_TAG16(ss, id) ((((unsigned)(id))>>(ss)->slot_p) & 0xffff)
 
 #define PROTOCOL_TCP 0
 #define PROTOCOL_UDP 1
@@ -61,6 +80,13 @@
 
 #define USEROBJECT ((size_t)(-1))
 
+// pooled read buffers (see socket_server_recvpool), a slab is RECV_SLAB_BLOCKS blocks
+#define RECV_BLOCK_SIZE 4096
+#define RECV_SLAB_BLOCKS 64
+#define MAX_RECV_SLAB 1024
+#define RECV_SLAB_SIZE (RECV_BLOCK_SIZE * RECV_SLAB_BLOCKS)
+#define RECV_POOL_SIZE ((size_t)RECV_SLAB_SIZE * MAX_RECV_SLAB)
+
 struct write_buffer {
 	struct write_buffer * next;
 	const void *buffer;
@@ -84,6 +110,16 @@ struct socket_stat {
 	uint64_t wtime;
 	uint64_t read;
 	uint64_t write;
+	uint64_t wcall;	// write syscalls
+};
+
+// length-prefixed framing in the socket thread (see socket_server_framing)
+struct socket_frame {
+	int header;             // 0 (disabled), 2 or 4 bytes big-endian length before each packet
+	int max;                // max size of a packet
+	char * buffer;          // the uncomplete packet at the beginning
+	int size;
+	int cap;
 };
 
 struct socket {
@@ -100,8 +136,13 @@ struct socket {
 	bool reading;
 	bool writing;
 	bool closing;
+	bool recvpool;          // read into the blocks of socket_server.rpool
 	ATOM_INT udpconnecting;
 	int64_t warn_size;
+	int64_t high_mark;      // 发送缓冲的高低水位, high_mark为0时不启用 (见socket_server_watermark)
+	int64_t low_mark;
+	bool blocked;           // 达到了高水位, 低于低水位时恢复
+	struct socket_frame frame;
 	union {
 		int size;
 		uint8_t udp_address[UDP_ADDRESS_SIZE];
@@ -112,24 +153,73 @@ struct socket {
 	size_t dw_size;
 };
 
+// The address space of all the slabs is reserved at once (the pages are not touched before they are used),
+// so socket_server_free_buffer tells a pooled block by its address without a lock.
+// Each slab belongs to a poller, its blocks return to the free lists of the poller.
+struct recv_pool {
+	ATOM_POINTER base;	// RECV_POOL_SIZE bytes, MAP_FAILED if it can't be reserved
+	ATOM_INT slab_n;
+	uint16_t owner[MAX_RECV_SLAB];	// the poller of the slab
+};
+
 // ctrl 是什么意思， 是控制？？
 
-struct socket_server {
-	volatile uint64_t time; 
+#define CTRL_RING_SIZE 1024
+
+// One request in the ring, seq is the sequence number of the ring position it's ready for:
+// pos when it's free for the producer of pos, pos+1 when the request of pos is written.
+struct ctrl_slot {
+	ATOM_SIZET seq;
+	uint8_t type;
+	uint8_t len;
+	union {
+		char buffer[256];
+		uintptr_t align;
+	} u;
+};
+
+// Multi-producer single-consumer request ring, the producers are the worker threads and the consumer is the socket thread.
+struct ctrl_ring {
+	ATOM_SIZET tail;
+	ATOM_INT signal;            // 1 when the ctrl fd has been signalled and not cleared yet
+	struct ctrl_slot slot[CTRL_RING_SIZE];
+};
+
+// Each poller is driven by one socket thread, and serves the sockets whose HASH_ID(id) % poller_n is its index:
+// all the requests of a socket go to the ring of its poller, and its fd is in the event pool of that poller.
+struct socket_poller {
 	int reserve_fd;	// for EMFILE
-	int recvctrl_fd;            // 接收管道消息的文件描述
-	int sendctrl_fd;            // 发送管道消息的文件描述
-	int checkctrl;              // 判断是否有其他线程通过管道，向socket线程发送消息的标记变量
+	int recvctrl_fd;            // 唤醒socket线程的eventfd (或管道读端)
+	int sendctrl_fd;            // 唤醒用的写端, eventfd时与recvctrl_fd相同
+	int checkctrl;              // 判断是否需要检查请求队列的标记变量
+	size_t ctrl_head;           // 下一个要读取的请求位置, 只有socket线程访问
+	struct ctrl_ring *ring;
 	poll_fd event_fd;           // epoll实例id
-	ATOM_INT alloc_id;          // 已经分配的socket slot列表id
 	int event_n;                // 标记本次epoll事件的数量
 	int event_index;            // 下一个未处理的epoll事件索引
-	struct socket_object_interface soi;
+	int accept_n;               // 当前监听事件已经accept的连接数, 不超过accept_batch
+	int idle;                   // 等待新事件之前已经返回过SOCKET_IDLE
+	void * rfree;               // free pooled blocks, linked by the first pointer of the block, only the socket thread
+	ATOM_POINTER rfree_remote;  // the blocks released by other threads, taken all at once by the socket thread
 	struct event ev[MAX_EVENT]; // epoll事件列表
-	struct socket slot[MAX_SOCKET]; // socket 列表
 	char buffer[MAX_INFO];      // 地址信息转成字符串以后，存在这里
 	uint8_t udpbuffer[MAX_UDP_PACKAGE];
-	fd_set rfds;
+};
+
+struct socket_server {
+	volatile uint64_t time; 
+	ATOM_INT alloc_id;          // 已经分配的socket slot列表id
+	int poller_n;
+	struct socket_poller *poller;
+	struct socket_object_interface soi;
+	int slot_p;                 // HASH_ID(id) is the low slot_p bits of id
+	unsigned slot_mask;
+	ATOM_INT slot_cap;          // 已分配的slot数量, HASH_ID不小于它的id还未分配
+	struct spinlock slot_lock;  // for growing slot_cap
+	ATOM_POINTER *page;         // socket 列表, 1<<(slot_p-SOCKET_PAGE_P) 页
+	struct socket invalid;      // returned for the ids out of slot_cap
+	int accept_batch;           // 每个监听事件最多accept的连接数
+	struct recv_pool rpool;
 };
 
 struct request_open {
@@ -188,6 +278,23 @@ struct request_setopt {
 	int value;
 };
 
+struct request_recvpool {
+	int id;
+	int enable;
+};
+
+struct request_watermark {
+	int id;
+	int high;
+	int low;
+};
+
+struct request_framing {
+	int id;
+	int header;
+	int max;
+};
+
 struct request_udp {
 	int id;
 	int fd;
@@ -219,10 +326,12 @@ struct request_dial_udp {
 	N client dial to UDP host port
 	T Set opt
 	U Create UDP socket
+	M Set receive buffer mode (pooled or not)
+	H Set write watermarks
+	F Set framing mode
  */
 
 struct request_package {
-	uint8_t header[8];	// 6 bytes dummy
 	union {
 		char buffer[256];
 		struct request_open open;
@@ -233,6 +342,9 @@ struct request_package {
 		struct request_bind bind;
 		struct request_resumepause resumepause;
 		struct request_setopt setopt;
+		struct request_recvpool recvpool;
+		struct request_watermark watermark;
+		struct request_framing framing;
 		struct request_udp udp;
 		struct request_setudp set_udp;
 		struct request_dial_udp dial_udp;
@@ -357,15 +469,85 @@ socket_keepalive(int fd) {
 	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void *)&keepalive , sizeof(keepalive));  
 }
 
+static inline void
+clear_wb_list(struct wb_list *list) {
+	list->head = NULL;
+	list->tail = NULL;
+}
+
+// The pages are never freed before the socket server, so a socket found by id is always safe to read.
+static inline struct socket *
+socket_slot(struct socket_server *ss, unsigned index) {
+	struct socket *page = (struct socket *)ATOM_LOAD(&ss->page[index >> SOCKET_PAGE_P]);
+	if (page == NULL) {
+		// the id is not allocated by reserve_id, it's always invalid
+		return &ss->invalid;
+	}
+	return &page[index & (SOCKET_PAGE_SIZE - 1)];
+}
+
+static inline struct socket *
+get_socket(struct socket_server *ss, int id) {
+	return socket_slot(ss, HASH_ID(ss, id));
+}
+
+static void
+init_socket(struct socket *s) {
+	memset(s, 0, sizeof(*s));
+	ATOM_INIT(&s->type, SOCKET_TYPE_INVALID);
+	clear_wb_list(&s->high);
+	clear_wb_list(&s->low);
+	spinlock_init(&s->dw_lock);
+}
+
+static void
+alloc_page(struct socket_server *ss, int page) {
+	struct socket *slot = MALLOC(SOCKET_PAGE_SIZE * sizeof(struct socket));
+	int i;
+	for (i=0;i<SOCKET_PAGE_SIZE;i++) {
+		init_socket(&slot[i]);
+	}
+	ATOM_STORE(&ss->page[page], (uintptr_t)slot);
+}
+
+// Allocate the pages until slot_cap covers index
+static void
+grow_slot(struct socket_server *ss, unsigned index) {
+	spinlock_lock(&ss->slot_lock);
+	int cap = ATOM_LOAD(&ss->slot_cap);
+	while (index >= (unsigned)cap) {
+		alloc_page(ss, cap >> SOCKET_PAGE_P);
+		cap += SOCKET_PAGE_SIZE;
+		// publish the page before slot_cap
+		ATOM_STORE(&ss->slot_cap, cap);
+	}
+	spinlock_unlock(&ss->slot_lock);
+}
+
 static int
 reserve_id(struct socket_server *ss) {
 	int i;
-	for (i=0;i<MAX_SOCKET;i++) {
+	int scanned = 0;
+	for (i=0;i<=(int)ss->slot_mask;i++) {
 		int id = ATOM_FINC(&(ss->alloc_id))+1;
 		if (id < 0) {
 			id = ATOM_FAND(&(ss->alloc_id), 0x7fffffff) & 0x7fffffff;
 		}
-		struct socket *s = &ss->slot[HASH_ID(id)];
+		// The ids go round the allocated slots, the tag (ID_TAG16) advances every round.
+		// The slot table grows only after a whole round finds no free slot, so it holds at most
+		// the peak of the live sockets (rounded up to pages), not the sockets ever created.
+		unsigned index = HASH_ID(ss, id);
+		int cap = ATOM_LOAD(&ss->slot_cap);
+		if (index >= (unsigned)cap) {
+			if (scanned < cap) {
+				// skip the rest ids of this round, the next id is index 0 with the next tag
+				ATOM_CAS(&ss->alloc_id, id, id | (int)ss->slot_mask);
+				continue;
+			}
+			grow_slot(ss, index);
+		}
+		++scanned;
+		struct socket *s = get_socket(ss, id);
 		int type_invalid = ATOM_LOAD(&s->type);
 		if (type_invalid == SOCKET_TYPE_INVALID) {
 			if (ATOM_CAS(&s->type, type_invalid, SOCKET_TYPE_RESERVE)) {
@@ -385,56 +567,143 @@ reserve_id(struct socket_server *ss) {
 	return -1;
 }
 
-static inline void
-clear_wb_list(struct wb_list *list) {
-	list->head = NULL;
-	list->tail = NULL;
+
+static inline struct socket_poller *
+get_poller(struct socket_server *ss, int id) {
+	return &ss->poller[HASH_ID(ss, id) % ss->poller_n];
 }
 
-struct socket_server * 
-socket_server_create(uint64_t time) {
-	int i;
+// The ctrl fd only wakes up the socket thread, the requests are in the ring.
+// Use an eventfd on linux (the two ends are the same fd), and a pipe elsewhere.
+static int
+ctrl_fd_create(int fd[2]) {
+#ifdef __linux__
+	int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0)
+		return 1;
+	fd[0] = fd[1] = efd;
+#else
+	if (pipe(fd))
+		return 1;
+	sp_nonblocking(fd[0]);
+	sp_nonblocking(fd[1]);
+#endif
+	return 0;
+}
+
+static void
+ctrl_fd_close(int fd[2]) {
+	if (fd[1] != fd[0])
+		close(fd[1]);
+	close(fd[0]);
+}
+
+static struct ctrl_ring *
+ctrl_ring_create() {
+	struct ctrl_ring *r = MALLOC(sizeof(*r));
+	size_t i;
+	ATOM_INIT(&r->tail, 0);
+	ATOM_INIT(&r->signal, 0);
+	for (i=0;i<CTRL_RING_SIZE;i++) {
+		ATOM_INIT(&r->slot[i].seq, i);
+	}
+	return r;
+}
+
+static int
+poller_init(struct socket_poller *p) {
 	int fd[2];
 	poll_fd efd = sp_create();
 	if (sp_invalid(efd)) {
 		skynet_error(NULL, "socket-server: create event pool failed.");
-		return NULL;
+		return 1;
 	}
-	if (pipe(fd)) {
+	if (ctrl_fd_create(fd)) {
 		sp_release(efd);
-		skynet_error(NULL, "socket-server: create socket pair failed.");
-		return NULL;
+		skynet_error(NULL, "socket-server: create ctrl fd failed.");
+		return 1;
 	}
 	if (sp_add(efd, fd[0], NULL)) {
 		// add recvctrl_fd to event poll
 		skynet_error(NULL, "socket-server: can't add server fd to event pool.");
-		close(fd[0]);
-		close(fd[1]);
+		ctrl_fd_close(fd);
 		sp_release(efd);
-		return NULL;
+		return 1;
+	}
+	p->event_fd = efd;
+	p->recvctrl_fd = fd[0];
+	p->sendctrl_fd = fd[1];
+	p->checkctrl = 1;
+	p->ctrl_head = 0;
+	p->ring = ctrl_ring_create();
+	p->reserve_fd = dup(1);	// reserve an extra fd for EMFILE
+	p->event_n = 0;
+	p->event_index = 0;
+	p->accept_n = 0;
+	p->idle = 0;
+	p->rfree = NULL;
+	ATOM_INIT(&p->rfree_remote, 0);
+	return 0;
+}
+
+static void
+poller_release(struct socket_poller *p) {
+	int fd[2] = { p->recvctrl_fd, p->sendctrl_fd };
+	ctrl_fd_close(fd);
+	FREE(p->ring);
+	sp_release(p->event_fd);
+	if (p->reserve_fd >= 0)
+		close(p->reserve_fd);
+}
+
+struct socket_server * 
+socket_server_create(uint64_t time, int poller_n, int max_socket, int accept_batch) {
+	int i;
+	if (poller_n < 1) {
+		poller_n = 1;
+	}
+	int slot_p = DEFAULT_SOCKET_P;
+	if (max_socket > 0) {
+		// round up to power of 2
+		slot_p = MIN_SOCKET_P;
+		while (slot_p < MAX_SOCKET_P && (1 << slot_p) < max_socket) {
+			++slot_p;
+		}
+	}
+	struct socket_poller *poller = MALLOC(poller_n * sizeof(*poller));
+	for (i=0;i<poller_n;i++) {
+		if (poller_init(&poller[i])) {
+			while (--i >= 0) {
+				poller_release(&poller[i]);
+			}
+			FREE(poller);
+			return NULL;
+		}
 	}
 
 	struct socket_server *ss = MALLOC(sizeof(*ss));
 	ss->time = time;
-	ss->event_fd = efd;
-	ss->recvctrl_fd = fd[0];
-	ss->sendctrl_fd = fd[1];
-	ss->checkctrl = 1;
-	ss->reserve_fd = dup(1);	// reserve an extra fd for EMFILE
-
-	for (i=0;i<MAX_SOCKET;i++) {
-		struct socket *s = &ss->slot[i];
-		ATOM_INIT(&s->type, SOCKET_TYPE_INVALID);
-		clear_wb_list(&s->high);
-		clear_wb_list(&s->low);
-		spinlock_init(&s->dw_lock);
-	}
+	ss->poller_n = poller_n;
+	ss->poller = poller;
+
+	ss->slot_p = slot_p;
+	ss->slot_mask = (1u << slot_p) - 1;
+	int page_n = 1 << (slot_p - SOCKET_PAGE_P);
+	ss->page = MALLOC(page_n * sizeof(ATOM_POINTER));
+	for (i=0;i<page_n;i++) {
+		ATOM_INIT(&ss->page[i], 0);
+	}
+	spinlock_init(&ss->slot_lock);
+	// start with one page, reserve_id grows it
+	alloc_page(ss, 0);
+	ATOM_INIT(&ss->slot_cap, SOCKET_PAGE_SIZE);
+	init_socket(&ss->invalid);
+	ss->invalid.id = -1;
+	ss->accept_batch = accept_batch > 0 ? accept_batch : DEFAULT_ACCEPT_BATCH;
 	ATOM_INIT(&ss->alloc_id , 0);
-	ss->event_n = 0;
-	ss->event_index = 0;
 	memset(&ss->soi, 0, sizeof(ss->soi));
-	FD_ZERO(&ss->rfds);
-	assert(ss->recvctrl_fd < FD_SETSIZE);
+	ATOM_INIT(&ss->rpool.base, 0);
+	ATOM_INIT(&ss->rpool.slab_n, 0);
 
 	return ss;
 }
@@ -471,6 +740,105 @@ free_buffer(struct socket_server *ss, struct socket_sendbuffer *buf) {
 	}
 }
 
+static char *
+recvpool_base(struct recv_pool *rp) {
+	char * base = (char *)ATOM_LOAD(&rp->base);
+	if (base == NULL) {
+		int flags = MAP_PRIVATE | MAP_ANON;
+#ifdef MAP_NORESERVE
+		flags |= MAP_NORESERVE;
+#endif
+		base = mmap(NULL, RECV_POOL_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (!ATOM_CAS_POINTER(&rp->base, 0, (uintptr_t)base)) {
+			// reserved by another poller
+			if (base != MAP_FAILED) {
+				munmap(base, RECV_POOL_SIZE);
+			}
+			base = (char *)ATOM_LOAD(&rp->base);
+		}
+	}
+	return base == MAP_FAILED ? NULL : base;
+}
+
+// call it in the socket thread of the poller, return NULL when the pool reaches MAX_RECV_SLAB
+static char *
+recvpool_alloc(struct socket_server *ss, struct socket_poller *p) {
+	char * block = p->rfree;
+	if (block == NULL) {
+		// take all the blocks released by the workers
+		uintptr_t head = ATOM_LOAD(&p->rfree_remote);
+		while (head && !ATOM_CAS_POINTER(&p->rfree_remote, head, 0)) {
+			head = ATOM_LOAD(&p->rfree_remote);
+		}
+		block = (char *)head;
+	}
+	if (block == NULL) {
+		struct recv_pool *rp = &ss->rpool;
+		char * base = recvpool_base(rp);
+		if (base == NULL || ATOM_LOAD(&rp->slab_n) >= MAX_RECV_SLAB) {
+			return NULL;
+		}
+		int n = ATOM_FINC(&rp->slab_n);
+		if (n >= MAX_RECV_SLAB) {
+			return NULL;
+		}
+		rp->owner[n] = p - ss->poller;
+		char * slab = base + (size_t)n * RECV_SLAB_SIZE;
+		// the first block is returned, link the others
+		int i;
+		for (i=RECV_SLAB_BLOCKS-1;i>0;i--) {
+			char * b = slab + i * RECV_BLOCK_SIZE;
+			*(void **)b = block;
+			block = b;
+		}
+		p->rfree = block;
+		return slab;
+	}
+	p->rfree = *(void **)block;
+	return block;
+}
+
+// return the block to the poller which owns it, in its socket thread
+static inline void
+recvpool_free(struct socket_poller *p, char *block) {
+	*(void **)block = p->rfree;
+	p->rfree = block;
+}
+
+// return the pooled block of the address and the index of its slab, or NULL
+static inline char *
+recvpool_block(struct recv_pool *rp, const void *buffer, int *slab) {
+	uintptr_t base = ATOM_LOAD(&rp->base);
+	if (base == 0 || base == (uintptr_t)MAP_FAILED) {
+		return NULL;
+	}
+	uintptr_t offset = (uintptr_t)buffer - base;
+	if (offset >= RECV_POOL_SIZE) {
+		return NULL;
+	}
+	*slab = (int)(offset / RECV_SLAB_SIZE);
+	return (char *)(base + offset / RECV_BLOCK_SIZE * RECV_BLOCK_SIZE);
+}
+
+void
+socket_server_free_buffer(struct socket_server *ss, void *buffer) {
+	if (buffer == NULL)
+		return;
+	int slab;
+	char * block = recvpool_block(&ss->rpool, buffer, &slab);
+	if (block == NULL) {
+		FREE(buffer);
+		return;
+	}
+	// push it to the poller of the slab, the socket thread takes the list away as a whole, so no ABA here
+	struct socket_poller *p = &ss->poller[ss->rpool.owner[slab]];
+	uintptr_t head;
+	do {
+		head = ATOM_LOAD(&p->rfree_remote);
+		*(uintptr_t *)block = head;
+	} while (!ATOM_CAS_POINTER(&p->rfree_remote, head, (uintptr_t)block));
+}
+
 static const void *
 clone_buffer(struct socket_sendbuffer *buf, size_t *sz) {
 	switch (buf->type) {
@@ -505,7 +873,9 @@ force_close(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 	assert(type != SOCKET_TYPE_RESERVE);
 	free_wb_list(ss,&s->high);
 	free_wb_list(ss,&s->low);
-	sp_del(ss->event_fd, s->fd);
+	FREE(s->frame.buffer);
+	s->frame.buffer = NULL;
+	sp_del(get_poller(ss, s->id)->event_fd, s->fd);
 	socket_lock(l);
 	if (type != SOCKET_TYPE_BIND) {
 		if (close(s->fd) < 0) {
@@ -529,8 +899,9 @@ void
 socket_server_release(struct socket_server *ss) {
 	int i;
 	struct socket_message dummy;
-	for (i=0;i<MAX_SOCKET;i++) {
-		struct socket *s = &ss->slot[i];
+	int cap = ATOM_LOAD(&ss->slot_cap);
+	for (i=0;i<cap;i++) {
+		struct socket *s = socket_slot(ss, i);
 		struct socket_lock l;
 		socket_lock_init(s, &l);
 		if (ATOM_LOAD(&s->type) != SOCKET_TYPE_RESERVE) {
@@ -538,11 +909,20 @@ socket_server_release(struct socket_server *ss) {
 		}
 		spinlock_destroy(&s->dw_lock);
 	}
-	close(ss->sendctrl_fd);
-	close(ss->recvctrl_fd);
-	sp_release(ss->event_fd);
-	if (ss->reserve_fd >= 0)
-		close(ss->reserve_fd);
+	for (i=0;i<ss->poller_n;i++) {
+		poller_release(&ss->poller[i]);
+	}
+	FREE(ss->poller);
+	void * base = (void *)ATOM_LOAD(&ss->rpool.base);
+	if (base != NULL && base != MAP_FAILED) {
+		munmap(base, RECV_POOL_SIZE);
+	}
+	for (i=0;i<cap >> SOCKET_PAGE_P;i++) {
+		FREE((void *)ATOM_LOAD(&ss->page[i]));
+	}
+	FREE((void *)ss->page);
+	spinlock_destroy(&ss->invalid.dw_lock);
+	spinlock_destroy(&ss->slot_lock);
 	FREE(ss);
 }
 
@@ -556,7 +936,7 @@ static inline int
 enable_write(struct socket_server *ss, struct socket *s, bool enable) {
 	if (s->writing != enable) {
 		s->writing = enable;
-		return sp_enable(ss->event_fd, s->fd, s, s->reading, enable);
+		return sp_enable(get_poller(ss, s->id)->event_fd, s->fd, s, s->reading, enable);
 	}
 	return 0;
 }
@@ -565,17 +945,18 @@ static inline int
 enable_read(struct socket_server *ss, struct socket *s, bool enable) {
 	if (s->reading != enable) {
 		s->reading = enable;
-		return sp_enable(ss->event_fd, s->fd, s, enable, s->writing);
+		return sp_enable(get_poller(ss, s->id)->event_fd, s->fd, s, enable, s->writing);
 	}
 	return 0;
 }
 
 static struct socket *
 new_fd(struct socket_server *ss, int id, int fd, int protocol, uintptr_t opaque, bool reading) {
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	assert(ATOM_LOAD(&s->type) == SOCKET_TYPE_RESERVE);
 
-	if (sp_add(ss->event_fd, fd, s)) {
+	// the poller of a listen socket may add the accepted one to another poller
+	if (sp_add(get_poller(ss, id)->event_fd, fd, s)) {
 		ATOM_STORE(&s->type, SOCKET_TYPE_INVALID);
 		return NULL;
 	}
@@ -585,12 +966,17 @@ new_fd(struct socket_server *ss, int id, int fd, int protocol, uintptr_t opaque,
 	s->reading = true;
 	s->writing = false;
 	s->closing = false;
-	ATOM_INIT(&s->sending , ID_TAG16(id) << 16 | 0);
+	s->recvpool = false;
+	ATOM_INIT(&s->sending , ID_TAG16(ss, id) << 16 | 0);
 	s->protocol = protocol;
 	s->p.size = MIN_READ_BUFFER;
 	s->opaque = opaque;
 	s->wb_size = 0;
 	s->warn_size = 0;
+	s->high_mark = 0;
+	s->low_mark = 0;
+	s->blocked = false;
+	memset(&s->frame, 0, sizeof(s->frame));
 	check_wb_list(&s->high);
 	check_wb_list(&s->low);
 	s->dw_buffer = NULL;
@@ -612,6 +998,7 @@ stat_read(struct socket_server *ss, struct socket *s, int n) {
 static inline void
 stat_write(struct socket_server *ss, struct socket *s, int n) {
 	s->stat.write += n;
+	s->stat.wcall++;
 	s->stat.wtime = ss->time;
 }
 
@@ -672,8 +1059,9 @@ open_socket(struct socket_server *ss, struct request_open * request, struct sock
 		ATOM_STORE(&ns->type , SOCKET_TYPE_CONNECTED);
 		struct sockaddr * addr = ai_ptr->ai_addr;
 		void * sin_addr = (ai_ptr->ai_family == AF_INET) ? (void*)&((struct sockaddr_in *)addr)->sin_addr : (void*)&((struct sockaddr_in6 *)addr)->sin6_addr;
-		if (inet_ntop(ai_ptr->ai_family, sin_addr, ss->buffer, sizeof(ss->buffer))) {
-			result->data = ss->buffer;
+		struct socket_poller *p = get_poller(ss, id);
+		if (inet_ntop(ai_ptr->ai_family, sin_addr, p->buffer, sizeof(p->buffer))) {
+			result->data = p->buffer;
 		}
 		freeaddrinfo( ai_list );
 		return SOCKET_OPEN;
@@ -692,7 +1080,7 @@ _failed:
 		close(sock);
 	freeaddrinfo( ai_list );
 _failed_getaddrinfo:
-	ATOM_STORE(&ss->slot[HASH_ID(id)].type, SOCKET_TYPE_INVALID);
+	ATOM_STORE(&get_socket(ss, id)->type, SOCKET_TYPE_INVALID);
 	return SOCKET_ERR;
 }
 
@@ -728,32 +1116,70 @@ close_write(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 	}
 }
 
+// drop sz bytes from the head of list, return the bytes beyond the list
+static size_t
+consume_wb_list(struct socket_server *ss, struct wb_list *list, size_t sz) {
+	while (list->head) {
+		struct write_buffer * tmp = list->head;
+		if (sz < tmp->sz) {
+			tmp->ptr += sz;
+			tmp->sz -= sz;
+			return 0;
+		}
+		sz -= tmp->sz;
+		list->head = tmp->next;
+		write_buffer_free(ss,tmp);
+	}
+	list->tail = NULL;
+	return sz;
+}
+
+// write up to MAX_IOV buffers by one writev, the low list follows the high list.
 static int
 send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_lock *l, struct socket_message *result) {
-	while (list->head) {
+	struct iovec iov[MAX_IOV];
+	struct wb_list *next = (list == &s->high) ? &s->low : NULL;
+	for (;;) {
+		int n = 0;
+		size_t total = 0;
+		struct wb_list *from = list;
 		struct write_buffer * tmp = list->head;
-		for (;;) {
-			ssize_t sz = write(s->fd, tmp->ptr, tmp->sz);
-			if (sz < 0) {
-				switch(errno) {
-				case EINTR:
-					continue;
-				case AGAIN_WOULDBLOCK:
-					return -1;
-				}
-				return close_write(ss, s, l, result);
+		while (n < MAX_IOV) {
+			if (tmp == NULL) {
+				if (next == NULL || from == next)
+					break;
+				from = next;
+				tmp = next->head;
+				continue;
 			}
-			stat_write(ss,s,(int)sz);
-			s->wb_size -= sz;
-			if (sz != tmp->sz) {
-				tmp->ptr += sz;
-				tmp->sz -= sz;
+			iov[n].iov_base = tmp->ptr;
+			iov[n].iov_len = tmp->sz;
+			total += tmp->sz;
+			++n;
+			tmp = tmp->next;
+		}
+		if (n == 0) {
+			break;
+		}
+		ssize_t sz = writev(s->fd, iov, n);
+		if (sz < 0) {
+			switch(errno) {
+			case EINTR:
+				continue;
+			case AGAIN_WOULDBLOCK:
 				return -1;
 			}
-			break;
+			return close_write(ss, s, l, result);
+		}
+		stat_write(ss,s,(int)sz);
+		s->wb_size -= sz;
+		size_t left = consume_wb_list(ss, list, sz);
+		if (next && left > 0) {
+			consume_wb_list(ss, next, left);
+		}
+		if ((size_t)sz != total) {
+			return -1;
 		}
-		list->head = tmp->next;
-		write_buffer_free(ss,tmp);
 	}
 	list->tail = NULL;
 
@@ -890,14 +1316,17 @@ send_buffer_(struct socket_server *ss, struct socket *s, struct socket_lock *l,
 	if (s->high.head == NULL) {
 		// step 2
 		if (s->low.head != NULL) {
-			int ret = send_list(ss,s,&s->low,l,result);
-			if (ret != -1) {
-				if (ret == SOCKET_ERR) {
-					// HALFCLOSE_WRITE
-					return SOCKET_ERR;
+			// tcp writes the low list with the high list in step 1, so it's blocked
+			if (s->protocol != PROTOCOL_TCP) {
+				int ret = send_list(ss,s,&s->low,l,result);
+				if (ret != -1) {
+					if (ret == SOCKET_ERR) {
+						// HALFCLOSE_WRITE
+						return SOCKET_ERR;
+					}
+					// SOCKET_RST (ignore)
+					return -1;
 				}
-				// SOCKET_RST (ignore)
-				return -1;
 			}
 			// step 3
 			if (list_uncomplete(&s->low)) {
@@ -935,6 +1364,16 @@ send_buffer_(struct socket_server *ss, struct socket *s, struct socket_lock *l,
 	return -1;
 }
 
+static int
+report_watermark(struct socket *s, struct socket_message *result, bool blocked) {
+	s->blocked = blocked;
+	result->opaque = s->opaque;
+	result->id = s->id;
+	result->ud = blocked;
+	result->data = NULL;
+	return SOCKET_WATERMARK;
+}
+
 static int
 send_buffer(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message *result) {
 	if (!socket_trylock(l))
@@ -959,6 +1398,9 @@ send_buffer(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 	}
 	int r = send_buffer_(ss,s,l,result);
 	socket_unlock(l);
+	if (r == -1 && s->blocked && s->wb_size <= s->low_mark && ATOM_LOAD(&s->type) != SOCKET_TYPE_INVALID) {
+		return report_watermark(s, result, false);
+	}
 
 	return r;
 }
@@ -1006,7 +1448,7 @@ append_sendbuffer_low(struct socket_server *ss,struct socket *s, struct request_
 static int
 trigger_write(struct socket_server *ss, struct request_send * request, struct socket_message *result) {
 	int id = request->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	if (socket_invalid(s, id))
 		return -1;
 	if (enable_write(ss, s, true)) {
@@ -1025,7 +1467,7 @@ trigger_write(struct socket_server *ss, struct request_send * request, struct so
 static int
 send_socket(struct socket_server *ss, struct request_send * request, struct socket_message *result, int priority, const uint8_t *udp_address) {
 	int id = request->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	struct send_object so;
 	send_object_init(ss, &so, request->buffer, request->sz);
 	uint8_t type = ATOM_LOAD(&s->type);
@@ -1083,6 +1525,13 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 			append_sendbuffer_udp(ss,s,priority,request,udp_address);
 		}
 	}
+	if (s->high_mark > 0) {
+		// the watermarks take the place of the warnings
+		if (!s->blocked && s->wb_size >= s->high_mark) {
+			return report_watermark(s, result, true);
+		}
+		return -1;
+	}
 	if (s->wb_size >= WARNING_SIZE && s->wb_size >= s->warn_size) {
 		s->warn_size = s->warn_size == 0 ? WARNING_SIZE *2 : s->warn_size*2;
 		result->opaque = s->opaque;
@@ -1112,12 +1561,13 @@ listen_socket(struct socket_server *ss, struct request_listen * request, struct
 	socklen_t slen = sizeof(u);
 	if (getsockname(listen_fd, &u.s, &slen) == 0) {
 		void * sin_addr = (u.s.sa_family == AF_INET) ? (void*)&u.v4.sin_addr : (void *)&u.v6.sin6_addr;
-		if (inet_ntop(u.s.sa_family, sin_addr, ss->buffer, sizeof(ss->buffer)) == 0) {
+		struct socket_poller *p = get_poller(ss, id);
+		if (inet_ntop(u.s.sa_family, sin_addr, p->buffer, sizeof(p->buffer)) == 0) {
 			result->data = strerror(errno);
 			return SOCKET_ERR;
 		}
 		int sin_port = ntohs((u.s.sa_family == AF_INET) ? u.v4.sin_port : u.v6.sin6_port);
-		result->data = ss->buffer;
+		result->data = p->buffer;
 		result->ud = sin_port;
 	} else {
 		result->data = strerror(errno);
@@ -1131,7 +1581,7 @@ _failed:
 	result->id = id;
 	result->ud = 0;
 	result->data = "reach skynet socket number limit";
-	ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
+	get_socket(ss, id)->type = SOCKET_TYPE_INVALID;
 
 	return SOCKET_ERR;
 }
@@ -1167,7 +1617,7 @@ halfclose_read(struct socket *s) {
 static int
 close_socket(struct socket_server *ss, struct request_close *request, struct socket_message *result) {
 	int id = request->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	if (socket_invalid(s, id)) {
 		// The socket is closed, ignore
 		return -1;
@@ -1217,7 +1667,7 @@ resume_socket(struct socket_server *ss, struct request_resumepause *request, str
 	result->opaque = request->opaque;
 	result->ud = 0;
 	result->data = NULL;
-	struct socket *s = &ss->slot[HASH_ID(id)];
+	struct socket *s = get_socket(ss, id);
 	if (socket_invalid(s, id)) {
 		result->data = "invalid socket";
 		return SOCKET_ERR;
@@ -1252,7 +1702,7 @@ resume_socket(struct socket_server *ss, struct request_resumepause *request, str
 static int
 pause_socket(struct socket_server *ss, struct request_resumepause *request, struct socket_message *result) {
 	int id = request->id;
-	struct socket *s = &ss->slot[HASH_ID(id)];
+	struct socket *s = get_socket(ss, id);
 	if (socket_invalid(s, id)) {
 		return -1;
 	}
@@ -1265,7 +1715,7 @@ pause_socket(struct socket_server *ss, struct request_resumepause *request, stru
 static void
 setopt_socket(struct socket_server *ss, struct request_setopt *request) {
 	int id = request->id;
-	struct socket *s = &ss->slot[HASH_ID(id)];
+	struct socket *s = get_socket(ss, id);
 	if (socket_invalid(s, id)) {
 		return;
 	}
@@ -1274,33 +1724,78 @@ setopt_socket(struct socket_server *ss, struct request_setopt *request) {
 }
 
 static void
-block_readpipe(int pipefd, void *buffer, int sz) {
-	for (;;) {
-		int n = read(pipefd, buffer, sz);
-		if (n<0) {
-			if (errno == EINTR)
-				continue;
-			skynet_error(NULL, "socket-server : read pipe error %s.",strerror(errno));
-			return;
-		}
-		// must atomic read from a pipe
-		assert(n == sz);
+recvpool_socket(struct socket_server *ss, struct request_recvpool *request) {
+	int id = request->id;
+	struct socket *s = get_socket(ss, id);
+	if (socket_invalid(s, id) || s->protocol != PROTOCOL_TCP) {
 		return;
 	}
+	s->recvpool = request->enable;
 }
 
 static int
-has_cmd(struct socket_server *ss) {
-	struct timeval tv = {0,0};
-	int retval;
-
-	FD_SET(ss->recvctrl_fd, &ss->rfds);
-	// retval -> 恢复值
-	retval = select(ss->recvctrl_fd+1, &ss->rfds, NULL, NULL, &tv);
-	if (retval == 1) {
-		return 1;
+watermark_socket(struct socket_server *ss, struct request_watermark *request, struct socket_message *result) {
+	int id = request->id;
+	struct socket *s = get_socket(ss, id);
+	if (socket_invalid(s, id) || s->protocol != PROTOCOL_TCP) {
+		return -1;
 	}
-	return 0;
+	s->high_mark = request->high;
+	s->low_mark = request->low;
+	// report the state at once, if the send buffer is already out of the new marks
+	if (s->high_mark > 0 && !s->blocked && s->wb_size >= s->high_mark) {
+		return report_watermark(s, result, true);
+	}
+	if (s->blocked && (s->high_mark == 0 || s->wb_size <= s->low_mark)) {
+		return report_watermark(s, result, false);
+	}
+	return -1;
+}
+
+// the bytes of the uncomplete packet are returned as SOCKET_DATA when framing is disabled
+static int
+framing_socket(struct socket_server *ss, struct request_framing *request, struct socket_message *result) {
+	int id = request->id;
+	struct socket *s = get_socket(ss, id);
+	if (socket_invalid(s, id) || s->protocol != PROTOCOL_TCP) {
+		return -1;
+	}
+	struct socket_frame *f = &s->frame;
+	f->header = request->header;
+	f->max = request->max;
+	if (f->header == 0 && f->buffer) {
+		char * buffer = f->buffer;
+		int size = f->size;
+		f->buffer = NULL;
+		f->size = f->cap = 0;
+		if (size == 0) {
+			FREE(buffer);
+			return -1;
+		}
+		result->opaque = s->opaque;
+		result->id = id;
+		result->ud = size;
+		result->data = buffer;
+		return SOCKET_DATA;
+	}
+	return -1;
+}
+
+static int
+has_cmd(struct socket_poller *p) {
+	struct ctrl_slot *slot = &p->ring->slot[p->ctrl_head % CTRL_RING_SIZE];
+	return ATOM_LOAD(&slot->seq) == p->ctrl_head + 1;
+}
+
+// the ctrl fd is readable: clear it, and the next send_request signals it again
+static void
+clear_ctrl_signal(struct socket_poller *p) {
+	uint64_t tmp[64];
+	while (read(p->recvctrl_fd, tmp, sizeof(tmp)) > 0) {
+		// a pipe may have more than one byte
+	}
+	ATOM_STORE(&p->ring->signal, 0);
+	p->checkctrl = 1;
 }
 
 static void
@@ -1315,7 +1810,7 @@ add_udp_socket(struct socket_server *ss, struct request_udp *udp) {
 	struct socket *ns = new_fd(ss, id, udp->fd, protocol, udp->opaque, true);
 	if (ns == NULL) {
 		close(udp->fd);
-		ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
+		get_socket(ss, id)->type = SOCKET_TYPE_INVALID;
 		return;
 	}
 	ATOM_STORE(&ns->type , SOCKET_TYPE_CONNECTED);
@@ -1325,7 +1820,7 @@ add_udp_socket(struct socket_server *ss, struct request_udp *udp) {
 static int
 set_udp_address(struct socket_server *ss, struct request_setudp *request, struct socket_message *result) {
 	int id = request->id;
-	struct socket *s = &ss->slot[HASH_ID(id)];
+	struct socket *s = get_socket(ss, id);
 	if (socket_invalid(s, id)) {
 		return -1;
 	}
@@ -1351,7 +1846,7 @@ dial_udp_socket(struct socket_server *ss, struct request_dial_udp *request, stru
 	struct socket *ns = new_fd(ss, id, request->fd, protocol, request->opaque, true);
 	if (ns == NULL){
 		close(request->fd);
-		ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
+		get_socket(ss, id)->type = SOCKET_TYPE_INVALID;
 		return -1;
 	}
 
@@ -1368,12 +1863,12 @@ dial_udp_socket(struct socket_server *ss, struct request_dial_udp *request, stru
 }
 
 static inline void
-inc_sending_ref(struct socket *s, int id) {
+inc_sending_ref(struct socket_server *ss, struct socket *s, int id) {
 	if (s->protocol != PROTOCOL_TCP)
 		return;
 	for (;;) {
 		unsigned long sending = ATOM_LOAD(&s->sending);
-		if ((sending >> 16) == ID_TAG16(id)) {
+		if ((sending >> 16) == ID_TAG16(ss, id)) {
 			if ((sending & 0xffff) == 0xffff) {
 				// s->sending may overflow (rarely), so busy waiting here for socket thread dec it. see issue #794
 				continue;
@@ -1391,7 +1886,7 @@ inc_sending_ref(struct socket *s, int id) {
 
 static inline void
 dec_sending_ref(struct socket_server *ss, int id) {
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	// Notice: udp may inc sending while type == SOCKET_TYPE_RESERVE
 	if (s->id == id && s->protocol == PROTOCOL_TCP) {
 		assert((ATOM_LOAD(&s->sending) & 0xffff) != 0);
@@ -1401,17 +1896,23 @@ dec_sending_ref(struct socket_server *ss, int id) {
 
 // return type
 static int
-ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
-	int fd = ss->recvctrl_fd;
+ctrl_cmd(struct socket_server *ss, struct socket_poller *p, struct socket_message *result) {
 	// the length of message is one byte, so 256 buffer size is enough.
 	// 这个256是什么，是字节吗？？？？
 	// 无符号char，那就是一字节
-	uint8_t buffer[256];
-	uint8_t header[2];
-	block_readpipe(fd, header, sizeof(header));
-	int type = header[0];
-	int len = header[1];
-	block_readpipe(fd, buffer, len);
+	union {
+		uint8_t buffer[256];
+		uintptr_t align;
+	} u;
+	uint8_t *buffer = u.buffer;
+	size_t head = p->ctrl_head;
+	struct ctrl_slot *slot = &p->ring->slot[head % CTRL_RING_SIZE];
+	int type = slot->type;
+	int len = slot->len;
+	memcpy(buffer, slot->u.buffer, len);
+	// release the slot to the producer of next round
+	ATOM_STORE(&slot->seq, head + CTRL_RING_SIZE);
+	p->ctrl_head = head + 1;
 	// ctrl command only exist in local fd, so don't worry about endian.
 	switch (type) {
 	case 'R':
@@ -1456,6 +1957,13 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 	case 'U':
 		add_udp_socket(ss, (struct request_udp *)buffer);
 		return -1;
+	case 'M':
+		recvpool_socket(ss, (struct request_recvpool *)buffer);
+		return -1;
+	case 'H':
+		return watermark_socket(ss, (struct request_watermark *)buffer, result);
+	case 'F':
+		return framing_socket(ss, (struct request_framing *)buffer, result);
 	default:
 		skynet_error(NULL, "socket-server: Unknown ctrl %c.",type);
 		return -1;
@@ -1464,14 +1972,48 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 	return -1;
 }
 
+// the backend may have received the data already (see socket_uring.h), the buffer should hold e->recv_size bytes
+static inline int
+read_socket(int fd, struct event *e, char *buffer, int sz) {
+	if (!e->recv) {
+		return (int)read(fd, buffer, sz);
+	}
+	if (e->recv_size < 0) {
+		errno = -e->recv_size;
+		return -1;
+	}
+	memcpy(buffer, e->recv_data, e->recv_size);
+	return e->recv_size;
+}
+
 // return -1 (ignore) when error
 static int
-forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
+forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct event *e, struct socket_message * result) {
+	struct socket_poller *p = get_poller(ss, s->id);
 	int sz = s->p.size;
-	char * buffer = MALLOC(sz);
-	int n = (int)read(s->fd, buffer, sz);
+	char * buffer = NULL;
+	// the read size grows out of the block as usual, then it's malloc'd
+	if (s->recvpool && sz <= RECV_BLOCK_SIZE - SOCKET_RECV_HEADER
+		&& (!e->recv || e->recv_size <= RECV_BLOCK_SIZE - SOCKET_RECV_HEADER)) {
+		buffer = recvpool_alloc(ss, p);
+	}
+	bool pooled = buffer != NULL;
+	if (pooled) {
+		buffer += SOCKET_RECV_HEADER;
+		sz = RECV_BLOCK_SIZE - SOCKET_RECV_HEADER;
+	} else {
+		if (e->recv && e->recv_size > sz) {
+			sz = e->recv_size;
+		}
+		buffer = MALLOC(sz);
+	}
+	int n = read_socket(s->fd, e, buffer, sz);
 	if (n<0) {
-		FREE(buffer);
+		if (pooled) {
+			recvpool_free(p, buffer - SOCKET_RECV_HEADER);
+		} else {
+			FREE(buffer);
+		}
 		switch(errno) {
 		case EINTR:
 		case AGAIN_WOULDBLOCK:
@@ -1482,7 +2024,11 @@ forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lo
 		return -1;
 	}
 	if (n==0) {
-		FREE(buffer);
+		if (pooled) {
+			recvpool_free(p, buffer - SOCKET_RECV_HEADER);
+		} else {
+			FREE(buffer);
+		}
 		if (s->closing) {
 			// Rare case : if s->closing is true, reading event is disable, and SOCKET_CLOSE is raised.
 			if (nomore_sending_data(s)) {
@@ -1506,7 +2052,7 @@ forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lo
 
 	if (halfclose_read(s)) {
 		// discard recv data (Rare case : if socket is HALFCLOSE_READ, reading event is disable.)
-		FREE(buffer);
+		socket_server_free_buffer(ss, buffer);
 		return -1;
 	}
 
@@ -1516,17 +2062,143 @@ forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lo
 	result->id = s->id;
 	result->ud = n;
 	result->data = buffer;
+	result->pooled = pooled;
 
+	if (e->recv) {
+		// the next RECV is armed by the next sp_wait
+		return SOCKET_DATA;
+	}
 	if (n == sz) {
-		s->p.size *= 2;
+		// a full block takes the next read out of the pool
+		s->p.size = sz * 2;
 		return SOCKET_MORE;
-	} else if (sz > MIN_READ_BUFFER && n*2 < sz) {
+	} else if (!pooled && sz > MIN_READ_BUFFER && n*2 < sz) {
 		s->p.size /= 2;
 	}
 
 	return SOCKET_DATA;
 }
 
+static inline int
+frame_length(const uint8_t *h, int header) {
+	if (header == 2) {
+		return h[0] << 8 | h[1];
+	}
+	uint32_t len = (uint32_t)h[0] << 24 | h[1] << 16 | h[2] << 8 | h[3];
+	return len > INT_MAX ? -1 : (int)len;
+}
+
+// Read after the uncomplete packet, forward the whole packets at the beginning as SOCKET_FRAME,
+// and keep the rest for the next read. return -1 (ignore) when there is no whole packet, or error
+static int
+forward_message_frame(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct event *e, struct socket_message * result) {
+	struct socket_frame *f = &s->frame;
+	int sz = s->p.size;
+	if (e->recv && e->recv_size > sz) {
+		sz = e->recv_size;
+	}
+	if (f->size >= f->header) {
+		// read the rest of the uncomplete packet at least
+		int need = f->header + frame_length((const uint8_t *)f->buffer, f->header) - f->size;
+		if (need > sz) {
+			sz = need;
+		}
+	}
+	if (f->size + sz > f->cap) {
+		char * buffer = MALLOC(f->size + sz);
+		if (f->size > 0) {
+			memcpy(buffer, f->buffer, f->size);
+		}
+		FREE(f->buffer);
+		f->buffer = buffer;
+		f->cap = f->size + sz;
+	}
+	int n = read_socket(s->fd, e, f->buffer + f->size, sz);
+	if (n<0) {
+		switch(errno) {
+		case EINTR:
+		case AGAIN_WOULDBLOCK:
+			break;
+		default:
+			return report_error(s, result, strerror(errno));
+		}
+		return -1;
+	}
+	if (n==0) {
+		if (s->closing) {
+			if (nomore_sending_data(s)) {
+				force_close(ss,s,l,result);
+			}
+			return -1;
+		}
+		int t = ATOM_LOAD(&s->type);
+		if (t == SOCKET_TYPE_HALFCLOSE_READ) {
+			return -1;
+		}
+		if (t == SOCKET_TYPE_HALFCLOSE_WRITE) {
+			force_close(ss,s,l,result);
+		} else {
+			close_read(ss, s, result);
+		}
+		return SOCKET_CLOSE;
+	}
+
+	if (halfclose_read(s)) {
+		return -1;
+	}
+
+	stat_read(ss,s,n);
+
+	if (!e->recv) {
+		if (n == s->p.size) {
+			s->p.size *= 2;
+		} else if (s->p.size > MIN_READ_BUFFER && n*2 < s->p.size) {
+			s->p.size /= 2;
+		}
+	}
+
+	f->size += n;
+	int offset = 0;
+	while (f->size - offset >= f->header) {
+		int len = frame_length((const uint8_t *)f->buffer + offset, f->header);
+		if (len < 0 || len > f->max) {
+			// stop reading, the owner should close it
+			enable_read(ss, s, false);
+			FREE(f->buffer);
+			f->buffer = NULL;
+			f->size = f->cap = 0;
+			return report_error(s, result, "frame too large");
+		}
+		if (f->size - offset - f->header < len) {
+			break;
+		}
+		offset += f->header + len;
+	}
+	if (offset == 0) {
+		return -1;
+	}
+
+	result->opaque = s->opaque;
+	result->id = s->id;
+	result->ud = offset;
+	result->data = f->buffer;
+	result->pooled = 0;
+
+	int rest = f->size - offset;
+	if (rest > 0) {
+		char * buffer = MALLOC(rest + s->p.size);
+		memcpy(buffer, f->buffer + offset, rest);
+		f->buffer = buffer;
+		f->size = rest;
+		f->cap = rest + s->p.size;
+	} else {
+		f->buffer = NULL;
+		f->size = f->cap = 0;
+	}
+
+	return (n == sz && !e->recv) ? SOCKET_MORE : SOCKET_FRAME;
+}
+
 static int
 gen_udp_address(int protocol, union sockaddr_all *sa, uint8_t * udp_address) {
 	int addrsz = 1;
@@ -1549,7 +2221,8 @@ static int
 forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
 	union sockaddr_all sa;
 	socklen_t slen = sizeof(sa);
-	int n = recvfrom(s->fd, ss->udpbuffer,MAX_UDP_PACKAGE,0,&sa.s,&slen);
+	uint8_t * udpbuffer = get_poller(ss, s->id)->udpbuffer;
+	int n = recvfrom(s->fd, udpbuffer,MAX_UDP_PACKAGE,0,&sa.s,&slen);
 	if (n<0) {
 		switch(errno) {
 		case EINTR:
@@ -1576,7 +2249,7 @@ forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_lo
 		data = MALLOC(n + 1 + 2 + 16);
 		gen_udp_address(PROTOCOL_UDPv6, &sa, data + n);
 	}
-	memcpy(data, ss->udpbuffer, n);
+	memcpy(data, udpbuffer, n);
 
 	result->opaque = s->opaque;
 	result->id = s->id;
@@ -1612,8 +2285,9 @@ report_connect(struct socket_server *ss, struct socket *s, struct socket_lock *l
 		socklen_t slen = sizeof(u);
 		if (getpeername(s->fd, &u.s, &slen) == 0) {
 			void * sin_addr = (u.s.sa_family == AF_INET) ? (void*)&u.v4.sin_addr : (void *)&u.v6.sin6_addr;
-			if (inet_ntop(u.s.sa_family, sin_addr, ss->buffer, sizeof(ss->buffer))) {
-				result->data = ss->buffer;
+			struct socket_poller *p = get_poller(ss, s->id);
+			if (inet_ntop(u.s.sa_family, sin_addr, p->buffer, sizeof(p->buffer))) {
+				result->data = p->buffer;
 				return SOCKET_OPEN;
 			}
 		}
@@ -1636,12 +2310,28 @@ getname(union sockaddr_all *u, char *buffer, size_t sz) {
 	}
 }
 
+// accept4 sets the flags within the accept call, SO_KEEPALIVE is inherited from the listen socket (see do_listen)
+static int
+accept_fd(int fd, struct sockaddr *addr, socklen_t *len) {
+#ifdef __linux__
+	return accept4(fd, addr, len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	int client_fd = accept(fd, addr, len);
+	if (client_fd >= 0) {
+		socket_keepalive(client_fd);
+		sp_nonblocking(client_fd);
+	}
+	return client_fd;
+#endif
+}
+
 // return 0 when failed, or -1 when file limit
 static int
 report_accept(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+	struct socket_poller *p = get_poller(ss, s->id);
 	union sockaddr_all u;
 	socklen_t len = sizeof(u);
-	int client_fd = accept(s->fd, &u.s, &len);
+	int client_fd = accept_fd(s->fd, &u.s, &len);
 	if (client_fd < 0) {
 		if (errno == EMFILE || errno == ENFILE) {
 			result->opaque = s->opaque;
@@ -1650,13 +2340,13 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 			result->data = strerror(errno);
 
 			// See https://stackoverflow.com/questions/47179793/how-to-gracefully-handle-accept-giving-emfile-and-close-the-connection
-			if (ss->reserve_fd >= 0) {
-				close(ss->reserve_fd);
+			if (p->reserve_fd >= 0) {
+				close(p->reserve_fd);
 				client_fd = accept(s->fd, &u.s, &len);
 				if (client_fd >= 0) {
 					close(client_fd);
 				}
-				ss->reserve_fd = dup(1);
+				p->reserve_fd = dup(1);
 			}
 			return -1;
 		} else {
@@ -1668,8 +2358,6 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 		close(client_fd);
 		return 0;
 	}
-	socket_keepalive(client_fd);
-	sp_nonblocking(client_fd);
 	struct socket *ns = new_fd(ss, id, client_fd, PROTOCOL_TCP, s->opaque, false);
 	if (ns == NULL) {
 		close(client_fd);
@@ -1683,21 +2371,23 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 	result->id = s->id;
 	result->ud = id;
 	result->data = NULL;
+	// the owner takes the accepts in SKYNET_SOCKET_TYPE_BATCH (see socket_server_recvpool)
+	result->pooled = s->recvpool;
 
-	if (getname(&u, ss->buffer, sizeof(ss->buffer))) {
-		result->data = ss->buffer;
+	if (getname(&u, p->buffer, sizeof(p->buffer))) {
+		result->data = p->buffer;
 	}
 
 	return 1;
 }
 
 static inline void 
-clear_closed_event(struct socket_server *ss, struct socket_message * result, int type) {
+clear_closed_event(struct socket_poller *p, struct socket_message * result, int type) {
 	if (type == SOCKET_CLOSE || type == SOCKET_ERR) {
 		int id = result->id;
 		int i;
-		for (i=ss->event_index; i<ss->event_n; i++) {
-			struct event *e = &ss->ev[i];
+		for (i=p->event_index; i<p->event_n; i++) {
+			struct event *e = &p->ev[i];
 			struct socket *s = e->s;
 			if (s) {
 				if (socket_invalid(s, id) && s->id == id) {
@@ -1711,32 +2401,40 @@ clear_closed_event(struct socket_server *ss, struct socket_message * result, int
 
 // return type
 int 
-socket_server_poll(struct socket_server *ss, struct socket_message * result, int * more) {
+socket_server_poll(struct socket_server *ss, int poller, struct socket_message * result, int * more) {
+	struct socket_poller *p = &ss->poller[poller];
+	result->pooled = 0;
 	for (;;) {
 		// 是否有消息
-		if (ss->checkctrl) {
+		if (p->checkctrl) {
 			// 是否有指令？
-			if (has_cmd(ss)) {
-				int type = ctrl_cmd(ss, result);
+			if (has_cmd(p)) {
+				int type = ctrl_cmd(ss, p, result);
 				if (type != -1) {
 					// 直接关了？
-					clear_closed_event(ss, result, type);
+					clear_closed_event(p, result, type);
 					return type;
 				} else
 					continue;
 			} else {
-				ss->checkctrl = 0;
+				p->checkctrl = 0;
 			}
 		}
-		if (ss->event_index == ss->event_n) {
-			ss->event_n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT);
-			ss->checkctrl = 1;
+		if (p->event_index == p->event_n) {
+			if (!p->idle) {
+				// the last events may give no message (EAGAIN after SOCKET_MORE or an accept), report it before waiting
+				p->idle = 1;
+				return SOCKET_IDLE;
+			}
+			p->event_n = sp_wait(p->event_fd, p->ev, MAX_EVENT);
+			p->idle = 0;
+			p->checkctrl = 1;
 			if (more) {
 				*more = 0;
 			}
-			ss->event_index = 0;
-			if (ss->event_n <= 0) {
-				ss->event_n = 0;
+			p->event_index = 0;
+			if (p->event_n <= 0) {
+				p->event_n = 0;
 				int err = errno;
 				if (err != EINTR) {
 					skynet_error(NULL, "socket-server: %s", strerror(err));
@@ -1744,10 +2442,11 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 				continue;
 			}
 		}
-		struct event *e = &ss->ev[ss->event_index++];
+		struct event *e = &p->ev[p->event_index++];
 		struct socket *s = e->s;
 		if (s == NULL) {
-			// dispatch pipe message at beginning
+			// ctrl fd, dispatch the requests at beginning
+			clear_ctrl_signal(p);
 			continue;
 		}
 		struct socket_lock l;
@@ -1758,8 +2457,16 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 		case SOCKET_TYPE_LISTEN: {
 			int ok = report_accept(ss, s, result);
 			if (ok > 0) {
+				// accept again in the next poll, until EAGAIN or accept_batch connections for this event
+				if (++p->accept_n < ss->accept_batch) {
+					--p->event_index;
+				} else {
+					p->accept_n = 0;
+				}
 				return SOCKET_ACCEPT;
-			} if (ok < 0 ) {
+			}
+			p->accept_n = 0;
+			if (ok < 0 ) {
 				return SOCKET_ERR;
 			}
 			// when ok == 0, retry
@@ -1768,27 +2475,38 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 		case SOCKET_TYPE_INVALID:
 			skynet_error(NULL, "socket-server: invalid socket");
 			break;
+		case SOCKET_TYPE_RESERVE:
+			// accepted by another poller, new_fd is not finished
+			break;
 		default:
-			if (e->read) {
+			// the event may be fetched before another poller disabled reading (see report_accept),
+			// but the data received by the backend is forwarded anyway
+			if (e->read && (s->reading || e->recv)) {
 				int type;
-				if (s->protocol == PROTOCOL_TCP) {
-					type = forward_message_tcp(ss, s, &l, result);
+				if (s->protocol == PROTOCOL_TCP && s->frame.header) {
+					type = forward_message_frame(ss, s, &l, e, result);
+					if (type == SOCKET_MORE) {
+						--p->event_index;
+						return SOCKET_FRAME;
+					}
+				} else if (s->protocol == PROTOCOL_TCP) {
+					type = forward_message_tcp(ss, s, &l, e, result);
 					if (type == SOCKET_MORE) {
-						--ss->event_index;
+						--p->event_index;
 						return SOCKET_DATA;
 					}
 				} else {
 					type = forward_message_udp(ss, s, &l, result);
 					if (type == SOCKET_UDP) {
 						// try read again
-						--ss->event_index;
+						--p->event_index;
 						return SOCKET_UDP;
 					}
 				}
 				if (e->write && type != SOCKET_CLOSE && type != SOCKET_ERR) {
 					// Try to dispatch write message next step if write flag set.
 					e->read = false;
-					--ss->event_index;
+					--p->event_index;
 				}
 				if (type == -1)
 					break;				
@@ -1828,21 +2546,44 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 	}
 }
 
+// send the request to the poller of socket id
 static void
-send_request(struct socket_server *ss, struct request_package *request, char type, int len) {
-	request->header[6] = (uint8_t)type;
-	request->header[7] = (uint8_t)len;
-	const char * req = (const char *)request + offsetof(struct request_package, header[6]);
+send_request(struct socket_server *ss, int id, struct request_package *request, char type, int len) {
+	struct socket_poller *p = get_poller(ss, id);
+	struct ctrl_ring *r = p->ring;
+	struct ctrl_slot *slot;
+	size_t pos = ATOM_LOAD(&r->tail);
 	for (;;) {
-		ssize_t n = write(ss->sendctrl_fd, req, len+2);
-		if (n<0) {
-			if (errno != EINTR) {
-				skynet_error(NULL, "socket-server : send ctrl command error %s.", strerror(errno));
+		slot = &r->slot[pos % CTRL_RING_SIZE];
+		size_t seq = ATOM_LOAD(&slot->seq);
+		if (seq == pos) {
+			if (ATOM_CAS_SIZET(&r->tail, pos, pos + 1))
+				break;
+		} else if ((intptr_t)(seq - pos) < 0) {
+			// the ring is full, wait the socket thread.
+			// compare the distance, size_t wraps on 32bit platform
+			sched_yield();
+		}
+		pos = ATOM_LOAD(&r->tail);
+	}
+	slot->type = (uint8_t)type;
+	slot->len = (uint8_t)len;
+	memcpy(slot->u.buffer, &request->u, len);
+	ATOM_STORE(&slot->seq, pos + 1);
+	// only the first request after the socket thread cleared the signal writes the ctrl fd
+	if (ATOM_LOAD(&r->signal) == 0 && ATOM_CAS(&r->signal, 0, 1)) {
+		uint64_t one = 1;
+		for (;;) {
+			ssize_t n = write(p->sendctrl_fd, &one, sizeof(one));
+			if (n<0) {
+				if (errno == EINTR)
+					continue;
+				if (errno != EAGAIN) {
+					skynet_error(NULL, "socket-server : send ctrl command error %s.", strerror(errno));
+				}
 			}
-			continue;
+			return;
 		}
-		assert(n == len+2);
-		return;
 	}
 }
 
@@ -1871,7 +2612,7 @@ socket_server_connect(struct socket_server *ss, uintptr_t opaque, const char * a
 	int len = open_request(ss, &request, opaque, addr, port);
 	if (len < 0)
 		return -1;
-	send_request(ss, &request, 'O', sizeof(request.u.open) + len);
+	send_request(ss, request.u.open.id, &request, 'O', sizeof(request.u.open) + len);
 	return request.u.open.id;
 }
 
@@ -1884,7 +2625,7 @@ can_direct_write(struct socket *s, int id) {
 int 
 socket_server_send(struct socket_server *ss, struct socket_sendbuffer *buf) {
 	int id = buf->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	if (socket_invalid(s, id) || s->closing) {
 		free_buffer(ss, buf);
 		return -1;
@@ -1936,20 +2677,20 @@ socket_server_send(struct socket_server *ss, struct socket_sendbuffer *buf) {
 			request.u.send.buffer = NULL;
 
 			// let socket thread enable write event
-			send_request(ss, &request, 'W', sizeof(request.u.send));
+			send_request(ss, request.u.send.id, &request, 'W', sizeof(request.u.send));
 
 			return 0;
 		}
 		socket_unlock(&l);
 	}
 
-	inc_sending_ref(s, id);
+	inc_sending_ref(ss, s, id);
 
 	struct request_package request;
 	request.u.send.id = id;
 	request.u.send.buffer = clone_buffer(buf, &request.u.send.sz);
 
-	send_request(ss, &request, 'D', sizeof(request.u.send));
+	send_request(ss, request.u.send.id, &request, 'D', sizeof(request.u.send));
 	return 0;
 }
 
@@ -1958,26 +2699,30 @@ int
 socket_server_send_lowpriority(struct socket_server *ss, struct socket_sendbuffer *buf) {
 	int id = buf->id;
 
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	if (socket_invalid(s, id)) {
 		free_buffer(ss, buf);
 		return -1;
 	}
 
-	inc_sending_ref(s, id);
+	inc_sending_ref(ss, s, id);
 
 	struct request_package request;
 	request.u.send.id = id;
 	request.u.send.buffer = clone_buffer(buf, &request.u.send.sz);
 
-	send_request(ss, &request, 'P', sizeof(request.u.send));
+	send_request(ss, request.u.send.id, &request, 'P', sizeof(request.u.send));
 	return 0;
 }
 
 void
 socket_server_exit(struct socket_server *ss) {
 	struct request_package request;
-	send_request(ss, &request, 'X', 0);
+	int i;
+	for (i=0;i<ss->poller_n;i++) {
+		// socket id i is served by poller i
+		send_request(ss, i, &request, 'X', 0);
+	}
 }
 
 void
@@ -1986,7 +2731,7 @@ socket_server_close(struct socket_server *ss, uintptr_t opaque, int id) {
 	request.u.close.id = id;
 	request.u.close.shutdown = 0;
 	request.u.close.opaque = opaque;
-	send_request(ss, &request, 'K', sizeof(request.u.close));
+	send_request(ss, request.u.close.id, &request, 'K', sizeof(request.u.close));
 }
 
 
@@ -1996,13 +2741,14 @@ socket_server_shutdown(struct socket_server *ss, uintptr_t opaque, int id) {
 	request.u.close.id = id;
 	request.u.close.shutdown = 1;
 	request.u.close.opaque = opaque;
-	send_request(ss, &request, 'K', sizeof(request.u.close));
+	send_request(ss, request.u.close.id, &request, 'K', sizeof(request.u.close));
 }
 
 // return -1 means failed
 // or return AF_INET or AF_INET6
+// reuseport sets SO_REUSEPORT, so that several sockets can bind the same port and the kernel balances the connections among them
 static int
-do_bind(const char *host, int port, int protocol, int *family) {
+do_bind(const char *host, int port, int protocol, int *family, int reuseport) {
 	int fd;
 	int status;
 	int reuse = 1;
@@ -2035,6 +2781,15 @@ do_bind(const char *host, int port, int protocol, int *family) {
 	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&reuse, sizeof(int))==-1) {
 		goto _failed;
 	}
+	if (reuseport) {
+#ifdef SO_REUSEPORT
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&reuse, sizeof(int))==-1) {
+			goto _failed;
+		}
+#else
+		goto _failed;
+#endif
+	}
 	status = bind(fd, (struct sockaddr *)ai_list->ai_addr, ai_list->ai_addrlen);
 	if (status != 0)
 		goto _failed;
@@ -2049,9 +2804,9 @@ _failed_fd:
 }
 
 static int
-do_listen(const char * host, int port, int backlog) {
+do_listen(const char * host, int port, int backlog, int reuseport) {
 	int family = 0;
-	int listen_fd = do_bind(host, port, IPPROTO_TCP, &family);
+	int listen_fd = do_bind(host, port, IPPROTO_TCP, &family, reuseport);
 	if (listen_fd < 0) {
 		return -1;
 	}
@@ -2059,14 +2814,18 @@ do_listen(const char * host, int port, int backlog) {
 		close(listen_fd);
 		return -1;
 	}
+	// the accepted sockets inherit it
+	socket_keepalive(listen_fd);
+	// report_accept accepts until EAGAIN
+	sp_nonblocking(listen_fd);
 	return listen_fd;
 }
 
 // 这个 ss 是什么时候创建的 -> 一开始就创建了
 // opaque 是 source handle
-int 
-socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog) {
-	int fd = do_listen(addr, port, backlog);
+static int
+listen_request(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog, int reuseport) {
+	int fd = do_listen(addr, port, backlog, reuseport);
 	if (fd < 0) {
 		return -1;
 	}
@@ -2079,10 +2838,22 @@ socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * ad
 	request.u.listen.opaque = opaque;
 	request.u.listen.id = id;
 	request.u.listen.fd = fd;
-	send_request(ss, &request, 'L', sizeof(request.u.listen));
+	send_request(ss, request.u.listen.id, &request, 'L', sizeof(request.u.listen));
 	return id;
 }
 
+int 
+socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog) {
+	return listen_request(ss, opaque, addr, port, backlog, 0);
+}
+
+// Each call opens another listen socket on the same port, owned by its own opaque.
+// The sockets are hashed to the pollers by id, so the accepts are spread on both the kernel and the socket threads.
+int
+socket_server_listen_reuseport(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog) {
+	return listen_request(ss, opaque, addr, port, backlog, 1);
+}
+
 int
 socket_server_bind(struct socket_server *ss, uintptr_t opaque, int fd) {
 	struct request_package request;
@@ -2092,7 +2863,7 @@ socket_server_bind(struct socket_server *ss, uintptr_t opaque, int fd) {
 	request.u.bind.opaque = opaque;
 	request.u.bind.id = id;
 	request.u.bind.fd = fd;
-	send_request(ss, &request, 'B', sizeof(request.u.bind));
+	send_request(ss, request.u.bind.id, &request, 'B', sizeof(request.u.bind));
 	return id;
 }
 
@@ -2101,7 +2872,7 @@ socket_server_start(struct socket_server *ss, uintptr_t opaque, int id) {
 	struct request_package request;
 	request.u.resumepause.id = id;
 	request.u.resumepause.opaque = opaque;
-	send_request(ss, &request, 'R', sizeof(request.u.resumepause));
+	send_request(ss, request.u.resumepause.id, &request, 'R', sizeof(request.u.resumepause));
 }
 
 void
@@ -2109,7 +2880,15 @@ socket_server_pause(struct socket_server *ss, uintptr_t opaque, int id) {
 	struct request_package request;
 	request.u.resumepause.id = id;
 	request.u.resumepause.opaque = opaque;
-	send_request(ss, &request, 'S', sizeof(request.u.resumepause));
+	send_request(ss, request.u.resumepause.id, &request, 'S', sizeof(request.u.resumepause));
+}
+
+void
+socket_server_recvpool(struct socket_server *ss, int id, int enable) {
+	struct request_package request;
+	request.u.recvpool.id = id;
+	request.u.recvpool.enable = enable;
+	send_request(ss, request.u.recvpool.id, &request, 'M', sizeof(request.u.recvpool));
 }
 
 void
@@ -2118,7 +2897,46 @@ socket_server_nodelay(struct socket_server *ss, int id) {
 	request.u.setopt.id = id;
 	request.u.setopt.what = TCP_NODELAY;
 	request.u.setopt.value = 1;
-	send_request(ss, &request, 'T', sizeof(request.u.setopt));
+	send_request(ss, request.u.setopt.id, &request, 'T', sizeof(request.u.setopt));
+}
+
+// low is clamped to [0, high]. high == 0 disables the watermarks
+void
+socket_server_watermark(struct socket_server *ss, int id, int high, int low) {
+	struct request_package request;
+	if (high < 0) {
+		high = 0;
+	}
+	if (low > high) {
+		low = high;
+	} else if (low < 0) {
+		low = 0;
+	}
+	request.u.watermark.id = id;
+	request.u.watermark.high = high;
+	request.u.watermark.low = low;
+	send_request(ss, request.u.watermark.id, &request, 'H', sizeof(request.u.watermark));
+}
+
+void
+socket_server_framing(struct socket_server *ss, int id, int header, int max) {
+	struct request_package request;
+	if (header != 2 && header != 4) {
+		header = 0;
+	}
+	if (header == 2) {
+		if (max <= 0 || max > 0xffff) {
+			max = 0xffff;
+		}
+	} else if (max <= 0) {
+		max = 0xffffff;
+	} else if (max > INT_MAX - header) {
+		max = INT_MAX - header;
+	}
+	request.u.framing.id = id;
+	request.u.framing.header = header;
+	request.u.framing.max = max;
+	send_request(ss, request.u.framing.id, &request, 'F', sizeof(request.u.framing));
 }
 
 void 
@@ -2134,7 +2952,7 @@ socket_server_udp(struct socket_server *ss, uintptr_t opaque, const char * addr,
 	int family;
 	if (port != 0 || addr != NULL) {
 		// bind
-		fd = do_bind(addr, port, IPPROTO_UDP, &family);
+		fd = do_bind(addr, port, IPPROTO_UDP, &family, 0);
 		if (fd < 0) {
 			return -1;
 		}
@@ -2158,7 +2976,7 @@ socket_server_udp(struct socket_server *ss, uintptr_t opaque, const char * addr,
 	request.u.udp.opaque = opaque;
 	request.u.udp.family = family;
 
-	send_request(ss, &request, 'U', sizeof(request.u.udp));	
+	send_request(ss, request.u.udp.id, &request, 'U', sizeof(request.u.udp));	
 	return id;
 }
 
@@ -2171,7 +2989,7 @@ socket_server_udp_listen(struct socket_server *ss, uintptr_t opaque, const char*
 
 	int family;
 	// bind
-	fd = do_bind(addr, port, IPPROTO_UDP, &family);
+	fd = do_bind(addr, port, IPPROTO_UDP, &family, 0);
 	if (fd < 0) {
 		return -1;
 	}
@@ -2189,7 +3007,7 @@ socket_server_udp_listen(struct socket_server *ss, uintptr_t opaque, const char*
 	request.u.udp.opaque = opaque;
 	request.u.udp.family = family;
 
-	send_request(ss, &request, 'U', sizeof(request.u.udp));
+	send_request(ss, request.u.udp.id, &request, 'U', sizeof(request.u.udp));
 	return id;
 }
 
@@ -2244,14 +3062,14 @@ socket_server_udp_dial(struct socket_server *ss, uintptr_t opaque, const char* a
 
 	freeaddrinfo( ai_list );
 
-	send_request(ss, &request, 'N', sizeof(request.u.dial_udp) - sizeof(request.u.dial_udp.address) + addrsz);
+	send_request(ss, request.u.dial_udp.id, &request, 'N', sizeof(request.u.dial_udp) - sizeof(request.u.dial_udp.address) + addrsz);
 	return id;
 }
 
 int 
 socket_server_udp_send(struct socket_server *ss, const struct socket_udp_address *addr, struct socket_sendbuffer *buf) {
 	int id = buf->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	if (socket_invalid(s, id)) {
 		free_buffer(ss, buf);
 		return -1;
@@ -2306,13 +3124,13 @@ socket_server_udp_send(struct socket_server *ss, const struct socket_udp_address
 
 	memcpy(request.u.send_udp.address, udp_address, addrsz);
 
-	send_request(ss, &request, 'A', sizeof(request.u.send_udp.send)+addrsz);
+	send_request(ss, request.u.send_udp.send.id, &request, 'A', sizeof(request.u.send_udp.send)+addrsz);
 	return 0;
 }
 
 int
 socket_server_udp_connect(struct socket_server *ss, int id, const char * addr, int port) {
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	if (socket_invalid(s, id)) {
 		return -1;
 	}
@@ -2357,7 +3175,7 @@ socket_server_udp_connect(struct socket_server *ss, int id, const char * addr, i
 
 	freeaddrinfo( ai_list );
 
-	send_request(ss, &request, 'C', sizeof(request.u.set_udp) - sizeof(request.u.set_udp.address) +addrsz);
+	send_request(ss, request.u.set_udp.id, &request, 'C', sizeof(request.u.set_udp) - sizeof(request.u.set_udp.address) +addrsz);
 
 	return 0;
 }
@@ -2438,6 +3256,7 @@ query_info(struct socket *s, struct socket_info *si) {
 	si->write = s->stat.write;
 	si->rtime = s->stat.rtime;
 	si->wtime = s->stat.wtime;
+	si->wcall = s->stat.wcall;
 	si->wbuffer = s->wb_size;
 	si->reading = s->reading;
 	si->writing = s->writing;
@@ -2449,8 +3268,9 @@ struct socket_info *
 socket_server_info(struct socket_server *ss) {
 	int i;
 	struct socket_info * si = NULL;
-	for (i=0;i<MAX_SOCKET;i++) {
-		struct socket * s = &ss->slot[i];
+	int cap = ATOM_LOAD(&ss->slot_cap);
+	for (i=0;i<cap;i++) {
+		struct socket * s = socket_slot(ss, i);
 		int id = s->id;
 		struct socket_info temp;
 		if (query_info(s, &temp) && s->id == id) {
@@ -13,11 +13,17 @@
 #define SOCKET_EXIT 5
 #define SOCKET_UDP 6
 #define SOCKET_WARNING 7
+#define SOCKET_IDLE 10	// returned once before the poller waits for new events, the caller may flush what it holds
+#define SOCKET_WATERMARK 11	// ud is 1 when the send buffer reaches the high watermark (blocked), 0 when it falls to the low one
+#define SOCKET_FRAME 12	// ud bytes of whole packets (with their headers) of a framed socket, see socket_server_framing
 
 // Only for internal use
 #define SOCKET_RST 8
 #define SOCKET_MORE 9
 
+// a pooled read buffer keeps SOCKET_RECV_HEADER bytes before the data, for the message header of the caller
+#define SOCKET_RECV_HEADER 32
+
 struct socket_server;
 
 struct socket_message {
@@ -25,12 +31,16 @@ struct socket_message {
 	uintptr_t opaque; // 与本socket关联的服务地址，socket接收到的消息，最后将会传送到这个服务商
 	int ud;	// for accept, ud is new connection id ; for data, ud is size of data 
 	char * data;
+	int pooled;	// data is in a pooled block, or an accept of a listen socket with recvpool (see socket_server_recvpool)
 };
 
-struct socket_server * socket_server_create(uint64_t time);
+// each poller should be polled by its own thread, with socket_server_poll(ss, 0 .. poller-1, ...)
+// max_socket is rounded up to power of 2 (0 for default 65536), the slots are allocated on demand.
+// A listen socket accepts at most accept_batch connections for each event (0 for default 8).
+struct socket_server * socket_server_create(uint64_t time, int poller, int max_socket, int accept_batch);
 void socket_server_release(struct socket_server *);
 void socket_server_updatetime(struct socket_server *, uint64_t time);
-int socket_server_poll(struct socket_server *, struct socket_message *result, int *more);
+int socket_server_poll(struct socket_server *, int poller, struct socket_message *result, int *more);
 
 void socket_server_exit(struct socket_server *);
 void socket_server_close(struct socket_server *, uintptr_t opaque, int id);
@@ -44,11 +54,25 @@ int socket_server_send_lowpriority(struct socket_server *, struct socket_sendbuf
 
 // ctrl command below returns id
 int socket_server_listen(struct socket_server *, uintptr_t opaque, const char * addr, int port, int backlog);
+int socket_server_listen_reuseport(struct socket_server *, uintptr_t opaque, const char * addr, int port, int backlog);
 int socket_server_connect(struct socket_server *, uintptr_t opaque, const char * addr, int port);
 int socket_server_bind(struct socket_server *, uintptr_t opaque, int fd);
 
 // for tcp
 void socket_server_nodelay(struct socket_server *, int id);
+// read into the pooled fixed size blocks instead of a malloc per read, while the adaptive read size fits in a block.
+// The data of SOCKET_DATA should be released by socket_server_free_buffer then, it may point into the block.
+// For a listen socket, it marks the accepts as pooled: the owner can take them in a batch.
+void socket_server_recvpool(struct socket_server *, int id, int enable);
+// SOCKET_WATERMARK is reported when the unsent bytes reach high and when they fall to low again,
+// instead of SOCKET_WARNING. high = 0 disables them.
+void socket_server_watermark(struct socket_server *, int id, int high, int low);
+// Split the stream into packets of a 2 or 4 bytes big-endian length header (header = 0 disables it) in the socket thread.
+// The data comes as SOCKET_FRAME, only whole packets, and a packet larger than max raises SOCKET_ERR.
+// max <= 0 means 64K-1 for 2 bytes header, 16M-1 for 4. Set it before socket_server_start.
+void socket_server_framing(struct socket_server *, int id, int header, int max);
+// free the data of socket message, returns the pooled block (any address in it) to the pool.
+void socket_server_free_buffer(struct socket_server *, void *buffer);
 
 struct socket_udp_address;
 
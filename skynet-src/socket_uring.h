@@ -0,0 +1,489 @@
+#ifndef poll_socket_uring_h
+#define poll_socket_uring_h
+
+// io_uring backend of socket_poll.h, build with -DUSE_IO_URING (linux 5.5+).
+// Each added fd has one oneshot POLL_ADD in flight, it is armed again when its completion is
+// reaped, and all these submissions are flushed by the single io_uring_enter of the next sp_wait.
+// The poll is evaluated at submission, so the events are level triggered like epoll.
+//
+// A connected stream socket which only wants to read is read by IORING_OP_RECV instead (linux 5.19+),
+// into the buffers provided to the kernel by a buffer ring. The data is handed to socket_server in the
+// event (see struct event), and the buffer is given back at the next sp_wait. The RECV is armed after
+// the first sp_enable (socket.start, or the end of connecting), so an accepted socket is never read
+// before its owner starts it. While writing is wanted too, or the ring runs out of buffers (ENOBUFS),
+// the fd is polled and read by socket_server as before.
+
+#include "skynet_malloc.h"
+#include "spinlock.h"
+
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 4096
+#define URING_FD_SIZE 1024
+// the provided buffers, URING_BUF_COUNT should be power of 2
+#define URING_BUF_COUNT 256
+#define URING_BUF_SIZE 8192
+#define URING_BUF_GROUP 0
+
+struct sp_fd {
+	void * ud;
+	uint32_t gen;	// tag of the poll in flight, 0 means none
+	uint32_t rgen;	// tag of the recv in flight, 0 means none
+	uint16_t events;	// the events wanted
+	uint16_t pevents;	// the events of the poll in flight
+	uint8_t stream;	// connected stream socket, it can be read by RECV
+	uint8_t started;	// sp_enable is called
+	uint8_t fallback;	// the last RECV got no buffer, poll it until it's readable
+	uint8_t rcancel;	// the recv in flight is canceled
+};
+
+struct sp_uring {
+	int fd;
+	// the submission queue and the fd table, sp_add may be called by the socket thread of a listen socket
+	struct spinlock lock;
+	uint32_t gen;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	void * sq_ring;
+	size_t sq_ring_sz;
+	void * cq_ring;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+	int fd_cap;
+	struct sp_fd * fds;
+	// the buffer ring, NULL when the kernel doesn't support it. It's used by the thread of sp_wait only
+	struct io_uring_buf_ring * br;
+	char * bufs;
+	uint16_t br_tail;
+	int used_n;
+	uint16_t used[URING_BUF_COUNT];	// the buffers of the last events, returned by next sp_wait
+};
+
+static bool
+sp_invalid(struct sp_uring *u) {
+	return u == NULL;
+}
+
+static int
+uring_enter(int fd, unsigned submit, unsigned wait) {
+	return (int)syscall(__NR_io_uring_enter, fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static void
+sp_release(struct sp_uring *u) {
+	if (u->br) {
+		munmap(u->br, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+		skynet_free(u->bufs);
+	}
+	if (u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_sz);
+	if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_sz);
+	if (u->sq_ring != MAP_FAILED)
+		munmap(u->sq_ring, u->sq_ring_sz);
+	close(u->fd);
+	spinlock_destroy(&u->lock);
+	skynet_free(u->fds);
+	skynet_free(u);
+}
+
+// give the buffer back to the ring, the kernel sees it after uring_buf_commit
+static inline void
+uring_buf_put(struct sp_uring *u, uint16_t bid) {
+	struct io_uring_buf *b = &u->br->bufs[u->br_tail & (URING_BUF_COUNT - 1)];
+	b->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * URING_BUF_SIZE);
+	b->len = URING_BUF_SIZE;
+	b->bid = bid;
+	++u->br_tail;
+}
+
+static inline void
+uring_buf_commit(struct sp_uring *u) {
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static void
+uring_buf_init(struct sp_uring *u) {
+	void * ring = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED) {
+		return;
+	}
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ring;
+	reg.ring_entries = URING_BUF_COUNT;
+	reg.bgid = URING_BUF_GROUP;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		// before linux 5.19, poll only
+		munmap(ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+		return;
+	}
+	u->br = ring;
+	u->bufs = skynet_malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+	u->br_tail = 0;
+	int i;
+	for (i=0;i<URING_BUF_COUNT;i++) {
+		uring_buf_put(u, i);
+	}
+	uring_buf_commit(u);
+}
+
+static struct sp_uring *
+sp_create() {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct sp_uring *u = skynet_malloc(sizeof(*u));
+	memset(u, 0, sizeof(*u));
+	u->fd = fd;
+	spinlock_init(&u->lock);
+	u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_sz > u->sq_ring_sz)
+			u->sq_ring_sz = u->cq_ring_sz;
+		u->cq_ring_sz = u->sq_ring_sz;
+	}
+	u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	}
+	u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+		sp_release(u);
+		return NULL;
+	}
+	char * sq = u->sq_ring;
+	char * cq = u->cq_ring;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	// sqe i always sits in slot i of the array
+	unsigned *array = (unsigned *)(sq + p.sq_off.array);
+	unsigned i;
+	for (i=0;i<p.sq_entries;i++) {
+		array[i] = i;
+	}
+	u->gen = 0;
+	u->fd_cap = URING_FD_SIZE;
+	u->fds = skynet_malloc(u->fd_cap * sizeof(struct sp_fd));
+	memset(u->fds, 0, u->fd_cap * sizeof(struct sp_fd));
+	uring_buf_init(u);
+	return u;
+}
+
+// call it with lock
+static void
+uring_push(struct sp_uring *u, uint8_t opcode, int sock, uint16_t events, uint64_t addr, uint64_t user_data, uint8_t flags) {
+	unsigned tail = *u->sq_tail;
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+		// the queue is full, submit it now
+		uring_enter(u->fd, u->sq_entries, 0);
+	}
+	struct io_uring_sqe *sqe = &u->sqes[tail & u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = sock;
+	sqe->poll_events = events;
+	sqe->addr = addr;
+	sqe->user_data = user_data;
+	sqe->flags = flags;
+	if (flags & IOSQE_BUFFER_SELECT) {
+		sqe->buf_group = URING_BUF_GROUP;
+	}
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t
+uring_tag(int sock, uint32_t gen) {
+	return (uint64_t)sock << 32 | gen;
+}
+
+static inline uint32_t
+uring_gen(struct sp_uring *u) {
+	if (++u->gen == 0)
+		++u->gen;
+	return u->gen;
+}
+
+// call it with lock. Bring the poll and the recv in flight to the wanted events of the fd.
+// Unlike epoll, a poll without events would report POLLRDHUP again and again,
+// so it is not armed (as kqueue, which reports nothing when both filters are disabled).
+// At most one RECV is in flight, and POLLIN is not polled meanwhile, so the data is never read out of order.
+static void
+uring_arm(struct sp_uring *u, int sock, struct sp_fd *f) {
+	bool recv = u->br && f->stream && f->started && !f->fallback && f->events == POLLIN;
+	if (recv) {
+		if (f->rgen == 0) {
+			f->rgen = uring_gen(u);
+			f->rcancel = 0;
+			uring_push(u, IORING_OP_RECV, sock, 0, 0, uring_tag(sock, f->rgen), IOSQE_BUFFER_SELECT);
+		}
+	} else if (f->rgen && !f->rcancel) {
+		// the data it may still receive is delivered by its completion
+		f->rcancel = 1;
+		uring_push(u, IORING_OP_ASYNC_CANCEL, -1, 0, uring_tag(sock, f->rgen), 0, 0);
+	}
+	uint16_t events = f->events;
+	if (recv || f->rgen) {
+		events &= ~POLLIN;
+	}
+	if (f->gen && f->pevents != events) {
+		// its completion is dropped by the tag
+		uring_push(u, IORING_OP_POLL_REMOVE, -1, 0, uring_tag(sock, f->gen), 0, 0);
+		f->gen = 0;
+	}
+	if (f->gen == 0 && events) {
+		f->gen = uring_gen(u);
+		f->pevents = events;
+		uring_push(u, IORING_OP_POLL_ADD, sock, events, 0, uring_tag(sock, f->gen), 0);
+	}
+}
+
+// call it with lock, cancel the poll and the recv in flight. Their completions are dropped by the tags.
+static void
+uring_cancel(struct sp_uring *u, int sock, struct sp_fd *f) {
+	if (f->gen) {
+		uring_push(u, IORING_OP_POLL_REMOVE, -1, 0, uring_tag(sock, f->gen), 0, 0);
+		f->gen = 0;
+	}
+	if (f->rgen) {
+		if (!f->rcancel) {
+			uring_push(u, IORING_OP_ASYNC_CANCEL, -1, 0, uring_tag(sock, f->rgen), 0, 0);
+		}
+		f->rgen = 0;
+	}
+}
+
+// SO_ACCEPTCONN is false before listen, the fd of a listen socket is added after it
+static bool
+uring_stream(int sock) {
+	int v;
+	socklen_t len = sizeof(v);
+	if (getsockopt(sock, SOL_SOCKET, SO_TYPE, &v, &len) != 0 || v != SOCK_STREAM)
+		return false;
+	len = sizeof(v);
+	if (getsockopt(sock, SOL_SOCKET, SO_ACCEPTCONN, &v, &len) != 0 || v)
+		return false;
+	return true;
+}
+
+// call it with lock
+static struct sp_fd *
+uring_fd(struct sp_uring *u, int sock) {
+	if (sock >= u->fd_cap) {
+		int cap = u->fd_cap;
+		while (sock >= cap) {
+			cap *= 2;
+		}
+		u->fds = skynet_realloc(u->fds, cap * sizeof(struct sp_fd));
+		memset(u->fds + u->fd_cap, 0, (cap - u->fd_cap) * sizeof(struct sp_fd));
+		u->fd_cap = cap;
+	}
+	return &u->fds[sock];
+}
+
+static void
+sp_del(struct sp_uring *u, int sock) {
+	spinlock_lock(&u->lock);
+	if (sock < u->fd_cap) {
+		struct sp_fd *f = &u->fds[sock];
+		uring_cancel(u, sock, f);
+		f->ud = NULL;
+		f->events = 0;
+	}
+	spinlock_unlock(&u->lock);
+}
+
+static int
+sp_add(struct sp_uring *u, int sock, void *ud) {
+	bool stream = uring_stream(sock);
+	spinlock_lock(&u->lock);
+	struct sp_fd *f = uring_fd(u, sock);
+	uring_cancel(u, sock, f);
+	f->ud = ud;
+	f->events = POLLIN;
+	f->stream = stream;
+	f->started = 0;
+	f->fallback = 0;
+	uring_arm(u, sock, f);
+	spinlock_unlock(&u->lock);
+	return 0;
+}
+
+static int
+sp_enable(struct sp_uring *u, int sock, void *ud, bool read_enable, bool write_enable) {
+	spinlock_lock(&u->lock);
+	struct sp_fd *f = uring_fd(u, sock);
+	f->ud = ud;
+	f->events = (read_enable ? POLLIN : 0) | (write_enable ? POLLOUT : 0);
+	f->started = 1;
+	uring_arm(u, sock, f);
+	spinlock_unlock(&u->lock);
+	return 0;
+}
+
+// call it with lock, return true if it's an event
+static bool
+uring_recv(struct sp_uring *u, struct io_uring_cqe *cqe, int sock, struct sp_fd *f, struct event *e) {
+	int res = cqe->res;
+	f->rgen = 0;
+	bool event = true;
+	if (res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+		uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		u->used[u->used_n++] = bid;
+		e->recv_data = u->bufs + (size_t)bid * URING_BUF_SIZE;
+	} else {
+		e->recv_data = NULL;
+	}
+	switch (res) {
+	case -ECANCELED:
+		event = false;
+		break;
+	case -ENOBUFS:
+		f->fallback = 1;
+		event = false;
+		break;
+	case -ENOTCONN:
+	case -EINVAL:
+	case -EOPNOTSUPP:
+		// not a connected stream, poll it
+		f->stream = 0;
+		event = false;
+		break;
+	}
+	if (event) {
+		e->s = f->ud;
+		e->read = true;
+		e->write = false;
+		e->error = false;
+		e->eof = false;
+		e->recv = true;
+		e->recv_size = res;
+	}
+	uring_arm(u, sock, f);
+	return event;
+}
+
+static int
+sp_wait(struct sp_uring *u, struct event *e, int max) {
+	int n = 0;
+	int i;
+	if (u->br) {
+		// the data of the last events is handled
+		for (i=0;i<u->used_n;i++) {
+			uring_buf_put(u, u->used[i]);
+		}
+		u->used_n = 0;
+		uring_buf_commit(u);
+	}
+	while (n == 0) {
+		spinlock_lock(&u->lock);
+		unsigned submit = *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+		spinlock_unlock(&u->lock);
+		unsigned head = *u->cq_head;
+		unsigned wait = (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) ? 1 : 0;
+		if (submit || wait) {
+			if (uring_enter(u->fd, submit, wait) < 0) {
+				return -1;
+			}
+		}
+		spinlock_lock(&u->lock);
+		unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail && n < max) {
+			struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+			++head;
+			uint64_t tag = cqe->user_data;
+			int sock = (int)(tag >> 32);
+			if (tag == 0)
+				continue;
+			struct sp_fd *f = sock < u->fd_cap ? &u->fds[sock] : NULL;
+			if (f && f->rgen && f->rgen == (uint32_t)tag) {
+				if (uring_recv(u, cqe, sock, f, &e[n])) {
+					++n;
+				}
+				continue;
+			}
+			if (cqe->flags & IORING_CQE_F_BUFFER) {
+				// a stale recv, give its buffer back
+				uring_buf_put(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+				uring_buf_commit(u);
+			}
+			if (f == NULL || f->gen == 0 || f->gen != (uint32_t)tag) {
+				// removed or changed after it was submitted
+				continue;
+			}
+			f->gen = 0;
+			if (cqe->res < 0) {
+				// the fd is still added, poll it again
+				uring_arm(u, sock, f);
+				continue;
+			}
+			unsigned flag = cqe->res & (f->pevents | POLLERR | POLLHUP);
+			if (flag & POLLIN) {
+				// there are buffers now, or it's readable without them (eof)
+				f->fallback = 0;
+			}
+			if (flag == 0) {
+				uring_arm(u, sock, f);
+				continue;
+			}
+			e[n].s = f->ud;
+			e[n].write = (flag & POLLOUT) != 0;
+			e[n].read = (flag & POLLIN) != 0;
+			e[n].error = (flag & POLLERR) != 0;
+			e[n].eof = (flag & POLLHUP) != 0;
+			e[n].recv = false;
+			++n;
+			// submitted by next sp_wait, after these events are handled
+			uring_arm(u, sock, f);
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+		spinlock_unlock(&u->lock);
+	}
+
+	return n;
+}
+
+static void
+sp_nonblocking(int fd) {
+	int flag = fcntl(fd, F_GETFL, 0);
+	if ( -1 == flag ) {
+		return;
+	}
+
+	fcntl(fd, F_SETFL, flag | O_NONBLOCK);
+}
+
+#endif
@@ -0,0 +1,46 @@
+local skynet = require "skynet"
+
+-- The driver of the benchmarks in test (testtimerbench, testhandlebench, testmqbench).
+-- A benchmark is a service with a mode for its load services, the driver runs in the mode nil:
+--	package.path = SERVICE_PATH .. "?.lua;" .. package.path
+--	local bench = require "bench"
+
+local bench = {}
+
+-- call f(i) for i = 1..n in forked coroutines, return after all of them return
+function bench.fork(n, f)
+	local co = coroutine.running()
+	local done = 0
+	for i = 1, n do
+		skynet.fork(function()
+			f(i)
+			done = done + 1
+			if done == n then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait(co)
+end
+
+-- For each n in args.count, grow the pool of services (SERVICE_NAME, args.mode) to n,
+-- time args.round(pool, n) which returns the number of operations, and report the rate.
+-- args.finish(pool, n) runs after each round, out of the timing.
+function bench.run(args)
+	local pool = {}
+	for _, n in ipairs(args.count) do
+		for i = #pool + 1, n do
+			pool[i] = skynet.newservice(SERVICE_NAME, args.mode)
+		end
+		local start = skynet.hpc()
+		local ops = args.round(pool, n)
+		local ti = (skynet.hpc() - start) / 1000000000
+		skynet.error(string.format("%ss = %d, %s = %d, time = %.3fs, %d %s/s",
+			args.mode, n, args.unit, ops, ti, math.floor(ops / ti), args.unit))
+		if args.finish then
+			args.finish(pool, n)
+		end
+	end
+end
+
+return bench
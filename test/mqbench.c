@@ -0,0 +1,113 @@
+// Push/pop throughput of skynet_mq with 1..64 producer threads and one consumer, without the rest of skynet.
+// The consumer works like a worker: it pops a batch until the queue is empty, then waits the queue back
+// from the global queue (a producer pushes it there after in_global is cleared).
+//
+// make mqbench                                  (spinlock queue)
+// make mqbench SKYNET_DEFINES=-DUSE_LOCKFREE_MQ (lock free queue)
+// usage: ./mqbench [messages per round] [max producers]
+
+#include "skynet.h"
+#include "skynet_mq.h"
+#include "atomic.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BATCH 64
+
+struct producer {
+	pthread_t pid;
+	struct message_queue *q;
+	ATOM_INT *start;
+	int count;
+};
+
+static double
+now(void) {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return ti.tv_sec + ti.tv_nsec / 1e9;
+}
+
+static void *
+producer_thread(void *ud) {
+	struct producer *p = ud;
+	while (!ATOM_LOAD(p->start)) {
+		sched_yield();
+	}
+	struct skynet_message msg;
+	msg.source = 0;
+	msg.data = NULL;
+	msg.sz = 0;
+	int i;
+	for (i=0;i<p->count;i++) {
+		msg.session = i;
+		skynet_mq_push(p->q, &msg);
+	}
+	return NULL;
+}
+
+static void
+drop_message(struct skynet_message *msg, void *ud) {
+}
+
+static double
+round_time(int producers, int count) {
+	struct message_queue *q = skynet_mq_create(1);
+	struct producer p[producers];
+	ATOM_INT start;
+	ATOM_INIT(&start, 0);
+	int i;
+	for (i=0;i<producers;i++) {
+		p[i].q = q;
+		p[i].start = &start;
+		p[i].count = count / producers;
+		pthread_create(&p[i].pid, NULL, producer_thread, &p[i]);
+	}
+	int total = count / producers * producers;
+	int received = 0;
+	struct skynet_message msg[BATCH];
+	double ti = now();
+	ATOM_STORE(&start, 1);
+	while (received < total) {
+		int n = skynet_mq_pop_batch(q, msg, BATCH);
+		if (n > 0) {
+			received += n;
+			continue;
+		}
+		// q is in the global queue after the next push
+		while (skynet_globalmq_pop() != q) {
+			sched_yield();
+		}
+	}
+	ti = now() - ti;
+	for (i=0;i<producers;i++) {
+		pthread_join(p[i].pid, NULL);
+	}
+	// the last pop gets a message, so the consumer still owns q
+	skynet_mq_mark_release(q);
+	skynet_mq_release(q, drop_message, NULL);
+	return ti;
+}
+
+int
+main(int argc, char *argv[]) {
+	int count = argc > 1 ? atoi(argv[1]) : 4000000;
+	int max = argc > 2 ? atoi(argv[2]) : 64;
+	skynet_mq_init();
+#ifdef USE_LOCKFREE_MQ
+	printf("lock free queue\n");
+#else
+	printf("spinlock queue\n");
+#endif
+	int producers;
+	for (producers = 1; producers <= max; producers *= 2) {
+		double ti = round_time(producers, count);
+		printf("producers = %d, messages = %d, time = %.3fs, %.0f msgs/s\n",
+			producers, count / producers * producers, ti, count / producers * producers / ti);
+	}
+	return 0;
+}
@@ -0,0 +1,40 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.kill
+
+-- Create and kill short lived agents, set service_pool in config to reuse their contexts and queues.
+-- Messages to the address of a killed agent must not reach a new one.
+
+local mode = ...
+
+local COUNT = 2000
+
+if mode == "agent" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function()
+		skynet.ret(skynet.pack(skynet.self()))
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local last
+	local start = skynet.hpc()
+	for i = 1, COUNT do
+		local agent = skynet.newservice(SERVICE_NAME, "agent")
+		assert(agent ~= last)
+		assert(skynet.call(agent, "lua") == agent)
+		skynet.kill(agent)
+		if last then
+			assert(not pcall(skynet.call, last, "lua"))
+		end
+		last = agent
+	end
+	local ti = (skynet.hpc() - start) / 1000000000
+	skynet.error(string.format("service_pool = %s, %d agents, time = %.3fs, %.1fus per agent",
+		skynet.getenv "service_pool", COUNT, ti, ti * 1000000 / COUNT))
+	skynet.exit()
+end)
+
+end
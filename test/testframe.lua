@@ -0,0 +1,140 @@
+local skynet = require "skynet"
+
+-- The socket thread splits the stream by the length header (socket.framing), the client writes the packets
+-- in random fragments. The packets are checked by socket.read in this service, and by a gateserver (netpack).
+-- usage: testframe [count]
+
+local mode = ...
+
+local function packet(i, size)
+	return string.format("%06d", i) .. string.rep(string.char(65 + i % 26), size - 6)
+end
+
+local function check(i, str)
+	local n = tonumber(str:sub(1, 6))
+	return n == i and str == packet(i, #str)
+end
+
+if mode == "gate" then
+
+local gateserver = require "snax.gateserver"
+local netpack = require "skynet.netpack"
+
+local count = 0
+local bad = 0
+local handler = {}
+
+function handler.open(source, conf)
+	return conf.port
+end
+
+function handler.connect(fd, addr)
+	gateserver.openclient(fd)
+end
+
+function handler.message(fd, msg, sz)
+	count = count + 1
+	if not check(count, netpack.tostring(msg, sz)) then
+		bad = bad + 1
+	end
+end
+
+function handler.command(cmd)
+	assert(cmd == "stat")
+	return count, bad
+end
+
+gateserver.start(handler)
+
+else
+
+-- gateserver registers the socket protocol itself, so it's required here
+local socket = require "skynet.socket"
+local driver = require "skynet.socketdriver"
+require "skynet.manager"	-- skynet.kill
+
+local COUNT = tonumber(mode) or 2000
+
+-- write the stream in random pieces, so the headers and the packets are cut by the reads
+local function send_fragments(fd, stream)
+	local i = 1
+	while i <= #stream do
+		local n = math.random(1, 8192)
+		socket.write(fd, stream:sub(i, i + n - 1))
+		i = i + n
+		if math.random(4) == 1 then
+			skynet.sleep(0)
+		end
+	end
+end
+
+local function test_socket(max)
+	local lid, _, port = socket.listen("127.0.0.1", 0)
+	local received = 0
+	local closed = false
+	socket.start(lid, function(id)
+		socket.framing(id, 4, max)
+		socket.start(id)
+		while true do
+			local header = socket.read(id, 4)
+			if not header then
+				break
+			end
+			local str = assert(socket.read(id, string.unpack(">I4", header)))
+			received = received + 1
+			assert(check(received, str), received)
+		end
+		closed = true
+		socket.close(id)
+	end)
+	local fd = assert(socket.open("127.0.0.1", port))
+	driver.nodelay(fd)
+	local stream = {}
+	for i = 1, COUNT do
+		local p = packet(i, math.random(6, i % 10 == 0 and max or 1000))
+		stream[i] = string.pack(">s4", p)
+	end
+	send_fragments(fd, table.concat(stream))
+	while received < COUNT do
+		skynet.sleep(1)
+	end
+	skynet.error(string.format("socket : %d packets, 4 bytes header, max = %d", received, max))
+	-- a packet larger than max is an error
+	socket.write(fd, string.pack(">I4", max + 1) .. string.rep("x", max + 1))
+	while not closed do
+		skynet.sleep(1)
+	end
+	skynet.error("socket : the packet larger than max is refused")
+	socket.close(fd)
+	socket.close(lid)
+end
+
+local function test_gate()
+	local gate = skynet.newservice(SERVICE_NAME, "gate")
+	local port = skynet.call(gate, "lua", "open", { address = "127.0.0.1", port = 0 })
+	local fd = assert(socket.open("127.0.0.1", port))
+	driver.nodelay(fd)
+	local stream = {}
+	for i = 1, COUNT do
+		local p = packet(i, math.random(6, 4096))
+		stream[i] = string.pack(">s2", p)
+	end
+	send_fragments(fd, table.concat(stream))
+	local count, bad
+	repeat
+		skynet.sleep(1)
+		count, bad = skynet.call(gate, "lua", "stat")
+	until count == COUNT
+	skynet.error(string.format("gate : %d packets, %d bad", count, bad))
+	assert(bad == 0)
+	socket.close(fd)
+	skynet.kill(gate)
+end
+
+skynet.start(function()
+	test_socket(100000)	-- larger than 64K, the 4 bytes header
+	test_gate()
+	skynet.exit()
+end)
+
+end
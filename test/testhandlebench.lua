@@ -0,0 +1,60 @@
+local skynet = require "skynet"
+
+-- Handle lookups per second with 1..64 services sending at the same time.
+-- Each send to a local address grabs the context of destination (skynet_handle_grab) and releases it
+-- after the push. The destination is a sink service dropping the messages, all the senders share it.
+-- Set thread in config to compare different number of worker threads.
+
+local mode = ...
+
+local COUNT = 1000000	-- lookups per round
+
+if mode == "sink" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(session)
+		-- a call waits the messages sent before it are dropped
+		if session ~= 0 then
+			skynet.ret()
+		end
+	end)
+end)
+
+elseif mode == "sender" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, dest, n)
+		local send = skynet.rawsend
+		for i = 1, n do
+			send(dest, "lua", "")
+		end
+		skynet.ret()
+	end)
+end)
+
+else
+
+package.path = SERVICE_PATH .. "?.lua;" .. package.path
+local bench = require "bench"
+
+skynet.start(function()
+	local sink = skynet.newservice(SERVICE_NAME, "sink")
+	bench.run {
+		mode = "sender",
+		unit = "grabs",
+		count = { 1, 2, 4, 8, 16, 32, 64 },
+		round = function(senders, n)
+			local each = COUNT // n
+			bench.fork(n, function(i)
+				skynet.call(senders[i], "lua", sink, each)
+			end)
+			return each * n
+		end,
+		finish = function()
+			skynet.call(sink, "lua")
+		end,
+	}
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,45 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+
+-- Hold N loopback connections (2N sockets) at once, the slot table grows on demand up to max_socket in config.
+-- Each fd needs a file descriptor, so raise ulimit -n first.
+-- usage: testmaxsocket [n]
+
+local N = tonumber((...)) or 3000
+
+skynet.start(function()
+	local lid, _, port = socket.listen("127.0.0.1", 0)
+	local accepted = {}
+	local n = 0
+	socket.start(lid, function(id)
+		accepted[id] = true
+		n = n + 1
+	end)
+	local clients = {}
+	local start = skynet.hpc()
+	for i = 1, N do
+		local fd = socket.open("127.0.0.1", port)
+		if not fd then
+			skynet.error("open failed after", i - 1, "connections")
+			break
+		end
+		clients[i] = fd
+	end
+	-- the accepted connections are closed when the slot table is full, so give up after 1s without progress
+	local idle = 0
+	while n < #clients and idle < 100 do
+		local last = n
+		skynet.sleep(1)
+		idle = (n == last) and idle + 1 or 0
+	end
+	local ti = (skynet.hpc() - start) / 1000000
+	skynet.error(string.format("connections = %d, accepted = %d, sockets = %d, time = %.1fms", #clients, n, #socket.netstat(), ti))
+	for _, fd in ipairs(clients) do
+		socket.close(fd)
+	end
+	for id in pairs(accepted) do
+		socket.close(id)
+	end
+	socket.close(lid)
+	skynet.exit()
+end)
@@ -0,0 +1,72 @@
+local skynet = require "skynet"
+
+-- Message queue push/pop throughput with 1..64 producers sending to one consumer.
+-- Build with -DUSE_LOCKFREE_MQ (see Makefile) to compare the lock free queue with the spinlock one.
+-- It measures the whole path of skynet.send, test/mqbench.c (make mqbench) measures the queue alone.
+
+local mode = ...
+
+local COUNT = 200000	-- messages per round
+
+if mode == "consumer" then
+
+local expect = 0
+local count = 0
+local co
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, cmd, n)
+		if cmd == "wait" then
+			expect = n
+			if count < expect then
+				co = coroutine.running()
+				skynet.wait(co)
+			end
+			count = 0
+			skynet.ret()
+		else
+			count = count + 1
+			if count == expect and co then
+				local c = co
+				co = nil
+				skynet.wakeup(c)
+			end
+		end
+	end)
+end)
+
+elseif mode == "producer" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, consumer, n)
+		for i = 1, n do
+			skynet.send(consumer, "lua")
+		end
+		skynet.ret()
+	end)
+end)
+
+else
+
+package.path = SERVICE_PATH .. "?.lua;" .. package.path
+local bench = require "bench"
+
+skynet.start(function()
+	local consumer = skynet.newservice(SERVICE_NAME, "consumer")
+	bench.run {
+		mode = "producer",
+		unit = "messages",
+		count = { 1, 2, 4, 8, 16, 32, 64 },
+		round = function(producers, n)
+			local each = COUNT // n
+			for i = 1, n do
+				skynet.send(producers[i], "lua", consumer, each)
+			end
+			skynet.call(consumer, "lua", "wait", each * n)
+			return each * n
+		end,
+	}
+	skynet.exit()
+end)
+
+end
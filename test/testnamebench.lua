@@ -0,0 +1,91 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.name
+local core = require "skynet.core"
+
+-- Register many local names, resolve them with skynet.localname, and check they are removed when the service exits.
+-- Then send to a name repeatedly (resolved by the cache in skynet_sendname) and move the name to another service.
+
+local COUNT = 20000
+
+local mode = ...
+
+if mode == "agent" then
+
+local count = 0
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, cmd)
+		if cmd == "count" then
+			skynet.ret(skynet.pack(count))
+		elseif cmd == nil then
+			skynet.ret()
+		else
+			count = count + 1
+		end
+	end)
+end)
+
+else
+
+local function count_names(prefix)
+	local n = 0
+	for _, v in ipairs(core.names()) do
+		if v[1]:sub(1, #prefix) == prefix then
+			n = n + 1
+		end
+	end
+	return n
+end
+
+skynet.start(function()
+	local agent = skynet.newservice(SERVICE_NAME, "agent")
+	local start = skynet.hpc()
+	for i = 1, COUNT do
+		skynet.name(".agent" .. i, agent)
+	end
+	local ti = (skynet.hpc() - start) / 1000000000
+	skynet.error(string.format("register %d names, time = %.3fs", COUNT, ti))
+
+	start = skynet.hpc()
+	for i = 1, COUNT do
+		assert(skynet.localname(".agent" .. i) == agent)
+	end
+	ti = (skynet.hpc() - start) / 1000000000
+	skynet.error(string.format("resolve %d names, time = %.3fs", COUNT, ti))
+	assert(skynet.localname(".agent0") == nil)
+
+	-- names are listed in sorted order
+	local list = core.names()
+	for i = 2, #list do
+		assert(list[i-1][1] < list[i][1])
+	end
+	assert(count_names("agent") == COUNT)
+
+	skynet.call(agent, "lua")
+	skynet.kill(agent)
+	assert(skynet.localname(".agent1") == nil)
+	assert(count_names("agent") == 0)
+	skynet.error("names removed")
+
+	local a = skynet.newservice(SERVICE_NAME, "agent")
+	skynet.name(".target", a)
+	start = skynet.hpc()
+	for i = 1, COUNT do
+		skynet.send(".target", "lua", "inc")
+	end
+	ti = (skynet.hpc() - start) / 1000000000
+	skynet.error(string.format("send %d messages to .target, time = %.3fs", COUNT, ti))
+	assert(skynet.call(a, "lua", "count") == COUNT)
+	skynet.kill(a)
+	-- the cached name is invalid after the service exits
+	assert(skynet.send(".target", "lua", "inc") == nil)
+	local b = skynet.newservice(SERVICE_NAME, "agent")
+	skynet.name(".target", b)
+	skynet.send(".target", "lua", "inc")
+	assert(skynet.call(b, "lua", "count") == 1)
+	skynet.kill(b)
+	skynet.error("name moved")
+	skynet.exit()
+end)
+
+end
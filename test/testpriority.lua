@@ -0,0 +1,94 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.kill
+
+-- Latency of calls to a service while background services are busy, with normal and high priority.
+-- The caller is high priority, so only the priority of the callee differs.
+-- 1. A high priority service answers in a few busy messages under a normal priority flood (reported only).
+-- 2. A normal priority service still answers under a high priority flood (starvation protection, asserted).
+
+local mode, arg = ...
+
+local function work()
+	local s = 0
+	for i = 1, 100000 do
+		s = s + i
+	end
+	return s
+end
+
+if mode == "busy" then
+
+skynet.start(function()
+	skynet.priority(arg == "high")
+	skynet.dispatch("lua", function(_,_, n)
+		work()
+		if n > 1 then
+			skynet.send(skynet.self(), "lua", n - 1)
+		end
+	end)
+end)
+
+elseif mode == "ping" then
+
+skynet.start(function()
+	skynet.priority(arg == "high")
+	skynet.dispatch("lua", function()
+		skynet.ret()
+	end)
+end)
+
+else
+
+-- time of one busy message, in ms
+local function calibrate()
+	local start = skynet.hpc()
+	for i = 1, 10 do
+		work()
+	end
+	return (skynet.hpc() - start) / 10 / 1000000
+end
+
+local function test(priority, flood)
+	local ping = skynet.newservice(SERVICE_NAME, "ping", priority)
+	local busy = {}
+	for i = 1, 16 do
+		busy[i] = skynet.newservice(SERVICE_NAME, "busy", flood)
+		for j = 1, 8 do
+			skynet.send(busy[i], "lua", 200)
+		end
+	end
+	local total, max = 0, 0
+	for i = 1, 100 do
+		local start = skynet.hpc()
+		skynet.call(ping, "lua")
+		local ti = (skynet.hpc() - start) / 1000000
+		total = total + ti
+		if ti > max then
+			max = ti
+		end
+		skynet.sleep(1)
+	end
+	local avg = total / 100
+	skynet.error(string.format("priority = %s, flood = %s, avg = %.3fms, max = %.3fms", priority, flood, avg, max))
+	for _, addr in ipairs(busy) do
+		skynet.kill(addr)
+	end
+	skynet.kill(ping)
+	return avg, max
+end
+
+skynet.start(function()
+	skynet.priority(true)
+	local cost = calibrate()
+	skynet.error(string.format("busy message = %.3fms", cost))
+	-- the latencies depend on the load of the machine, so they are only reported
+	local normal_avg = test("normal", "normal")
+	local high_avg, high_max = test("high", "normal")
+	skynet.error(string.format("high / normal avg = %.2f, high max = %.1f busy messages", high_avg / normal_avg, high_max / cost))
+	-- each flood is about 16 * 8 * 200 busy messages, a starved service waits for most of them
+	local _, starved_max = test("normal", "high")
+	assert(starved_max < cost * 16 * 8 * 200 / 2, "normal priority is starved")
+	skynet.exit()
+end)
+
+end
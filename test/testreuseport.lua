@@ -0,0 +1,42 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+
+-- Open N listen sockets on the same port with SO_REUSEPORT, and count the accepts of each one.
+-- usage: testreuseport [listener] [connection]
+
+local N, M = ...
+N = tonumber(N) or 4
+M = tonumber(M) or 1000
+
+skynet.start(function()
+	local listeners = {}
+	local count = {}
+	local port = 0
+	local accepted = 0
+	for i = 1, N do
+		local lid, _, p = socket.listen("127.0.0.1", port, nil, true)
+		port = p
+		listeners[i] = lid
+		count[i] = 0
+		socket.start(lid, function(id)
+			count[i] = count[i] + 1
+			accepted = accepted + 1
+			socket.close(id)
+		end)
+	end
+	local clients = {}
+	for i = 1, M do
+		clients[i] = assert(socket.open("127.0.0.1", port))
+	end
+	while accepted < M do
+		skynet.sleep(1)
+	end
+	skynet.error(string.format("port = %d, accepts = %s", port, table.concat(count, " ")))
+	for _, fd in ipairs(clients) do
+		socket.close(fd)
+	end
+	for _, lid in ipairs(listeners) do
+		socket.close(lid)
+	end
+	skynet.exit()
+end)
@@ -0,0 +1,61 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+local driver = require "skynet.socketdriver"
+
+-- The data to a busy service is coalesced into BATCH messages by the socket thread (see skynet_socket.c).
+-- The batch should be flushed before the socket thread waits for new events, even if the last events and
+-- requests give no message, or the data here is held until some other socket event comes.
+-- usage: testsocketbatch [packets] [busy ms]
+
+local N, BUSY = ...
+N = tonumber(N) or 64
+BUSY = tonumber(BUSY) or 200
+
+local received = 0
+
+local function busy(ms)
+	local ti = os.clock() + ms / 1000
+	while os.clock() < ti do end
+end
+
+skynet.start(function()
+	local lid, _, port = socket.listen("127.0.0.1", 0)
+	local started = false
+	socket.start(lid, function(id)
+		socket.start(id)
+		started = true
+		while true do
+			local str = socket.read(id)
+			if not str then
+				break
+			end
+			received = received + #str
+		end
+		socket.close(id)
+	end)
+	local fd = assert(socket.open("127.0.0.1", port))
+	driver.nodelay(fd)
+	while not started do
+		skynet.sleep(1)
+	end
+	local packet = string.rep("x", 100)
+	for round = 1, 4 do
+		local total = received + N * #packet
+		for i = 1, N do
+			socket.write(fd, packet)
+		end
+		-- a request without message, after the data
+		driver.nodelay(fd)
+		-- keep the service busy, so the socket thread batches the data to it
+		busy(BUSY)
+		local ti = skynet.now()
+		while received < total do
+			assert(skynet.now() - ti < 100, "the batch is held by the socket thread")
+			skynet.sleep(1)
+		end
+		skynet.error(string.format("round %d : %d bytes in %d ticks", round, received, skynet.now() - ti))
+	end
+	socket.close(fd)
+	socket.close(lid)
+	skynet.exit()
+end)
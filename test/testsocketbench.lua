@@ -0,0 +1,98 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+local driver = require "skynet.socketdriver"	-- for nodelay
+
+-- Echo throughput over loopback: CLIENTS connections, each sends COUNT packets of SIZE bytes and reads them back,
+-- one by one (pingpong) or all at once (pipeline). "writes" is the number of write syscalls of the client sockets.
+-- usage: testsocketbench [clients] [count] [size]
+
+local CLIENTS, COUNT, SIZE = ...
+CLIENTS = tonumber(CLIENTS) or 16
+COUNT = tonumber(COUNT) or 2000
+SIZE = tonumber(SIZE) or 100
+
+local stall = 0	-- the echo side waits before reading, so the packets pile up in the send lists
+
+local function echo(id)
+	socket.start(id)
+	driver.nodelay(id)
+	if stall > 0 then
+		skynet.sleep(stall)
+	end
+	while true do
+		local str = socket.read(id)
+		if not str then
+			break
+		end
+		socket.write(id, str)
+	end
+	socket.close(id)
+end
+
+local function client(port, pipeline)
+	local fd = assert(socket.open("127.0.0.1", port))
+	driver.nodelay(fd)
+	if pipeline then
+		-- write all the packets at once, they pile up in the send lists of both ends
+		local packets = {}
+		for j = 1, COUNT do
+			local p = string.format("%08d", j) .. string.rep("x", SIZE - 8)
+			packets[j] = p
+			socket.write(fd, p)
+		end
+		assert(socket.read(fd, SIZE * COUNT) == table.concat(packets))
+	else
+		local packet = string.rep("x", SIZE)
+		for j = 1, COUNT do
+			socket.write(fd, packet)
+			assert(socket.read(fd, SIZE) == packet)
+		end
+	end
+	return fd
+end
+
+local function wcall(fds)
+	local n = 0
+	for _, info in ipairs(socket.netstat()) do
+		if fds[info.id] then
+			n = n + info.wcall
+		end
+	end
+	return n
+end
+
+local function bench(port, pipeline)
+	local done = 0
+	local fds = {}
+	local start = skynet.hpc()
+	for i = 1, CLIENTS do
+		skynet.fork(function()
+			local fd = client(port, pipeline)
+			fds[fd] = true
+			done = done + 1
+		end)
+	end
+	while done < CLIENTS do
+		skynet.sleep(1)
+	end
+	local ti = (skynet.hpc() - start) / 1000000000
+	local bytes = CLIENTS * COUNT * SIZE * 2
+	skynet.error(string.format("%s clients = %d, packets = %d, size = %d, time = %.3fs, %d packets/s, %.2f MB/s, %d writes",
+		pipeline and "pipeline" or "pingpong", CLIENTS, CLIENTS * COUNT, SIZE, ti, math.floor(CLIENTS * COUNT / ti), bytes / ti / 1048576, wcall(fds)))
+	for fd in pairs(fds) do
+		socket.close(fd)
+	end
+end
+
+skynet.start(function()
+	local lid, _, port = socket.listen("127.0.0.1", 0)
+	socket.start(lid, function(id)
+		skynet.fork(echo, id)
+	end)
+	SIZE = math.max(SIZE, 8)
+	bench(port, false)
+	stall = 10
+	bench(port, true)
+	socket.close(lid)
+	skynet.exit()
+end)
@@ -24,7 +24,78 @@ local function test()
 	end
 end
 
+-- timeouts expire at the same tick are delivered in one message
+local function test_batch()
+	local n = 0
+	for i=1,100 do
+		skynet.timeout(5, function() n = n + 1 end)
+	end
+	skynet.sleep(10)
+	print("test batch timeout", n)
+	assert(n == 100)
+end
+
+-- an error in one callback doesn't drop the other timeouts of the batch,
+-- and the timeouts of the same tick expire in the order they were armed
+local function test_batch_error()
+	local order = {}
+	skynet.timeout(5, function() error "test batch error" end)
+	for i=1,10 do
+		skynet.timeout(5, function() order[#order+1] = i end)
+	end
+	skynet.sleep(10)
+	print("test batch error, fired", #order)
+	assert(#order == 10)
+	for i=1,10 do
+		assert(order[i] == i)
+	end
+end
+
+-- a sleep woken early cancels its timer, the node is unlinked from the wheel
+-- and the other timers of the same tick still expire
+local function test_cancel()
+	local N = 200
+	local co = {}
+	local result = {}
+	local done = 0
+	local parent = coroutine.running()
+	for i=1,N do
+		skynet.fork(function()
+			co[i] = coroutine.running()
+			result[i] = skynet.sleep(20)
+			done = done + 1
+			if done == N then
+				skynet.wakeup(parent)
+			end
+		end)
+	end
+	skynet.yield()
+	for i=1,N,2 do
+		skynet.wakeup(co[i])
+	end
+	skynet.wait(parent)
+	for i=1,N do
+		assert(result[i] == (i % 2 == 1 and "BREAK" or nil), i)
+	end
+	print("test cancel timeout", N // 2)
+end
+
+-- set timer_tick = 1 in config for millisecond precision
+local function test_ms()
+	local co = coroutine.running()
+	for _, ti in ipairs { 1, 3, 15 } do
+		local start = skynet.hpc()
+		skynet.timeout_ms(ti, function() skynet.wakeup(co) end)
+		skynet.wait(co)
+		print(string.format("test timeout_ms %d : %.3fms", ti, (skynet.hpc() - start) / 1000000))
+	end
+end
+
 skynet.start(function()
+	test_batch()
+	test_batch_error()
+	test_cancel()
+	test_ms()
 	skynet.trace_timeout(true)	-- trun on trace for timeout, skynet.task will returns more info.
 	test()
 
@@ -0,0 +1,50 @@
+local skynet = require "skynet"
+
+-- Timeouts per second with 8, 32 and 64 services (workers below) arming timers at the same time.
+-- The worker threads are set by thread in config, run it with thread = 8, 32 and 64 to compare them.
+
+local mode = ...
+
+local COUNT = 20000	-- timeouts per service
+
+if mode == "worker" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, n)
+		local co = coroutine.running()
+		local fired = 0
+		local function timeout()
+			fired = fired + 1
+			if fired == n then
+				skynet.wakeup(co)
+			end
+		end
+		for i = 1, n do
+			skynet.timeout(i % 10 + 1, timeout)
+		end
+		skynet.wait(co)
+		skynet.ret()
+	end)
+end)
+
+else
+
+package.path = SERVICE_PATH .. "?.lua;" .. package.path
+local bench = require "bench"
+
+skynet.start(function()
+	bench.run {
+		mode = "worker",
+		unit = "timeouts",
+		count = { 8, 32, 64 },
+		round = function(workers, n)
+			bench.fork(n, function(i)
+				skynet.call(workers[i], "lua", COUNT)
+			end)
+			return n * COUNT
+		end,
+	}
+	skynet.exit()
+end)
+
+end
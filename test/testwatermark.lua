@@ -0,0 +1,78 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+
+-- The server doesn't read for a while, so the client's send buffer grows up to the high watermark.
+-- The client throttles itself by socket.wait_writable, the unsent bytes stay between low and high.
+-- usage: testwatermark [total bytes] [high] [low]
+
+local TOTAL, HIGH, LOW = ...
+TOTAL = tonumber(TOTAL) or 16 * 1024 * 1024
+HIGH = tonumber(HIGH) or 64 * 1024
+LOW = tonumber(LOW) or 16 * 1024
+
+local CHUNK = 4096
+local received = 0
+
+local function server(id)
+	socket.start(id)
+	skynet.sleep(100)	-- let the data pile up in the client
+	skynet.error("server start reading")
+	while true do
+		local str = socket.read(id)
+		if not str then
+			break
+		end
+		received = received + #str
+	end
+	socket.close(id)
+end
+
+local function wbuffer(fd)
+	for _, info in ipairs(socket.netstat()) do
+		if info.id == fd then
+			return info.wbuffer
+		end
+	end
+	return 0
+end
+
+local function client(port)
+	local fd = assert(socket.open("127.0.0.1", port))
+	socket.watermark(fd, HIGH, LOW)
+	local chunk = string.rep("x", CHUNK)
+	local sent = 0
+	local wait = 0
+	local peak = 0
+	while sent < TOTAL do
+		local ti = skynet.now()
+		if not socket.wait_writable(fd) then
+			error "socket closed"
+		end
+		if skynet.now() > ti then
+			wait = wait + 1
+		end
+		socket.write(fd, chunk)
+		sent = sent + CHUNK
+		peak = math.max(peak, wbuffer(fd))
+		skynet.yield()	-- the producer runs by messages, the watermark events come between them
+	end
+	skynet.error(string.format("sent %d bytes, waited %d times, peak wbuffer = %d", sent, wait, peak))
+	-- the blocked event is asynchronous, a few chunks may be written before it arrives
+	assert(peak < HIGH * 2, "watermark doesn't hold the send buffer")
+	socket.close(fd)
+	return sent
+end
+
+skynet.start(function()
+	local lid, _, port = socket.listen("127.0.0.1", 0)
+	socket.start(lid, function(id)
+		skynet.fork(server, id)
+	end)
+	local sent = client(port)
+	while received < sent do
+		skynet.sleep(1)
+	end
+	skynet.error(string.format("received %d bytes", received))
+	socket.close(lid)
+	skynet.exit()
+end)